@@ -0,0 +1,157 @@
+//
+//  CCPomeloCallback.h
+//
+//  Created by laoyur@126.com on 13-11-22.
+//
+//  Callback storage of CCPomeloWrapper for cocos2dx 3.x, included by CCPomeloWrapper.h.
+//  Needs C++11 only, not cocos2d-x.
+
+#ifndef __CCPomeloCallback__
+#define __CCPomeloCallback__
+
+#include <stddef.h>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ 回调对象：小于6个指针大小的lambda直接存放在对象内部，不分配堆内存。
+ How the wrapper keeps callbacks of the request, notify and event paths:
+ callables up to the size of 6 pointers (a lambda capturing a few pointers, or
+ a std::function) are stored inline instead of on the heap. Moving never
+ allocates, which the wrapper does all along the way. Move only, so it may
+ hold move only callables (a lambda owning a std::unique_ptr...); pass it on
+ with std::move(). The public callback types stay std::function, only
+ PomeloTask is one of these.
+ */
+template <typename Signature> class CCPomeloCallback;
+
+template <typename R, typename... Args>
+class CCPomeloCallback<R(Args...)>
+{
+    union Storage
+    {
+        void* heap;
+        unsigned char inlined[6 * sizeof(void*)];
+        long double alignDouble;
+        void (*alignFunction)();
+    };
+    
+    struct Ops
+    {
+        R (*invoke)(Storage* storage, Args&&... args);
+        void (*move)(Storage* to, Storage* from);           //from is destroyed
+        void (*destroy)(Storage* storage);
+    };
+    
+    template <typename F>
+    struct Inline
+    {
+        static F* get(Storage* storage) { return reinterpret_cast<F*>(storage->inlined); }
+        static R invoke(Storage* storage, Args&&... args) { return (*get(storage))(std::forward<Args>(args)...); }
+        static void move(Storage* to, Storage* from) { new (to->inlined) F(std::move(*get(from))); destroy(from); }
+        static void destroy(Storage* storage) { get(storage)->~F(); }
+    };
+    
+    template <typename F>
+    struct Heap
+    {
+        static F* get(Storage* storage) { return static_cast<F*>(storage->heap); }
+        static R invoke(Storage* storage, Args&&... args) { return (*get(storage))(std::forward<Args>(args)...); }
+        static void move(Storage* to, Storage* from) { to->heap = from->heap; }
+        static void destroy(Storage* storage) { delete get(storage); }
+    };
+    
+    template <typename Impl>
+    static const Ops* opsOf()
+    {
+        static const Ops ops = { &Impl::invoke, &Impl::move, &Impl::destroy };
+        return &ops;
+    }
+    
+    //empty std::function or function pointer: no callback
+    template <typename F>
+    static bool isEmpty(const F&) { return false; }
+    template <typename S>
+    static bool isEmpty(const std::function<S>& f) { return !f; }
+    template <typename F>
+    static bool isEmpty(F* f) { return f == NULL; }
+    
+public:
+    CCPomeloCallback() : mOps(NULL) {}
+    CCPomeloCallback(std::nullptr_t) : mOps(NULL) {}
+    
+    template <typename F, typename Callable = typename std::decay<F>::type,
+              typename = typename std::enable_if<!std::is_same<Callable, CCPomeloCallback>::value>::type,
+              typename = decltype(std::declval<Callable&>()(std::declval<Args>()...))>
+    CCPomeloCallback(F&& f) : mOps(NULL)
+    {
+        if(isEmpty(f))
+            return;
+        
+        const bool fits = sizeof(Callable) <= sizeof(Storage) && alignof(Callable) <= alignof(Storage)
+                          && std::is_nothrow_move_constructible<Callable>::value;
+        if(fits)
+        {
+            new (mStorage.inlined) Callable(std::forward<F>(f));
+            mOps = opsOf<Inline<Callable> >();
+        }
+        else
+        {
+            mStorage.heap = new Callable(std::forward<F>(f));
+            mOps = opsOf<Heap<Callable> >();
+        }
+    }
+    
+    CCPomeloCallback(const CCPomeloCallback&) = delete;
+    CCPomeloCallback& operator=(const CCPomeloCallback&) = delete;
+    CCPomeloCallback(CCPomeloCallback&& other) noexcept : mOps(NULL) { take(other); }
+    ~CCPomeloCallback() { reset(); }
+    
+    CCPomeloCallback& operator=(CCPomeloCallback&& other)
+    {
+        if(this != &other)
+        {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+    CCPomeloCallback& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+    
+    explicit operator bool() const { return mOps != NULL; }
+    
+    R operator()(Args... args) const
+    {
+        return mOps->invoke(const_cast<Storage*>(&mStorage), std::forward<Args>(args)...);
+    }
+    
+private:
+    void take(CCPomeloCallback& other)
+    {
+        if(other.mOps)
+        {
+            other.mOps->move(&mStorage, &other.mStorage);
+            mOps = other.mOps;
+            other.mOps = NULL;
+        }
+    }
+    void reset()
+    {
+        if(mOps)
+        {
+            mOps->destroy(&mStorage);
+            mOps = NULL;
+        }
+    }
+    
+    Storage mStorage;
+    const Ops* mOps;
+};
+
+#endif /* defined(__CCPomeloCallback__) */
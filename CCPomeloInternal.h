@@ -0,0 +1,1302 @@
+//
+//  CCPomeloInternal.h
+//
+//  Created by laoyur@126.com on 13-11-22.
+//
+//  Pieces of CCPomeloWrapper.cpp that need neither cocos2d-x nor libpomelo,
+//  so test/ can build them on their own. Not a public header.
+//  CCPomeloWrapper.cpp的内部实现，不依赖cocos2d-x与libpomelo，供test/单独编译。
+
+#ifndef __CCPomeloInternal__
+#define __CCPomeloInternal__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#ifndef POMELO_OUTBOX_SUPPORTED
+#if defined(_WIN32)
+#define POMELO_OUTBOX_SUPPORTED 0
+#else
+#define POMELO_OUTBOX_SUPPORTED 1
+#endif
+#endif
+#if POMELO_OUTBOX_SUPPORTED
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifndef CCPOMELO_FAST_JSON_WRITER
+#define CCPOMELO_FAST_JSON_WRITER 0 //-DCCPOMELO_FAST_JSON_WRITER=1 to replace jansson's dumper, see writeJson()
+#endif
+#ifndef CCPOMELO_FAST_JSON_PARSER
+#define CCPOMELO_FAST_JSON_PARSER 0 //-DCCPOMELO_FAST_JSON_PARSER=1 to replace jansson's parser, see readJson()
+#endif
+#include "jansson.h"
+#include "zlib.h"
+
+//==================== body compression ====================
+/*
+ Large bodies may travel as {"__zip":"<base64 of zlib stream>","__len":<raw size>}.
+ The client packs outgoing bodies of routes enabled by setCompression(), and
+ unpacks every incoming envelope on libpomelo thread, so a server side filter
+ can decide on its own which responses/pushes are worth compressing.
+ */
+#define POMELO_ZIP_KEY "__zip"
+#define POMELO_ZIP_LEN_KEY "__len"
+//__len comes from the wire: anything above is refused instead of allocated
+static const json_int_t kMaxUnzippedSize = 64 * 1024 * 1024;
+
+static const char kBase64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline void base64Encode(const unsigned char* in, size_t len, std::string& out)
+{
+    out.clear();
+    out.reserve((len + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < len; i += 3)
+    {
+        unsigned int v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out += kBase64Chars[(v >> 18) & 0x3f];
+        out += kBase64Chars[(v >> 12) & 0x3f];
+        out += kBase64Chars[(v >> 6) & 0x3f];
+        out += kBase64Chars[v & 0x3f];
+    }
+    if(i < len)
+    {
+        unsigned int v = in[i] << 16;
+        if(i + 1 < len)
+            v |= in[i + 1] << 8;
+        out += kBase64Chars[(v >> 18) & 0x3f];
+        out += kBase64Chars[(v >> 12) & 0x3f];
+        out += (i + 1 < len) ? kBase64Chars[(v >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+}
+inline bool base64Decode(const char* in, size_t len, std::string& out)
+{
+    out.clear();
+    out.reserve(len / 4 * 3);
+    unsigned int v = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = in[i];
+        int d;
+        if(c >= 'A' && c <= 'Z') d = c - 'A';
+        else if(c >= 'a' && c <= 'z') d = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') d = c - '0' + 52;
+        else if(c == '+') d = 62;
+        else if(c == '/') d = 63;
+        else if(c == '=') break;
+        else return false;
+        
+        v = (v << 6) | d;
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            out += (char)((v >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+//@return: the envelope, or NULL if compressing does not pay off
+inline json_t* zipBody(const char* raw, size_t len)
+{
+    uLongf zlen = compressBound(len);
+    std::string zipped(zlen, '\0');
+    if(compress2((Bytef*)&zipped[0], &zlen, (const Bytef*)raw, len, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return NULL;
+    if((zlen + 2) / 3 * 4 + 32 >= len)
+        return NULL;    //base64 plus {"__zip":"","__len":<len>} around it
+    
+    std::string b64;
+    base64Encode((const unsigned char*)zipped.data(), zlen, b64);
+    json_t* envelope = json_object();
+    json_object_set_new(envelope, POMELO_ZIP_KEY, json_string(b64.c_str()));
+    json_object_set_new(envelope, POMELO_ZIP_LEN_KEY, json_integer(len));
+    return envelope;
+}
+//@return: false if docs is not an envelope
+inline bool unzipBody(json_t* docs, std::string& out)
+{
+    if(!json_is_object(docs) || json_object_size(docs) != 2)
+        return false;
+    json_t* zip = json_object_get(docs, POMELO_ZIP_KEY);
+    json_t* len = json_object_get(docs, POMELO_ZIP_LEN_KEY);
+    if(!json_is_string(zip) || !json_is_integer(len))
+        return false;
+    
+    json_int_t size = json_integer_value(len);
+    if(size < 0 || size > kMaxUnzippedSize)
+        return false;
+    
+    std::string zipped;
+    const char* b64 = json_string_value(zip);
+    if(!base64Decode(b64, strlen(b64), zipped))
+        return false;
+    
+    uLongf rawLen = (uLongf)size;
+    out.resize(rawLen);
+    if(uncompress((Bytef*)&out[0], &rawLen, (const Bytef*)zipped.data(), zipped.size()) != Z_OK)
+    {
+        out.clear();
+        return false;
+    }
+    out.resize(rawLen);
+    return true;
+}
+#if CCPOMELO_FAST_JSON_WRITER || CCPOMELO_FAST_JSON_PARSER
+//strings are scanned 8 bytes at a time, in plain 64-bit words (SWAR, no SIMD intrinsics)
+static const uint64_t kSwarOnes = 0x0101010101010101ULL;
+static const uint64_t kSwarHighs = 0x8080808080808080ULL;
+
+//non zero if one of the 8 bytes is a control character, '"' or '\\'
+//(may also flag bytes next to the first match, never misses one)
+inline uint64_t needsEscape(uint64_t v)
+{
+    //bytes >= 0x80 never match, so ~v stands for ~(v ^ c) too
+    uint64_t quote = v ^ (kSwarOnes * '"');
+    uint64_t backslash = v ^ (kSwarOnes * '\\');
+    return ((v - kSwarOnes * 0x20) | (quote - kSwarOnes) | (backslash - kSwarOnes)) & ~v & kSwarHighs;
+}
+#endif
+#if CCPOMELO_FAST_JSON_WRITER
+/*
+ 快速JSON序列化，编译时定义CCPOMELO_FAST_JSON_WRITER=1启用。
+ Compact writer used instead of jansson's dumper when built with
+ CCPOMELO_FAST_JSON_WRITER=1. The text is the same as JSON_COMPACT output:
+ members in jansson's iteration order, reals as "%.17g", which
+ test/CCPomeloJsonTest.cpp checks byte for byte. Strings are copied in runs
+ between the characters to escape, jansson goes through them one code point
+ at a time.
+ */
+inline void writeJsonString(const char* s, size_t len, std::string& out)
+{
+    out += '"';
+    size_t run = 0, i = 0;
+    while (i < len)
+    {
+        uint64_t v;
+        if(i + 8 <= len)
+        {
+            memcpy(&v, s + i, 8);
+            if(!needsEscape(v))
+            {
+                i += 8;
+                continue;
+            }
+        }
+        
+        unsigned char c = (unsigned char)s[i];
+        if(c >= 0x20 && c != '"' && c != '\\')
+        {
+            i++;
+            continue;
+        }
+        
+        out.append(s + run, i - run);
+        switch (c)
+        {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+            {
+                char seq[8];
+                snprintf(seq, sizeof(seq), "\\u%04X", c);
+                out += seq;
+            }
+        }
+        run = ++i;
+    }
+    out.append(s + run, len - run);
+    out += '"';
+}
+inline void writeJson(json_t* json, std::string& out)
+{
+    char buf[32];
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+        {
+            out += '{';
+            bool first = true;
+            for (void* it = json_object_iter(json); it; it = json_object_iter_next(json, it))
+            {
+                if(!first)
+                    out += ',';
+                first = false;
+                const char* key = json_object_iter_key(it);
+                writeJsonString(key, strlen(key), out);
+                out += ':';
+                writeJson(json_object_iter_value(it), out);
+            }
+            out += '}';
+            break;
+        }
+        case JSON_ARRAY:
+        {
+            out += '[';
+            size_t size = json_array_size(json);
+            for (size_t i = 0; i < size; i++)
+            {
+                if(i > 0)
+                    out += ',';
+                writeJson(json_array_get(json, i), out);
+            }
+            out += ']';
+            break;
+        }
+        case JSON_STRING:
+        {
+            const char* value = json_string_value(json);
+            writeJsonString(value, strlen(value), out);
+            break;
+        }
+        case JSON_INTEGER:
+            snprintf(buf, sizeof(buf), "%lld", (long long)json_integer_value(json));
+            out += buf;
+            break;
+        case JSON_REAL:
+        {
+            snprintf(buf, sizeof(buf), "%.17g", json_real_value(json));
+            char* exp = strchr(buf, 'e');
+            if(exp)
+            {
+                //"1e300", "3e-7" like jansson, not "1e+300", "3e-07"
+                char* digits = exp + 1;
+                if(*digits == '-')
+                    digits++;
+                char* end = exp + 1;
+                while (*end == '+' || *end == '-' || (*end == '0' && end[1]))
+                    end++;
+                memmove(digits, end, strlen(end) + 1);
+            }
+            else if(!strchr(buf, '.') && strspn(buf, "-0123456789") == strlen(buf))
+            {
+                strcat(buf, ".0");  //still a real when read back
+            }
+            out += buf;
+            break;
+        }
+        case JSON_TRUE:
+            out += "true";
+            break;
+        case JSON_FALSE:
+            out += "false";
+            break;
+        default:
+            out += "null";
+            break;
+    }
+}
+#endif
+#if CCPOMELO_FAST_JSON_PARSER
+/*
+ 快速JSON解析，编译时定义CCPOMELO_FAST_JSON_PARSER=1启用。
+ Parser used instead of json_loads() when built with CCPOMELO_FAST_JSON_PARSER=1.
+ It builds the same jansson tree and refuses the same texts (objects and arrays
+ at the top only, no NUL in strings, strict UTF-8, jansson's depth limit),
+ test/CCPomeloJsonTest.cpp compares both on generated and mangled texts.
+ Strings are scanned 8 bytes at a time up to the closing quote and copied in
+ one go, integers are read without strtoll(). It gives no error details.
+ */
+class _PomeloJsonReader
+{
+public:
+    _PomeloJsonReader(const char* text, size_t len) : mPos(text), mEnd(text + len), mDepth(0) {}
+    
+    //@return: new reference, or NULL if the text is malformed
+    json_t* read()
+    {
+        skipSpace();
+        if(mPos == mEnd || (*mPos != '{' && *mPos != '['))
+            return NULL;    //as json_loads() without JSON_DECODE_ANY
+        
+        json_t* json = value();
+        skipSpace();
+        if(json && mPos != mEnd)
+        {
+            json_decref(json);
+            return NULL;
+        }
+        return json;
+    }
+    
+private:
+    static const int kMaxDepth = 2048;  //JSON_PARSER_MAX_DEPTH of jansson
+    
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    
+    void skipSpace()
+    {
+        while (mPos < mEnd && (*mPos == ' ' || *mPos == '\n' || *mPos == '\r' || *mPos == '\t'))
+            mPos++;
+    }
+    json_t* literal(const char* word, size_t len, json_t* json)
+    {
+        if((size_t)(mEnd - mPos) < len || memcmp(mPos, word, len) != 0)
+            return NULL;
+        mPos += len;
+        return json;
+    }
+    json_t* value()
+    {
+        if(mPos == mEnd || ++mDepth > kMaxDepth)
+            return NULL;
+        
+        json_t* json;
+        switch (*mPos)
+        {
+            case '{': json = object(); break;
+            case '[': json = array(); break;
+            case '"': json = readString() ? json_string_nocheck(mString.c_str()) : NULL; break;
+            case 't': json = literal("true", 4, json_true()); break;
+            case 'f': json = literal("false", 5, json_false()); break;
+            case 'n': json = literal("null", 4, json_null()); break;
+            default: json = number(); break;
+        }
+        mDepth--;
+        return json;
+    }
+    json_t* object()
+    {
+        mPos++;
+        json_t* json = json_object();
+        skipSpace();
+        if(mPos < mEnd && *mPos == '}')
+        {
+            mPos++;
+            return json;
+        }
+        
+        //a key stays put while its value is read, one per level
+        //(by index, deeper levels may grow mKeys)
+        size_t level = mDepth - 1;
+        if(mKeys.size() <= level)
+            mKeys.resize(level + 1);
+        while (true)
+        {
+            skipSpace();
+            if(mPos == mEnd || *mPos != '"' || !readString())
+                break;
+            mKeys[level].swap(mString);
+            
+            skipSpace();
+            if(mPos == mEnd || *mPos != ':')
+                break;
+            mPos++;
+            skipSpace();
+            
+            json_t* member = value();
+            if(!member || json_object_set_new_nocheck(json, mKeys[level].c_str(), member) != 0)
+                break;
+            
+            skipSpace();
+            if(mPos == mEnd)
+                break;
+            if(*mPos == '}')
+            {
+                mPos++;
+                return json;
+            }
+            if(*mPos++ != ',')
+                break;
+        }
+        json_decref(json);
+        return NULL;
+    }
+    json_t* array()
+    {
+        mPos++;
+        json_t* json = json_array();
+        skipSpace();
+        if(mPos < mEnd && *mPos == ']')
+        {
+            mPos++;
+            return json;
+        }
+        
+        while (true)
+        {
+            skipSpace();
+            json_t* item = value();
+            if(!item || json_array_append_new(json, item) != 0)
+                break;
+            
+            skipSpace();
+            if(mPos == mEnd)
+                break;
+            if(*mPos == ']')
+            {
+                mPos++;
+                return json;
+            }
+            if(*mPos++ != ',')
+                break;
+        }
+        json_decref(json);
+        return NULL;
+    }
+    //the string at mPos into mString, unescaped
+    bool readString()
+    {
+        const char* run = ++mPos;
+        mString.clear();
+        while (true)
+        {
+            //plain ASCII in one go
+            uint64_t v;
+            while (mEnd - mPos >= 8)
+            {
+                memcpy(&v, mPos, 8);
+                if(needsEscape(v) || (v & kSwarHighs))
+                    break;
+                mPos += 8;
+            }
+            if(mPos == mEnd)
+                return false;
+            
+            unsigned char c = (unsigned char)*mPos;
+            if(c == '"')
+            {
+                mString.append(run, mPos - run);
+                mPos++;
+                return true;
+            }
+            else if(c == '\\')
+            {
+                mString.append(run, mPos - run);
+                if(!readEscape())
+                    return false;
+                run = mPos;
+            }
+            else if(c < 0x20)
+            {
+                return false;
+            }
+            else if(c < 0x80)
+            {
+                mPos++;
+            }
+            else if(!skipUtf8())
+            {
+                return false;
+            }
+        }
+    }
+    //the code point at mPos, as strict as jansson: no overlong forms, no surrogates
+    bool skipUtf8()
+    {
+        unsigned char c = (unsigned char)*mPos;
+        size_t size;
+        unsigned int cp;
+        if(c >= 0xC2 && c <= 0xDF) { size = 2; cp = c & 0x1F; }
+        else if(c >= 0xE0 && c <= 0xEF) { size = 3; cp = c & 0x0F; }
+        else if(c >= 0xF0 && c <= 0xF4) { size = 4; cp = c & 0x07; }
+        else return false;
+        
+        if((size_t)(mEnd - mPos) < size)
+            return false;
+        for (size_t i = 1; i < size; i++)
+        {
+            unsigned char next = (unsigned char)mPos[i];
+            if((next & 0xC0) != 0x80)
+                return false;
+            cp = (cp << 6) | (next & 0x3F);
+        }
+        if((size == 3 && cp < 0x800) || (size == 4 && cp < 0x10000)
+           || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            return false;
+        mPos += size;
+        return true;
+    }
+    static long hex4(const char* s)
+    {
+        long v = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = s[i];
+            v <<= 4;
+            if(isDigit(c)) v |= c - '0';
+            else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+            else return -1;
+        }
+        return v;
+    }
+    bool readEscape()
+    {
+        if(mEnd - mPos < 2)
+            return false;
+        char c = mPos[1];
+        mPos += 2;
+        switch (c)
+        {
+            case '"': case '\\': case '/': mString += c; return true;
+            case 'b': mString += '\b'; return true;
+            case 'f': mString += '\f'; return true;
+            case 'n': mString += '\n'; return true;
+            case 'r': mString += '\r'; return true;
+            case 't': mString += '\t'; return true;
+            case 'u': break;
+            default: return false;
+        }
+        
+        long cp = mEnd - mPos >= 4 ? hex4(mPos) : -1;
+        if(cp <= 0)
+            return false;   //malformed, or \u0000 (jansson wants JSON_ALLOW_NUL for it)
+        mPos += 4;
+        if(cp >= 0xD800 && cp <= 0xDBFF)
+        {
+            //a surrogate pair, or nothing
+            long low = mEnd - mPos >= 6 && mPos[0] == '\\' && mPos[1] == 'u' ? hex4(mPos + 2) : -1;
+            if(low < 0xDC00 || low > 0xDFFF)
+                return false;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            mPos += 6;
+        }
+        else if(cp >= 0xDC00 && cp <= 0xDFFF)
+        {
+            return false;
+        }
+        
+        if(cp < 0x80)
+        {
+            mString += (char)cp;
+        }
+        else if(cp < 0x800)
+        {
+            mString += (char)(0xC0 | (cp >> 6));
+            mString += (char)(0x80 | (cp & 0x3F));
+        }
+        else if(cp < 0x10000)
+        {
+            mString += (char)(0xE0 | (cp >> 12));
+            mString += (char)(0x80 | ((cp >> 6) & 0x3F));
+            mString += (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            mString += (char)(0xF0 | (cp >> 18));
+            mString += (char)(0x80 | ((cp >> 12) & 0x3F));
+            mString += (char)(0x80 | ((cp >> 6) & 0x3F));
+            mString += (char)(0x80 | (cp & 0x3F));
+        }
+        return true;
+    }
+    json_t* number()
+    {
+        const char* start = mPos;
+        bool negative = *mPos == '-';
+        if(negative)
+            mPos++;
+        if(mPos == mEnd)
+            return NULL;
+        if(*mPos == '0')
+        {
+            mPos++;
+            if(mPos < mEnd && isDigit(*mPos))
+                return NULL;    //no leading zeros
+        }
+        else if(isDigit(*mPos))
+        {
+            while (mPos < mEnd && isDigit(*mPos))
+                mPos++;
+        }
+        else
+        {
+            return NULL;
+        }
+        const char* intEnd = mPos;
+        
+        bool real = false;
+        if(mPos < mEnd && *mPos == '.')
+        {
+            mPos++;
+            if(mPos == mEnd || !isDigit(*mPos))
+                return NULL;
+            while (mPos < mEnd && isDigit(*mPos))
+                mPos++;
+            real = true;
+        }
+        if(mPos < mEnd && (*mPos == 'e' || *mPos == 'E'))
+        {
+            mPos++;
+            if(mPos < mEnd && (*mPos == '+' || *mPos == '-'))
+                mPos++;
+            if(mPos == mEnd || !isDigit(*mPos))
+                return NULL;
+            while (mPos < mEnd && isDigit(*mPos))
+                mPos++;
+            real = true;
+        }
+        
+        const char* digits = negative ? start + 1 : start;
+        if(!real && intEnd - digits <= 18)
+        {
+            //fits, no overflow check needed
+            json_int_t v = 0;
+            for (const char* p = digits; p < intEnd; p++)
+                v = v * 10 + (*p - '0');
+            return json_integer(negative ? -v : v);
+        }
+        
+        //long integers and reals, strto*() want a terminated copy
+        mNumber.assign(start, mPos - start);
+        errno = 0;
+        if(!real)
+        {
+            long long v = strtoll(mNumber.c_str(), NULL, 10);
+            return errno == ERANGE ? NULL : json_integer((json_int_t)v);
+        }
+        double v = strtod(mNumber.c_str(), NULL);
+        if(errno == ERANGE && (v == HUGE_VAL || v == -HUGE_VAL))
+            return NULL;    //overflow, underflow is fine with jansson
+        return json_real(v);
+    }
+    
+    const char* mPos;
+    const char* mEnd;
+    int mDepth;
+    std::string mString;
+    std::string mNumber;
+    std::vector<std::string> mKeys;
+};
+inline json_t* readJson(const char* text, size_t len)
+{
+    return _PomeloJsonReader(text, len).read();
+}
+#endif
+//json text of an object or array to a tree, NULL if malformed
+//@return: new reference
+inline json_t* loadJson(const std::string& text)
+{
+#if CCPOMELO_FAST_JSON_PARSER
+    return readJson(text.data(), text.size());
+#else
+    json_error_t err;
+    return json_loadb(text.data(), text.size(), 0, &err);
+#endif
+}
+inline int appendToString(const char* buffer, size_t size, void* data)
+{
+    ((std::string*)data)->append(buffer, size);
+    return 0;
+}
+//compact json text appended to out; of an object or array only unless any
+inline void dumpJson(json_t* json, std::string& out, bool any = false)
+{
+    if(!json || (!any && !json_is_object(json) && !json_is_array(json)))
+        return; //as json_dumps() without JSON_ENCODE_ANY
+#if CCPOMELO_FAST_JSON_WRITER
+    writeJson(json, out);
+#else
+    json_dump_callback(json, appendToString, &out, JSON_COMPACT | (any ? JSON_ENCODE_ANY : 0));
+#endif
+}
+//json text of an incoming body, unpacking compressed envelopes.
+//Written straight into out, without the intermediate json_dumps() buffer.
+inline void dumpBody(json_t* docs, std::string& out)
+{
+    out.clear();
+    if(!docs || unzipBody(docs, out))
+        return;
+    
+    dumpJson(docs, out);
+}
+//about how long the compact json text of json is, without writing it.
+//Escapes are not counted. The walk stops as soon as limit is reached,
+//so a big body costs no more than a small one.
+//@return: the estimate, or something >= limit
+inline size_t estimateJsonSize(json_t* json, size_t limit, size_t total = 0)
+{
+    switch (json_typeof(json))
+    {
+        case JSON_OBJECT:
+        {
+            total += 2;
+            void* iter = json_object_iter(json);
+            while (iter && total < limit)
+            {
+                total += strlen(json_object_iter_key(iter)) + 4;   //"":,
+                total = estimateJsonSize(json_object_iter_value(iter), limit, total);
+                iter = json_object_iter_next(json, iter);
+            }
+            return total;
+        }
+        case JSON_ARRAY:
+        {
+            total += 2;
+            size_t count = json_array_size(json);
+            for (size_t i = 0; i < count && total < limit; i++)
+            {
+                total = estimateJsonSize(json_array_get(json, i), limit, total + 1);
+            }
+            return total;
+        }
+        case JSON_STRING:
+            return total + strlen(json_string_value(json)) + 2;
+        case JSON_INTEGER:
+        {
+            json_int_t v = json_integer_value(json);
+            size_t digits = v < 0 ? 2 : 1;
+            while (v /= 10)
+                digits++;
+            return total + digits;
+        }
+        case JSON_REAL:
+            return total + 17;
+        case JSON_FALSE:
+            return total + 5;
+        default:
+            return total + 4;   //true, null
+    }
+}
+
+//==================== delta events ====================
+/*
+ Pushes of an event set by setDeltaEvent() are either a full document, which
+ replaces the state, or {"__delta":<RFC 7386 merge patch>} to be applied to
+ the last state. States are told apart by the key member, if any.
+ */
+#define POMELO_DELTA_KEY "__delta"
+
+//the merge patch, leaving target alone (a decode worker may still read it):
+//objects on the patched paths are copied, everything else is shared.
+//@return: new reference
+inline json_t* mergePatch(json_t* target, json_t* patch)
+{
+    if(!json_is_object(patch))
+        return json_incref(patch);
+    
+    json_t* result = json_is_object(target) ? json_copy(target) : json_object();   //shallow
+    void* iter = json_object_iter(patch);
+    while (iter)
+    {
+        const char* key = json_object_iter_key(iter);
+        json_t* value = json_object_iter_value(iter);
+        if(json_is_null(value))
+            json_object_del(result, key);
+        else
+            json_object_set_new(result, key, mergePatch(json_object_get(result, key), value));
+        iter = json_object_iter_next(patch, iter);
+    }
+    return result;
+}
+inline std::string deltaKey(json_t* value)
+{
+    if(json_is_string(value))
+        return json_string_value(value);
+    
+    char buf[32];
+    if(json_is_integer(value))
+    {
+        snprintf(buf, sizeof(buf), "%lld", (long long)json_integer_value(value));
+        return buf;
+    }
+    std::string out;
+    if(value)
+        dumpJson(value, out, true);
+    return out;
+}
+
+//==================== outbox ====================
+/*
+ Messages sent while not connected are kept in a ring buffer inside a memory
+ mapped file: [header][records...]. head/tail are ever growing byte counters,
+ their position in the ring is counter % data size. A record is
+ [u32 size of the rest][u8 kind][u32 seq][u16 route length][route][msg].
+ The kernel writes dirty pages back on its own, so the messages survive an app
+ restart (or crash) without any fsync per message.
+ */
+static const char kOutboxRequest = 'R';
+static const char kOutboxNotify = 'N';
+
+class _PomeloOutbox
+{
+public:
+    _PomeloOutbox();
+    ~_PomeloOutbox();
+    
+    bool open(const char* path, size_t capacity);
+    void close();
+    bool isOpen() const { return mHeader != NULL; }
+    
+    //@return: false if there is no room left
+    bool push(char kind, const char* route, const std::string& msg, unsigned int& seq);
+    //@return: false if empty, or if the front record is corrupted (all dropped then)
+    bool front(char& kind, std::string& route, std::string& msg, unsigned int& seq);
+    void pop();
+    
+private:
+    struct Header
+    {
+        char magic[4];
+        unsigned int version;
+        unsigned long long dataSize;
+        unsigned long long head;
+        unsigned long long tail;
+        unsigned int nextSeq;
+    };
+    
+    void read(unsigned long long pos, void* out, size_t len) const;
+    void write(unsigned long long pos, const void* in, size_t len);
+    
+    Header* mHeader;
+    char*   mData;
+    size_t  mMapSize;
+    int     mFd;
+    size_t  mFrontSize;
+};
+
+inline _PomeloOutbox::_PomeloOutbox()
+:mHeader(NULL),
+mData(NULL),
+mMapSize(0),
+mFd(-1),
+mFrontSize(0)
+{
+}
+inline _PomeloOutbox::~_PomeloOutbox()
+{
+    close();
+}
+inline bool _PomeloOutbox::open(const char* path, size_t capacity)
+{
+    close();
+#if POMELO_OUTBOX_SUPPORTED
+    mFd = ::open(path, O_RDWR | O_CREAT, 0600);
+    if(mFd < 0)
+        return false;
+    
+    mMapSize = sizeof(Header) + capacity;
+    if(ftruncate(mFd, mMapSize) != 0)
+    {
+        close();
+        return false;
+    }
+    void* base = mmap(NULL, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if(base == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    mHeader = (Header*)base;
+    mData = (char*)base + sizeof(Header);
+    
+    if(memcmp(mHeader->magic, "PMOB", 4) != 0 || mHeader->version != 1 || mHeader->dataSize != capacity
+       || mHeader->tail - mHeader->head > capacity)
+    {
+        //new or unusable file, start over
+        memset(mHeader, 0, sizeof(Header));
+        memcpy(mHeader->magic, "PMOB", 4);
+        mHeader->version = 1;
+        mHeader->dataSize = capacity;
+    }
+    mFrontSize = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+inline void _PomeloOutbox::close()
+{
+#if POMELO_OUTBOX_SUPPORTED
+    if(mHeader)
+    {
+        msync(mHeader, mMapSize, MS_ASYNC);
+        munmap(mHeader, mMapSize);
+    }
+    if(mFd >= 0)
+        ::close(mFd);
+#endif
+    mHeader = NULL;
+    mData = NULL;
+    mFd = -1;
+}
+inline void _PomeloOutbox::read(unsigned long long pos, void* out, size_t len) const
+{
+    size_t off = pos % mHeader->dataSize;
+    size_t n = std::min(len, (size_t)(mHeader->dataSize - off));
+    memcpy(out, mData + off, n);
+    memcpy((char*)out + n, mData, len - n);
+}
+inline void _PomeloOutbox::write(unsigned long long pos, const void* in, size_t len)
+{
+    size_t off = pos % mHeader->dataSize;
+    size_t n = std::min(len, (size_t)(mHeader->dataSize - off));
+    memcpy(mData + off, in, n);
+    memcpy(mData, (const char*)in + n, len - n);
+}
+inline bool _PomeloOutbox::push(char kind, const char* route, const std::string& msg, unsigned int& seq)
+{
+    unsigned short routeLen = (unsigned short)strlen(route);
+    unsigned int size = 1 + 4 + 2 + routeLen + msg.size();
+    if(!mHeader || mHeader->tail - mHeader->head + 4 + size > mHeader->dataSize)
+        return false;
+    
+    seq = mHeader->nextSeq++;
+    unsigned long long pos = mHeader->tail;
+    write(pos, &size, 4);               pos += 4;
+    write(pos, &kind, 1);               pos += 1;
+    write(pos, &seq, 4);                pos += 4;
+    write(pos, &routeLen, 2);           pos += 2;
+    write(pos, route, routeLen);        pos += routeLen;
+    write(pos, msg.data(), msg.size()); pos += msg.size();
+    
+    //publish the record only after its bytes are in place
+    __sync_synchronize();
+    mHeader->tail = pos;
+    return true;
+}
+inline bool _PomeloOutbox::front(char& kind, std::string& route, std::string& msg, unsigned int& seq)
+{
+    if(!mHeader || mHeader->head == mHeader->tail)
+        return false;
+    
+    unsigned int size = 0;
+    unsigned short routeLen = 0;
+    unsigned long long pos = mHeader->head;
+    read(pos, &size, 4);        pos += 4;
+    read(pos, &kind, 1);        pos += 1;
+    read(pos, &seq, 4);         pos += 4;
+    read(pos, &routeLen, 2);    pos += 2;
+    
+    //the file may be torn by a crash halfway through a write, or be garbage
+    if(size < 7u + routeLen || 4ull + size > mHeader->tail - mHeader->head
+       || (kind != kOutboxRequest && kind != kOutboxNotify))
+    {
+        mHeader->head = mHeader->tail;
+        mFrontSize = 0;
+        return false;
+    }
+    route.resize(routeLen);
+    read(pos, &route[0], routeLen);     pos += routeLen;
+    msg.resize(size - 7 - routeLen);
+    read(pos, &msg[0], msg.size());
+    
+    mFrontSize = 4 + size;
+    return true;
+}
+inline void _PomeloOutbox::pop()
+{
+    if(mHeader && mFrontSize > 0)
+    {
+        mHeader->head += mFrontSize;
+        mFrontSize = 0;
+    }
+}
+
+//==================== pattern listeners ====================
+//see CCPomeloWrapper::addPatternListener()
+//'*' matches any run of characters (also none), '?' exactly one. Patterns
+//share their common prefixes, so an event is matched in one walk down the
+//tree, which stops at the first character no pattern continues with.
+template <typename T>
+class _PomeloRouteTrie
+{
+public:
+    _PomeloRouteTrie() : mCount(0) {}
+    ~_PomeloRouteTrie() { clear(); }
+    
+    bool empty() const { return mCount == 0; }
+    
+    //@return: the user previously listening to pattern (to be deleted by the caller), or NULL
+    T* insert(const char* pattern, T* user)
+    {
+        Node* node = &mRoot;
+        for (const char* p = pattern; *p; p++)
+        {
+            Node*& next = node->next[*p];
+            if(!next)
+                next = new Node();
+            node = next;
+        }
+        
+        T* old = node->user;
+        node->user = user;
+        if(!old)
+            mCount++;
+        return old;
+    }
+    //@return: the user listening to pattern (to be deleted by the caller), or NULL
+    T* remove(const char* pattern)
+    {
+        std::vector<Node*> path(1, &mRoot);
+        for (const char* p = pattern; *p; p++)
+        {
+            typename std::map<char,Node*>::iterator it = path.back()->next.find(*p);
+            if(it == path.back()->next.end())
+                return NULL;
+            path.push_back(it->second);
+        }
+        
+        T* user = path.back()->user;
+        if(!user)
+            return NULL;
+        path.back()->user = NULL;
+        mCount--;
+        
+        //prune the branch nobody uses any more
+        size_t len = path.size() - 1;
+        while (len > 0 && !path[len]->user && path[len]->next.empty())
+        {
+            delete path[len];
+            path[len - 1]->next.erase(pattern[len - 1]);
+            len--;
+        }
+        return user;
+    }
+    //most specific match: literal characters win over '?', '?' over '*'
+    T* match(const char* event) const
+    {
+        return mCount ? match(&mRoot, event) : NULL;
+    }
+    //deletes the users, or hands them to users if given
+    void clear(std::vector<T*>* users = NULL)
+    {
+        release(&mRoot, users);
+        mRoot.next.clear();
+        mRoot.user = NULL;
+        mCount = 0;
+    }
+    
+private:
+    struct Node
+    {
+        Node() : user(NULL) {}
+        std::map<char,Node*> next;
+        T* user;  //owned, listener of the pattern ending here
+    };
+    
+    static T* match(const Node* node, const char* s)
+    {
+        typename std::map<char,Node*>::const_iterator it;
+        if(*s)
+        {
+            it = node->next.find(*s);
+            if(it != node->next.end() && *s != '*' && *s != '?')
+            {
+                T* user = match(it->second, s + 1);
+                if(user)
+                    return user;
+            }
+            it = node->next.find('?');
+            if(it != node->next.end())
+            {
+                T* user = match(it->second, s + 1);
+                if(user)
+                    return user;
+            }
+        }
+        else if(node->user)
+        {
+            return node->user;
+        }
+        
+        it = node->next.find('*');
+        if(it != node->next.end())
+        {
+            //shortest run first
+            for (const char* p = s; ; p++)
+            {
+                T* user = match(it->second, p);
+                if(user || !*p)
+                    return user;
+            }
+        }
+        return NULL;
+    }
+    static void release(Node* node, std::vector<T*>* users)
+    {
+        if(users && node->user)
+            users->push_back(node->user);
+        else
+            delete node->user;
+        typename std::map<char,Node*>::iterator it;
+        for (it = node->next.begin(); it != node->next.end(); it++)
+        {
+            release(it->second, users);
+            delete it->second;
+        }
+    }
+    
+    Node mRoot;
+    size_t mCount;
+};
+
+//==================== pomelo protocol ====================
+/*
+ What libpomelo speaks over tcp, for the websocket transport (one binary
+ frame holds one or more packages):
+ package: [u8 type][u24 body length, big endian][body]
+ data package body, a message: [u8 flag][id][route][body]
+   flag: type << 1 | route is a dictionary code
+   id: request/response only, base 128 varint, low 7 bits first
+   route: request/notify/push only, [u16 code] or [u8 length][chars]
+   body: json text
+ */
+static const int kPackageHandshake = 1;
+static const int kPackageHandshakeAck = 2;
+static const int kPackageHeartbeat = 3;
+static const int kPackageData = 4;
+static const int kPackageKick = 5;
+
+static const int kMessageRequest = 0;
+static const int kMessageNotify = 1;
+static const int kMessageResponse = 2;
+static const int kMessagePush = 3;
+
+static const size_t kMaxPackageBody = 0xffffff;
+
+struct _PomeloPackage
+{
+    int type;
+    std::string body;
+};
+
+struct _PomeloMessage
+{
+    _PomeloMessage() : type(kMessageRequest), id(0), routeCode(-1) {}
+    int type;
+    uint32_t id;        //request/response
+    int routeCode;      //>= 0 if the route came as a dictionary code
+    std::string route;
+    std::string body;
+};
+
+//@return: false if body is too long for a package
+inline bool encodePackage(int type, const std::string& body, std::string& out)
+{
+    if(body.size() > kMaxPackageBody)
+        return false;
+    out += (char)type;
+    out += (char)((body.size() >> 16) & 0xff);
+    out += (char)((body.size() >> 8) & 0xff);
+    out += (char)(body.size() & 0xff);
+    out += body;
+    return true;
+}
+
+//@return: false if data is not a whole number of packages
+inline bool decodePackages(const char* data, size_t len, std::vector<_PomeloPackage>& out)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    size_t offset = 0;
+    while (offset < len)
+    {
+        if(len - offset < 4)
+            return false;
+        size_t size = (size_t)p[offset + 1] << 16 | (size_t)p[offset + 2] << 8 | p[offset + 3];
+        if(len - offset - 4 < size)
+            return false;
+        
+        _PomeloPackage package;
+        package.type = p[offset];
+        package.body.assign(data + offset + 4, size);
+        out.push_back(package);
+        offset += 4 + size;
+    }
+    return true;
+}
+
+//routeCode >= 0 replaces route. @return: false if route is too long
+inline bool encodeMessage(int type, uint32_t id, const std::string& route, int routeCode, const std::string& body, std::string& out)
+{
+    out += (char)(type << 1 | (routeCode >= 0 ? 1 : 0));
+    if(type == kMessageRequest || type == kMessageResponse)
+    {
+        do
+        {
+            unsigned char byte = id & 0x7f;
+            id >>= 7;
+            out += (char)(id ? byte | 0x80 : byte);
+        } while (id);
+    }
+    if(type != kMessageResponse)
+    {
+        if(routeCode >= 0)
+        {
+            out += (char)((routeCode >> 8) & 0xff);
+            out += (char)(routeCode & 0xff);
+        }
+        else
+        {
+            if(route.size() > 0xff)
+                return false;
+            out += (char)route.size();
+            out += route;
+        }
+    }
+    out += body;
+    return true;
+}
+
+//@return: false if data is not a message
+inline bool decodeMessage(const char* data, size_t len, _PomeloMessage& msg)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    size_t offset = 0;
+    if(len < 1)
+        return false;
+    unsigned char flag = p[offset++];
+    if(flag & 0xf0)
+        return false;   //gzip'ed bodies of newer servers, not asked for in handshake
+    msg.type = flag >> 1 & 0x7;
+    
+    msg.id = 0;
+    if(msg.type == kMessageRequest || msg.type == kMessageResponse)
+    {
+        for (int shift = 0; ; shift += 7)
+        {
+            if(offset >= len || shift > 28)
+                return false;
+            unsigned char byte = p[offset++];
+            msg.id |= (uint32_t)(byte & 0x7f) << shift;
+            if(!(byte & 0x80))
+                break;
+        }
+    }
+    
+    msg.routeCode = -1;
+    msg.route.clear();
+    if(msg.type != kMessageResponse)
+    {
+        if(flag & 1)
+        {
+            if(len - offset < 2)
+                return false;
+            msg.routeCode = p[offset] << 8 | p[offset + 1];
+            offset += 2;
+        }
+        else
+        {
+            if(offset >= len)
+                return false;
+            size_t size = p[offset++];
+            if(len - offset < size)
+                return false;
+            msg.route.assign(data + offset, size);
+            offset += size;
+        }
+    }
+    
+    msg.body.assign(data + offset, len - offset);
+    return true;
+}
+
+#endif /* defined(__CCPomeloInternal__) */
@@ -7,27 +7,254 @@
 
 #include "CCPomeloWrapper.h"
 #include <errno.h>
+#include <math.h>
 #include <queue>
+#include <list>
+#include <set>
+#include <algorithm>
+#if CC_TARGET_PLATFORM != CC_PLATFORM_WIN32
+#include <sys/time.h>
+#define POMELO_OUTBOX_SUPPORTED 1
+#else
+#define POMELO_OUTBOX_SUPPORTED 0
+#endif
+#if CCX3
+#include <atomic>
+#include <chrono>
+#include "network/WebSocket.h"
+#endif
 #include "pomelo.h"
 #include "jansson.h"
+#include "zlib.h"
+#include "CCPomeloInternal.h"
 
 using namespace std;
 USING_NS_CC;
 
 static CCPomeloWrapper* gPomelo = NULL;
 
+//wall clock, in seconds: serverNow() adds the server's offset to it
+static double nowSeconds()
+{
+#if CCX3
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);    //cocos2dx 2.x has one for win32 in CCStdC.h
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+//lock-free integer shared between cocos thread and libpomelo thread
+//std::atomic for cocos2dx 3.x, gcc/clang builtins for cocos2dx 2.x
+class _PomeloAtomic
+{
+public:
+    explicit _PomeloAtomic(long v = 0) : mValue(v) {}
+#if CCX3
+    long load() const { return mValue.load(); }
+    void store(long v) { mValue.store(v); }
+    long exchange(long v) { return mValue.exchange(v); }
+    long add(long v) { return mValue.fetch_add(v) + v; }
+private:
+    std::atomic<long> mValue;
+#else
+    long load() const { return __sync_add_and_fetch(&mValue, 0); }
+    void store(long v) { exchange(v); }
+    long exchange(long v) { __sync_synchronize(); return __sync_lock_test_and_set(&mValue, v); }
+    long add(long v) { return __sync_add_and_fetch(&mValue, v); }
+private:
+    mutable volatile long mValue;
+#endif
+    
+    _PomeloAtomic(const _PomeloAtomic&);
+    _PomeloAtomic& operator=(const _PomeloAtomic&);
+};
+
+//==================== session record ====================
+/*
+ Log file: "PMRL" u32 version, followed by records of
+ [u8 kind][f64 seconds since recording started][i32 status]
+ [u16 route length][u32 data length][route][data]
+ in native byte order. Data is json text, compressed bodies are unpacked.
+ */
+static const char kRecordRequest = 'Q';     //outgoing
+static const char kRecordNotify = 'N';      //outgoing
+static const char kRecordResponse = 'R';
+static const char kRecordNotifyAck = 'A';
+static const char kRecordEvent = 'E';
+
+struct _PomeloRecord
+{
+    char kind;
+    double time;
+    int status;
+    string route;
+    string data;
+};
+
+//written from both cocos thread and libpomelo thread
+class _PomeloRecorder
+{
+public:
+    _PomeloRecorder();
+    ~_PomeloRecorder();
+    
+    bool open(const char* path);
+    void close();
+    bool isOpen() const { return mActive.load() != 0; }
+    
+    void write(char kind, const char* route, int status, const string& data);
+    
+    static bool load(const char* path, vector<_PomeloRecord>& records);
+    
+private:
+    FILE*           mFile;
+    double          mStart;
+    _PomeloAtomic   mActive;    //lock-free early out for write()
+    pthread_mutex_t mMutex;
+};
+
+_PomeloRecorder::_PomeloRecorder()
+:mFile(NULL),
+mStart(0)
+{
+    pthread_mutex_init(&mMutex, NULL);
+}
+_PomeloRecorder::~_PomeloRecorder()
+{
+    close();
+    pthread_mutex_destroy(&mMutex);
+}
+bool _PomeloRecorder::open(const char* path)
+{
+    close();
+    
+    FILE* file = fopen(path, "wb");
+    if(!file)
+        return false;
+    
+    unsigned int version = 1;
+    fwrite("PMRL", 1, 4, file);
+    fwrite(&version, 4, 1, file);
+    
+    pthread_mutex_lock(&mMutex);
+    mFile = file;
+    mStart = nowSeconds();
+    mActive.store(1);
+    pthread_mutex_unlock(&mMutex);
+    return true;
+}
+void _PomeloRecorder::close()
+{
+    pthread_mutex_lock(&mMutex);
+    mActive.store(0);
+    if(mFile)
+        fclose(mFile);
+    mFile = NULL;
+    pthread_mutex_unlock(&mMutex);
+}
+void _PomeloRecorder::write(char kind, const char* route, int status, const string& data)
+{
+    unsigned short routeLen = route ? (unsigned short)strlen(route) : 0;
+    unsigned int dataLen = data.size();
+    
+    pthread_mutex_lock(&mMutex);
+    if(mFile)
+    {
+        double time = nowSeconds() - mStart;
+        fwrite(&kind, 1, 1, mFile);
+        fwrite(&time, 8, 1, mFile);
+        fwrite(&status, 4, 1, mFile);
+        fwrite(&routeLen, 2, 1, mFile);
+        fwrite(&dataLen, 4, 1, mFile);
+        fwrite(route, 1, routeLen, mFile);
+        fwrite(data.data(), 1, dataLen, mFile);
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+bool _PomeloRecorder::load(const char* path, vector<_PomeloRecord>& records)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+        return false;
+    
+    char magic[4];
+    unsigned int version = 0;
+    if(fread(magic, 1, 4, file) != 4 || memcmp(magic, "PMRL", 4) != 0
+       || fread(&version, 4, 1, file) != 1 || version != 1)
+    {
+        fclose(file);
+        return false;
+    }
+    
+    _PomeloRecord rec;
+    unsigned short routeLen;
+    unsigned int dataLen;
+    while (fread(&rec.kind, 1, 1, file) == 1
+           && fread(&rec.time, 8, 1, file) == 1
+           && fread(&rec.status, 4, 1, file) == 1
+           && fread(&routeLen, 2, 1, file) == 1
+           && fread(&dataLen, 4, 1, file) == 1)
+    {
+        rec.route.resize(routeLen);
+        rec.data.resize(dataLen);
+        if((routeLen && fread(&rec.route[0], 1, routeLen, file) != routeLen)
+           || (dataLen && fread(&rec.data[0], 1, dataLen, file) != dataLen))
+        {
+            break;  //cut off by a crash, keep what we have
+        }
+        records.push_back(rec);
+    }
+    fclose(file);
+    return true;
+}
+
+struct _PomeloBatch;
+static void releaseBatch(_PomeloBatch* batch);
+
+#if CCX3
+//how _PomeloUser keeps the callbacks: the public std::function types are
+//moved in, lambdas of the wrapper itself are stored without one
+typedef CCPomeloCallback<void(CCPomeloRequestResult&&)> _PomeloReqResultCB;
+typedef CCPomeloCallback<void(const CCPomeloNotifyResult&)> _PomeloNtfResultCB;
+typedef CCPomeloCallback<void(CCPomeloEvent&&)> _PomeloEventCB;
+typedef CCPomeloCallback<void(CCPomeloEventBatch&&)> _PomeloEventBatchCB;
+typedef CCPomeloCallback<void(const CCPomeloResponseChunk&)> _PomeloReqChunkCB;
+typedef CCPomeloCallback<void(CCPomeloBatchResult&&)> _PomeloBatchCB;
+typedef CCPomeloCallback<void(PomeloTask&&)> _PomeloExecutorCB;
+
+//requestOn(): the callback and its result, handed to the executor as one task
+struct _PomeloExecutorTask
+{
+    _PomeloExecutorTask(_PomeloReqResultCB&& cb, CCPomeloRequestResult&& rst)
+    :callback(std::move(cb)), result(std::move(rst)) {}
+    void operator()() { callback(std::move(result)); }
+    
+    _PomeloReqResultCB callback;
+    CCPomeloRequestResult result;
+};
+#endif
+
 struct _PomeloUser
 {
 #if CCX3
-    _PomeloUser(){ connCB = NULL; reqCB = NULL; ntfCB = NULL; evtCB = NULL; };
-    ~_PomeloUser(){};
+    _PomeloUser(){ connCB = NULL; reqCB = NULL; ntfCB = NULL; evtCB = NULL; chunkCB = NULL; batchCB = NULL; direct = false; streamWindow = 0; nextSubscriber = NULL; batch = NULL; batchIndex = 0; sentAt = 0; batchEvents = false; queued = false; };
+    ~_PomeloUser(){ delete nextSubscriber; releaseBatch(batch); };
 
     PomeloAsyncConnCallback connCB; //for async conn
-    PomeloReqResultCallback reqCB;  //for request
-    PomeloNtfResultCallback ntfCB;  //for notify
-    PomeloEventCallback evtCB;      //for listener
+    _PomeloReqResultCB reqCB;       //for request
+    _PomeloNtfResultCB ntfCB;       //for notify
+    _PomeloEventCB evtCB;           //for listener
+    _PomeloEventBatchCB evtBatchCB; //for batch listener
+    _PomeloReqChunkCB chunkCB;      //for streamed request
+    _PomeloBatchCB batchCB;         //for batch
+    _PomeloExecutorCB executor;     //for requestOn, the result hops onto it
 
 #else
+    _PomeloUser(){ target = NULL; connSel = NULL; direct = false; streamWindow = 0; nextSubscriber = NULL; batch = NULL; batchIndex = 0; sentAt = 0; batchEvents = false; queued = false; };
+    ~_PomeloUser(){ delete nextSubscriber; releaseBatch(batch); };
+    
     CCObject* target;   //by ref
     union
     {
@@ -35,16 +262,167 @@ struct _PomeloUser
         PomeloReqResultHandler reqSel;  //for request
         PomeloNtfResultHandler ntfSel;  //for notify
         PomeloEventHandler evtSel;      //for listener
+        PomeloEventBatchHandler evtBatchSel;    //for batch listener
+        PomeloReqChunkHandler chunkSel; //for streamed request
+        PomeloBatchHandler batchSel;    //for batch
     };
 #endif
+    
+    bool direct;    //dispatch on libpomelo thread, see CCPomeloWrapper::request()
+    size_t streamWindow;    //> 0 for streamed request, see CCPomeloWrapper::requestStreamed()
+    string cacheKey;        //not empty if the response goes into the response cache
+    string collapseKey;     //not empty if identical requests may attach to this one
+    _PomeloUser* nextSubscriber;    //collapsed requests sharing the response, owned
+    _PomeloBatch* batch;    //member of a batch, holds a reference
+    size_t batchIndex;
+    double sentAt;          //request written to libpomelo, for the round trip time
+    bool batchEvents;       //listener takes a CCPomeloEventBatch, see CCPomeloWrapper::addBatchListener()
+    bool queued;            //handed to cocos thread by submitFromAnyThread(), told about refusals
+    
+    //taken from a freelist, every request/notify needs one
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+    static void trimPool();
+};
+
+/*
+ _PomeloUser的空闲链表，避免每次request/notify都分配内存。
+ Freed users are kept for the next ones, up to kUserPoolMax. Users come and
+ go on the cocos thread, submitting threads and the network thread, hence
+ the mutex; it is held for a couple of pointer moves only.
+ */
+static const size_t kUserPoolMax = 256;
+static pthread_mutex_t gUserPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static void* gUserPool = NULL;  //a free block starts with the next one
+static size_t gUserPoolSize = 0;
+
+void* _PomeloUser::operator new(size_t size)
+{
+    pthread_mutex_lock(&gUserPoolMutex);
+    void* p = gUserPool;
+    if(p)
+    {
+        gUserPool = *(void**)p;
+        gUserPoolSize--;
+    }
+    pthread_mutex_unlock(&gUserPoolMutex);
+    return p ? p : ::operator new(size);
+}
+void _PomeloUser::operator delete(void* p)
+{
+    if(!p)
+        return;
+    pthread_mutex_lock(&gUserPoolMutex);
+    if(gUserPoolSize < kUserPoolMax)
+    {
+        *(void**)p = gUserPool;
+        gUserPool = p;
+        gUserPoolSize++;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&gUserPoolMutex);
+    ::operator delete(p);
+}
+void _PomeloUser::trimPool()
+{
+    pthread_mutex_lock(&gUserPoolMutex);
+    void* p = gUserPool;
+    gUserPool = NULL;
+    gUserPoolSize = 0;
+    pthread_mutex_unlock(&gUserPoolMutex);
+    
+    while (p)
+    {
+        void* next = *(void**)p;
+        ::operator delete(p);
+        p = next;
+    }
+}
 
+struct _PomeloBatchEntry
+{
+    string route;
+    int status;
+    string resp;
+    bool landed;
+};
+
+//see CCPomeloWrapper::requestBatch()
+struct _PomeloBatch
+{
+    _PomeloUser* user;      //aggregated callback, owned
+    vector<_PomeloBatchEntry> entries;  //guarded by mMutex
+    size_t pending;         //entries not landed yet, guarded by mMutex
+    double deadline;        //0 for no timeout
+    _PomeloAtomic refs;     //CCPomeloImpl::mBatches + member users still alive
 };
+//member users may die on libpomelo thread (direct dispatch)
+static void releaseBatch(_PomeloBatch* batch)
+{
+    if(batch && batch->refs.add(-1) == 0)
+    {
+        delete batch->user;
+        delete batch;
+    }
+}
 
 struct _PomeloRequestResult
 {
     pc_request_t* request;  //by ref
     int status;
     string resp;
+    json_t* docs;   //streamed request only, resp is rendered chunk by chunk
+    unsigned int decodeSeq; //!= 0 while resp is being decoded by a worker
+};
+
+//a response delivered without touching the network: cache hit or replay
+struct _PomeloCacheHit
+{
+    _PomeloUser* user;
+    string route;
+    int status;
+    string resp;
+};
+
+struct _PomeloCachePolicy
+{
+    double ttl;
+    size_t maxEntries;
+    list<string> keys;  //oldest first
+};
+
+struct _PomeloCacheEntry
+{
+    string resp;
+    double expireAt;
+};
+
+//a streamed response being rendered across frames
+struct _PomeloStream
+{
+    pc_request_t* request;
+    _PomeloUser* user;
+    int status;
+    json_t* docs;       //see CCPomeloImpl::releaseDocs()
+    string text;        //already flat text (compressed envelope), sliced as is
+    size_t textPos;
+    void* iter;         //next object member
+    size_t index;       //next array element
+    bool opened;
+    bool closed;
+    string pending;     //rendered but not delivered yet
+};
+
+//a recorded session being fed back, see CCPomeloWrapper::replay()
+struct _PomeloReplay
+{
+    vector<_PomeloRecord> records;
+    size_t pos;         //next record to play
+    double start;
+    float speed;
+    map<string,queue<_PomeloUser*> > requests;  //made during replay, by route
+    map<string,queue<size_t> > responses;       //played but not claimed yet, by route
+    queue<pair<string,_PomeloUser*> > notifies;
 };
 
 struct _PomeloNotifyResult
@@ -56,857 +434,4540 @@ struct _PomeloNotifyResult
 struct _PomeloEvent
 {
     string event;
+    unsigned int hash;      //hashRoute(event), listeners are looked up by it
     string data;
+    unsigned int decodeSeq; //!= 0 while data is being decoded by a worker
 };
 
-CCPomeloRequestResult::CCPomeloRequestResult()
-{
-}
-CCPomeloNotifyResult::CCPomeloNotifyResult()
-{
-}
-CCPomeloEvent::CCPomeloEvent()
+//CCPomeloRouteHash() of the typed routes (FNV-1a), for names known at run time only
+static unsigned int hashRoute(const char* route)
 {
+    unsigned int h = 2166136261u;
+    for (const char* p = route; *p; p++)
+    {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
 }
-
-class CCPomeloImpl : 
 #if CCX3
-public cocos2d::Object
-#else
-public cocos2d::CCObject
+static_assert(CCPomeloRouteHash("onChat") == 0x82a235a6u, "the typed routes' hash must be hashRoute()'s");
 #endif
+
+//the exact listeners, keyed by route hash: a lookup is integer compares and
+//one string compare at the end, as different names may share a hash
+class _PomeloEventUserMap
 {
-    
 public:
-    CCPomeloImpl();
-    virtual ~CCPomeloImpl();
-    
-    CCPomeloStatus status() const;
+    struct Entry
+    {
+        string event;
+        _PomeloUser* user;  //owned by CCPomeloImpl
+    };
+    typedef multimap<unsigned int,Entry>::iterator iterator;
     
-    int connect(const char* host, int port);
+    iterator begin() { return mMap.begin(); }
+    iterator end() { return mMap.end(); }
+    void erase(iterator it) { mMap.erase(it); }
+    void clear() { mMap.clear(); }
     
-#if CCX3
-    int connectAsnyc(const char* host, int port, const PomeloAsyncConnCallback& callback);
+    iterator find(const char* event, unsigned int hash)
+    {
+        pair<iterator,iterator> range = mMap.equal_range(hash);
+        for (iterator it = range.first; it != range.second; it++)
+        {
+            if(it->second.event == event)
+                return it;
+        }
+        return mMap.end();
+    }
+    void set(const char* event, unsigned int hash, _PomeloUser* user)
+    {
+        iterator it = find(event, hash);
+        if(it == mMap.end())
+        {
+            Entry entry = {event, user};
+            it = mMap.insert(make_pair(hash, entry));
+        }
+        it->second.user = user;
+    }
     
-    int setDisconnectedCallback(const std::function<void()>& callback);
+private:
+    multimap<unsigned int,Entry> mMap;
+};
+
+struct _PomeloDeltaEvent
+{
+    string keyField;    //empty: one state for the event
+    bool full;          //listeners get the whole state, else the changed fields only
+    map<string,json_t*> docs;   //key => last state, never changed in place
+};
+
+//a heavy body handed to the decode workers, see CCPomeloWrapper::setDecodeWorkers()
+struct _PomeloDecodeJob
+{
+    unsigned int seq;
+    unsigned int generation;    //jobs of an earlier connection are dropped
+    json_t* docs;
+};
+
+//==================== transport ====================
+/*
+ What CCPomeloImpl needs from the wire, one object per connection. Calls and
+ callbacks are those of libpomelo, so every transport looks like libpomelo
+ to the wrapper: callbacks come from the transport's own thread, and
+ deleting it calls back the unfinished requests/notifies synchronously.
+ */
+class _PomeloTransport
+{
+public:
+    virtual ~_PomeloTransport() {}
     
-    int request(const char* route, const std::string& msg, const PomeloReqResultCallback& callback);
+    //blocking, @return: 0--connected
+    virtual int connect(struct sockaddr_in* address) = 0;
+    //@return: the connection request handed to cb once done, NULL if failed
+    virtual pc_connect_t* connectAsync(struct sockaddr_in* address, pc_connect_cb cb) = 0;
     
-    int notify(const char* route, const std::string& msg, const PomeloNtfResultCallback& callback);
+    virtual int request(pc_request_t* req, const char* route, json_t* msg, pc_request_cb cb) = 0;
+    virtual int notify(pc_notify_t* ntf, const char* route, json_t* msg, pc_notify_cb cb) = 0;
     
-    int addListener(const char* event, const PomeloEventCallback& callback);
-#else
-    int connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector);
+    virtual int addListener(const char* event, pc_event_cb cb) = 0;
+    virtual void removeListener(const char* event, pc_event_cb cb) = 0;
+};
 
-    int setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d::SEL_CallFunc pSelector);
-    
-    int request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector);
+//libpomelo tcp client
+class _PomeloTcpTransport : public _PomeloTransport
+{
+public:
+    _PomeloTcpTransport(const string& protoPath, const string& protoFile)
+    :mClient(pc_client_new())
+    {
+        if(!protoFile.empty())
+        {
+            //cached protos are sent back in handshake, libpomelo does the rest
+            pc_proto_init(mClient, protoPath.c_str(), protoFile.c_str());
+        }
+    }
+    virtual ~_PomeloTcpTransport() { pc_client_destroy(mClient); }
     
-    int notify(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector);
+    virtual int connect(struct sockaddr_in* address) { return pc_client_connect(mClient, address); }
+    virtual pc_connect_t* connectAsync(struct sockaddr_in* address, pc_connect_cb cb)
+    {
+        pc_connect_t* conn = pc_connect_req_new(address);
+        if(pc_client_connect2(mClient, conn, cb))
+        {
+            pc_connect_req_destroy(conn);
+            return NULL;
+        }
+        return conn;
+    }
     
-    int addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector);
-
-#endif
+    virtual int request(pc_request_t* req, const char* route, json_t* msg, pc_request_cb cb) { return pc_request(mClient, req, route, msg, cb); }
+    virtual int notify(pc_notify_t* ntf, const char* route, json_t* msg, pc_notify_cb cb) { return pc_notify(mClient, ntf, route, msg, cb); }
     
-    void stop();
-    void removeListener(const char* event);
-    void removeAllListeners();
+    virtual int addListener(const char* event, pc_event_cb cb) { return pc_add_listener(mClient, event, cb); }
+    virtual void removeListener(const char* event, pc_event_cb cb) { pc_remove_listener(mClient, event, cb); }
     
 private:
-    //callbacks for libpomelo
-    static void connectAsnycCallback(pc_connect_t* conn_req, int status);
-    static void requestCallback(pc_request_t *request, int status, json_t *docs);
-    static void notifyCallback(pc_notify_t *ntf, int status);
-    static void eventCallback(pc_client_t *client, const char *event, void *data);
-    static void disconnectedCallback(pc_client_t *client, const char *event, void *data);
+    pc_client_t* mClient;
+};
+
+//listeners of the transports that are not libpomelo, callbacks are made
+//outside the lock so they may add or remove listeners
+class _PomeloListenerList
+{
+public:
+    _PomeloListenerList() { pthread_mutex_init(&mMutex, NULL); }
+    ~_PomeloListenerList() { pthread_mutex_destroy(&mMutex); }
+    
+    void add(const char* event, pc_event_cb cb)
+    {
+        pthread_mutex_lock(&mMutex);
+        mListeners.insert(make_pair(string(event), cb));
+        pthread_mutex_unlock(&mMutex);
+    }
+    void remove(const char* event, pc_event_cb cb)
+    {
+        pthread_mutex_lock(&mMutex);
+        multimap<string,pc_event_cb>::iterator it = mListeners.lower_bound(event);
+        for (; it != mListeners.end() && it->first == event; it++)
+        {
+            if(it->second == cb)
+            {
+                mListeners.erase(it);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mMutex);
+    }
+    void emit(const string& event, json_t* docs)
+    {
+        vector<pc_event_cb> callbacks;
+        pthread_mutex_lock(&mMutex);
+        multimap<string,pc_event_cb>::iterator it = mListeners.lower_bound(event);
+        for (; it != mListeners.end() && it->first == event; it++)
+        {
+            callbacks.push_back(it->second);
+        }
+        pthread_mutex_unlock(&mMutex);
+        
+        for (size_t i = 0; i < callbacks.size(); i++)
+        {
+            callbacks[i](NULL, event.c_str(), docs);
+        }
+    }
     
 private:
-    void ccDispatcher(float delta);
-    void dispatchAsyncConnCallback();
-    void dispatchRequestCallbacks();
-    void dispatchNotifyCallbacks();
-    void dispatchEventCallbacks();
+    pthread_mutex_t mMutex;
+    multimap<string,pc_event_cb> mListeners;
+};
+
+/*
+ In-process transport paired with a CCPomeloLoopbackServer: a thread of its
+ own plays libpomelo's network thread, hands requests/notifies to the server
+ and delivers its answers & pushes through the very same callbacks, so
+ everything above the socket runs as usual.
+ */
+class _PomeloLoopbackTransport : public _PomeloTransport
+{
+public:
+    explicit _PomeloLoopbackTransport(CCPomeloLoopbackServer* server);
+    virtual ~_PomeloLoopbackTransport();
     
-    void pushReqResult(_PomeloRequestResult* reqResult);
-    void pushNtfResult(_PomeloNotifyResult* ntfResult);
-    void pushEvent(_PomeloEvent* event);
+    virtual int connect(struct sockaddr_in*) { return 0; }
+    virtual pc_connect_t* connectAsync(struct sockaddr_in* address, pc_connect_cb cb)
+    {
+        Job job;
+        job.conn = pc_connect_req_new(address);
+        job.connCB = cb;
+        post(job);
+        return job.conn;
+    }
     
-    _PomeloRequestResult* popReqResult(bool lock = true);
-    _PomeloNotifyResult* popNtfResult(bool lock = true);
-    _PomeloEvent* popEvent(bool lock = true);
+    virtual int request(pc_request_t* req, const char* route, json_t* msg, pc_request_cb cb)
+    {
+        //filled in like pc_request() does, pc_request_destroy() frees route
+        req->route = strdup(route);
+        req->msg = msg;
+        req->cb = cb;
+        
+        Job job;
+        job.req = req;
+        post(job);
+        return 0;
+    }
+    virtual int notify(pc_notify_t* ntf, const char* route, json_t* msg, pc_notify_cb cb)
+    {
+        ntf->route = strdup(route);
+        ntf->msg = msg;
+        ntf->cb = cb;
+        
+        Job job;
+        job.ntf = ntf;
+        post(job);
+        return 0;
+    }
     
-    void clearReqResource();
-    void clearNtfResource();
-    void clearAllPendingEvents();
+    virtual int addListener(const char* event, pc_event_cb cb)
+    {
+        mListeners.add(event, cb);
+        return 0;
+    }
+    virtual void removeListener(const char* event, pc_event_cb cb) { mListeners.remove(event, cb); }
     
-    void lock();
-    void unlock();
+    //from the server, any thread. docs NULL for PC_EVENT_DISCONNECT
+    void push(const char* event, json_t* docs)
+    {
+        Job job;
+        job.event = event;
+        job.docs = docs;
+        post(job);
+    }
     
 private:
-    CCPomeloStatus      mStatus;
-    pc_client_t*        mClient;
-    
-    _PomeloUser*            mAsyncConnUser;
-    bool                    mAsyncConnDispatchPending;
-    int                     mAsyncConnStatus;
-    pc_connect_t*       mAsyncConn; //by ref
-    
-    pthread_mutex_t     mMutex;
-#if CCX3
-    std::function<void()> mDisconnectCB;
-#else
-    CCObject*           mDisconnectCbTarget;
-    SEL_CallFunc        mDisconnectCbSelector;
-#endif
+    struct Job
+    {
+        Job() : conn(NULL), connCB(NULL), req(NULL), ntf(NULL), docs(NULL) {}
+        pc_connect_t* conn;
+        pc_connect_cb connCB;
+        pc_request_t* req;
+        pc_notify_t* ntf;
+        string event;   //a push if not empty
+        json_t* docs;   //owned
+    };
     
-    map<pc_request_t*,_PomeloUser*> mReqUserMap;
-    queue<_PomeloRequestResult*> mReqResultQueue;
+    void post(const Job& job)
+    {
+        pthread_mutex_lock(&mMutex);
+        mJobs.push(job);
+        pthread_cond_signal(&mCond);
+        pthread_mutex_unlock(&mMutex);
+    }
+    void run(const Job& job);
+    static void* worker(void* arg);
     
-    map<string,_PomeloUser*> mEventUserMap;
-    queue<_PomeloEvent*> mEventQueue;
+    _PomeloLoopbackLink* mLink;     //the server may go first
+    pthread_t mThread;
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+    queue<Job> mJobs;
+    bool mQuit;
+    _PomeloListenerList mListeners;
+};
+
+//shared by a server and the transports created for it, freed by the last one.
+//The server detaches itself on destruction, requests fail from then on.
+struct _PomeloLoopbackLink
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+    CCPomeloLoopbackServer* server;
+    _PomeloLoopbackTransport* transport;    //the latest connection gets the pushes
+    int refs;
+    int calls;  //onRequest()/onNotify() running
     
-    map<pc_notify_t*,_PomeloUser*> mNtfUserMap;
-    queue<_PomeloNotifyResult*> mNtfResultQueue;
+    static void release(_PomeloLoopbackLink* link)
+    {
+        pthread_mutex_lock(&link->mutex);
+        bool last = --link->refs == 0;
+        pthread_mutex_unlock(&link->mutex);
+        if(last)
+        {
+            pthread_cond_destroy(&link->idle);
+            pthread_mutex_destroy(&link->mutex);
+            delete link;
+        }
+    }
 };
 
-void CCPomeloImpl::ccDispatcher(float delta)
+_PomeloLoopbackTransport::_PomeloLoopbackTransport(CCPomeloLoopbackServer* server)
+:mLink(server->mLink),
+mQuit(false)
 {
-    dispatchAsyncConnCallback();
-    dispatchRequestCallbacks();
-    dispatchNotifyCallbacks();
-    dispatchEventCallbacks();
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+    pthread_create(&mThread, NULL, worker, this);
+    
+    pthread_mutex_lock(&mLink->mutex);
+    mLink->refs++;
+    mLink->transport = this;
+    pthread_mutex_unlock(&mLink->mutex);
 }
-void CCPomeloImpl::dispatchAsyncConnCallback()
+_PomeloLoopbackTransport::~_PomeloLoopbackTransport()
 {
-    if(mAsyncConnDispatchPending)
+    pthread_mutex_lock(&mLink->mutex);
+    if(mLink->transport == this)
+        mLink->transport = NULL;
+    pthread_mutex_unlock(&mLink->mutex);
+    
+    pthread_mutex_lock(&mMutex);
+    mQuit = true;
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mMutex);
+    pthread_join(mThread, NULL);
+    
+    //like pc_client_destroy(): unfinished ones are called back right here,
+    //then freed (the callback has released msg)
+    while (!mJobs.empty())
     {
-        mAsyncConnDispatchPending = false;
-        
-        pc_add_listener(mClient, PC_EVENT_DISCONNECT, disconnectedCallback);
-        
-        _PomeloUser* user = mAsyncConnUser;
-#if CCX3
-        if(user && user->connCB)
+        Job& job = mJobs.front();
+        if(job.conn)
         {
-            user->connCB(mAsyncConnStatus);
+            pc_connect_req_destroy(job.conn);
         }
-#else
-        if(user && user->target && user->connSel)
+        else if(job.req)
         {
-            PomeloAsyncConnHandler sel = user->connSel;
-            (user->target->*sel)(mAsyncConnStatus);
+            job.req->cb(job.req, -1, NULL);
+            pc_request_destroy(job.req);
         }
-#endif
-        
-        if(mAsyncConnUser == user)  //just in case of stop() called in cb
+        else if(job.ntf)
         {
-            delete mAsyncConnUser;
-            mAsyncConnUser = NULL;
+            job.ntf->cb(job.ntf, -1);
+            pc_notify_destroy(job.ntf);
         }
+        json_decref(job.docs);
+        mJobs.pop();
     }
+    
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+    _PomeloLoopbackLink::release(mLink);
 }
-void CCPomeloImpl::dispatchRequestCallbacks()
+void* _PomeloLoopbackTransport::worker(void* arg)
 {
-    _PomeloRequestResult* rst = popReqResult(mStatus == EPomeloConnected);
-    if(rst)
+    _PomeloLoopbackTransport* transport = (_PomeloLoopbackTransport*)arg;
+    while (true)
     {
-        _PomeloUser* user = NULL;
-        
-        if(mReqUserMap.find(rst->request) != mReqUserMap.end())
-        {
-            user = mReqUserMap[rst->request];
-            mReqUserMap.erase(rst->request);
-        }
-#if CCX3
-        //here is the good place to perform callback
-        if(user && user->reqCB)
+        pthread_mutex_lock(&transport->mMutex);
+        while (transport->mJobs.empty() && !transport->mQuit)
         {
-            CCPomeloRequestResult result;
-            result.requestRoute = rst->request->route;
-            result.status = rst->status;
-            result.jsonMsg = rst->resp;
-            
-            user->reqCB(result);
+            pthread_cond_wait(&transport->mCond, &transport->mMutex);
         }
-#else
-        //here is the good place to perform callback
-        if(user && user->target && user->reqSel)
+        if(transport->mQuit)
         {
-            CCPomeloRequestResult result;
-            result.requestRoute = rst->request->route;
-            result.status = rst->status;
-            result.jsonMsg = rst->resp;
-            
-            PomeloReqResultHandler sel = user->reqSel;
-            (user->target->*sel)(result);
+            pthread_mutex_unlock(&transport->mMutex);
+            break;
         }
-#endif
-
-        delete user;
+        Job job = transport->mJobs.front();
+        transport->mJobs.pop();
+        pthread_mutex_unlock(&transport->mMutex);
         
-        //fixme
-        json_decref(rst->request->msg);
-        pc_request_destroy(rst->request);
-        delete rst;
+        transport->run(job);
     }
+    return NULL;
 }
-void CCPomeloImpl::dispatchNotifyCallbacks()
+void _PomeloLoopbackTransport::run(const Job& job)
 {
-    _PomeloNotifyResult* rst = popNtfResult(mStatus == EPomeloConnected);
-    if(rst)
+    if(job.conn)
     {
-        _PomeloUser* user = NULL;
+        job.connCB(job.conn, 0);
+    }
+    else if(job.req || job.ntf)
+    {
+        //the server is held while called: its destructor waits for us
+        pthread_mutex_lock(&mLink->mutex);
+        CCPomeloLoopbackServer* server = mLink->server;
+        if(server)
+            mLink->calls++;
+        pthread_mutex_unlock(&mLink->mutex);
         
-        if(mNtfUserMap.find(rst->notify) != mNtfUserMap.end())
+        string msg;
+        dumpBody(job.req ? job.req->msg : job.ntf->msg, msg);
+        json_t* docs = NULL;
+        if(server && job.req)
         {
-            user = mNtfUserMap[rst->notify];
-            mNtfUserMap.erase(rst->notify);
+            string resp = server->onRequest(job.req->route, msg);
+            docs = loadJson(resp);
         }
-#if CCX3
-        if(user && user->ntfCB)
+        else if(server)
         {
-            CCPomeloNotifyResult result;
-            result.notifyRoute = rst->notify->route;
-            result.status = rst->status;
-            
-            user->ntfCB(result);
+            server->onNotify(job.ntf->route, msg);
         }
-#else
-        if(user && user->target && user->ntfSel)
+        
+        if(server)
         {
-            CCPomeloNotifyResult result;
-            result.notifyRoute = rst->notify->route;
-            result.status = rst->status;
-            
-            PomeloNtfResultHandler sel = user->ntfSel;
-            (user->target->*sel)(result);
+            pthread_mutex_lock(&mLink->mutex);
+            if(--mLink->calls == 0)
+                pthread_cond_broadcast(&mLink->idle);
+            pthread_mutex_unlock(&mLink->mutex);
         }
-#endif
-        delete user;
         
-        //fixme
-        json_decref(rst->notify->msg);
-        pc_notify_destroy(rst->notify);
-        delete rst;
+        if(job.req)
+            job.req->cb(job.req, docs ? 0 : -1, docs);
+        else
+            job.ntf->cb(job.ntf, server ? 0 : -1);
+        json_decref(docs);
     }
-}
-void CCPomeloImpl::dispatchEventCallbacks()
-{
-    _PomeloEvent* rst = popEvent(mStatus == EPomeloConnected);
-    if(rst)
+    else
     {
-        if(rst->event.compare(PC_EVENT_DISCONNECT) == 0)
-        {
-            //connection lost
-            stop(); //release data
-            
-#if CCX3
-            if (mDisconnectCB) {
-                mDisconnectCB();
-            }
-#else
-            if(mDisconnectCbTarget && mDisconnectCbSelector)
-            {
-                (mDisconnectCbTarget->*mDisconnectCbSelector)();
-            }
-#endif
-
-        }
-        else    //for customized events
-        {
-            _PomeloUser* user = NULL;
-            
-            if(mEventUserMap.find(rst->event) != mEventUserMap.end())
-            {
-                user = mEventUserMap[rst->event];
-            }
-            
-#if CCX3
-            if(user && user->evtCB)
-            {
-                CCPomeloEvent result;
-                result.event = rst->event;
-                result.jsonMsg = rst->data;
-                
-                user->evtCB(result);
-            }
-#else
-            if(user && user->target && user->evtSel)
-            {
-                CCPomeloEvent result;
-                result.event = rst->event;
-                result.jsonMsg = rst->data;
-                
-                PomeloEventHandler sel = user->evtSel;
-                (user->target->*sel)(result);
-            }
-#endif
-            
-
-        }
-        delete rst;
+        mListeners.emit(job.event, job.docs);
+        json_decref(job.docs);
     }
 }
 
-void CCPomeloImpl::pushReqResult(_PomeloRequestResult* reqResult)
+CCPomeloLoopbackServer::CCPomeloLoopbackServer()
+:mLink(new _PomeloLoopbackLink())
 {
-    mReqResultQueue.push(reqResult);
+    pthread_mutex_init(&mLink->mutex, NULL);
+    pthread_cond_init(&mLink->idle, NULL);
+    mLink->server = this;
+    mLink->transport = NULL;
+    mLink->refs = 1;
+    mLink->calls = 0;
 }
-void CCPomeloImpl::pushNtfResult(_PomeloNotifyResult* ntfResult)
+CCPomeloLoopbackServer::~CCPomeloLoopbackServer()
 {
-    mNtfResultQueue.push(ntfResult);
+    //transports still around fail what comes next
+    pthread_mutex_lock(&mLink->mutex);
+    mLink->server = NULL;
+    mLink->transport = NULL;
+    while (mLink->calls > 0)
+        pthread_cond_wait(&mLink->idle, &mLink->mutex);
+    pthread_mutex_unlock(&mLink->mutex);
+    
+    _PomeloLoopbackLink::release(mLink);
 }
-void CCPomeloImpl::pushEvent(_PomeloEvent* event)
+void CCPomeloLoopbackServer::onNotify(const std::string&, const std::string&)
 {
-    mEventQueue.push(event);
 }
-
-_PomeloRequestResult* CCPomeloImpl::popReqResult(bool lock/* = true*/)
+int CCPomeloLoopbackServer::push(const char* event, const std::string& msg)
 {
-    _PomeloRequestResult* rst = NULL;
-    if(lock)
-        pthread_mutex_lock(&mMutex);
-    if (mReqResultQueue.size() > 0)
+    json_t* docs = loadJson(msg);
+    if(!docs)
+        return -1;
+    
+    pthread_mutex_lock(&mLink->mutex);
+    _PomeloLoopbackTransport* transport = mLink->transport;
+    if(transport)
+        transport->push(event, docs);
+    pthread_mutex_unlock(&mLink->mutex);
+    
+    if(!transport)
     {
-        rst = mReqResultQueue.front();
-        mReqResultQueue.pop();
+        json_decref(docs);
+        return -1;
     }
-    if(lock)
-        pthread_mutex_unlock(&mMutex);
-    return rst;
+    return 0;
 }
-_PomeloNotifyResult* CCPomeloImpl::popNtfResult(bool lock/* = true*/)
+int CCPomeloLoopbackServer::disconnect()
 {
-    _PomeloNotifyResult* rst = NULL;
-    if(lock)
-        pthread_mutex_lock(&mMutex);
-    if (mNtfResultQueue.size() > 0)
-    {
-        rst = mNtfResultQueue.front();
-        mNtfResultQueue.pop();
-    }
-    if(lock)
-        pthread_mutex_unlock(&mMutex);
-    return rst;
+    pthread_mutex_lock(&mLink->mutex);
+    _PomeloLoopbackTransport* transport = mLink->transport;
+    if(transport)
+        transport->push(PC_EVENT_DISCONNECT, NULL);
+    pthread_mutex_unlock(&mLink->mutex);
+    
+    return transport ? 0 : -1;
 }
-_PomeloEvent* CCPomeloImpl::popEvent(bool lock/* = true*/)
+
+#if CCX3
+/*
+ Pomelo over a websocket, for servers behind a web gateway (pomelo's
+ hybridconnector or sioconnector-less ws setups). It speaks the protocol
+ libpomelo speaks over tcp, see CCPomeloInternal.h, with json bodies only:
+ no protobuf, setProtoCache() does not apply. cocos2d-x's WebSocket calls
+ back on cocos thread, so a thread of its own plays libpomelo's network
+ thread like the loopback transport does, and sends the heartbeats.
+ The handshake needs cocos thread to run: the blocking connect() fails.
+ */
+class _PomeloWebSocketTransport : public _PomeloTransport, public cocos2d::network::WebSocket::Delegate
 {
-    _PomeloEvent* evt = NULL;
-    if(lock)
-        pthread_mutex_lock(&mMutex);
-    if (mEventQueue.size() > 0)
+public:
+    explicit _PomeloWebSocketTransport(const string& url);
+    virtual ~_PomeloWebSocketTransport();
+    
+    virtual int connect(struct sockaddr_in*) { return -1; }
+    virtual pc_connect_t* connectAsync(struct sockaddr_in* address, pc_connect_cb cb);
+    
+    virtual int request(pc_request_t* req, const char* route, json_t* msg, pc_request_cb cb);
+    virtual int notify(pc_notify_t* ntf, const char* route, json_t* msg, pc_notify_cb cb);
+    
+    virtual int addListener(const char* event, pc_event_cb cb)
     {
-        evt = mEventQueue.front();
-        mEventQueue.pop();
+        mListeners.add(event, cb);
+        return 0;
     }
-    if(lock)
-        pthread_mutex_unlock(&mMutex);
-    return evt;
-}
+    virtual void removeListener(const char* event, pc_event_cb cb) { mListeners.remove(event, cb); }
+    
+    //cocos thread
+    virtual void onOpen(cocos2d::network::WebSocket*);
+    virtual void onMessage(cocos2d::network::WebSocket*, const cocos2d::network::WebSocket::Data& data);
+    virtual void onClose(cocos2d::network::WebSocket*);
+    virtual void onError(cocos2d::network::WebSocket*, const cocos2d::network::WebSocket::ErrorCode&);
+    
+private:
+    enum State
+    {
+        kConnecting,    //websocket opening, then handshake
+        kOpen,
+        kClosed
+    };
+    struct Job
+    {
+        Job() : conn(NULL), status(0), req(NULL), ntf(NULL), docs(NULL) {}
+        pc_connect_t* conn;
+        int status;
+        pc_request_t* req;
+        pc_notify_t* ntf;
+        string event;   //a push if not empty
+        json_t* docs;   //owned
+    };
+    
+    void post(const Job& job);  //mMutex held
+    int send(int type, const string& body);
+    string encode(int type, uint32_t id, const char* route, json_t* msg);
+    void handshake(const string& body);
+    void message(const string& body);
+    void lost(bool kicked);     //mMutex held
+    void run(const Job& job);
+    static void* worker(void* arg);
+    
+    string mUrl;
+    cocos2d::network::WebSocket* mSocket;
+    pthread_t mThread;
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+    queue<Job> mJobs;
+    bool mQuit;
+    _PomeloListenerList mListeners;
+    
+    State mState;
+    pc_connect_t* mConn;        //until the connection is open or failed
+    pc_connect_cb mConnCB;
+    uint32_t mNextId;
+    map<uint32_t,pc_request_t*> mRequests;  //waiting for responses
+    map<string,int> mRouteCodes;    //route dictionary of the handshake
+    map<int,string> mCodeRoutes;
+    double mHeartbeat;      //seconds, 0: none
+    double mNextBeat;       //0: waiting for the server's heartbeat
+    double mLastReceived;
+};
 
-void CCPomeloImpl::connectAsnycCallback(pc_connect_t* conn_req, int status)
+_PomeloWebSocketTransport::_PomeloWebSocketTransport(const string& url)
+:mUrl(url),
+mSocket(NULL),
+mQuit(false),
+mState(kConnecting),
+mConn(NULL),
+mConnCB(NULL),
+mNextId(1),
+mHeartbeat(0),
+mNextBeat(0),
+mLastReceived(0)
 {
-    pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+    pthread_create(&mThread, NULL, worker, this);
+}
+_PomeloWebSocketTransport::~_PomeloWebSocketTransport()
+{
+    pthread_mutex_lock(&mMutex);
+    mQuit = true;
+    mState = kClosed;   //close() may call onClose() right away
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mMutex);
+    pthread_join(mThread, NULL);
     
-    if(gPomelo->_theMagic->mAsyncConn != conn_req)
+    if(mSocket)
     {
-        //conn_req是一个已经被“断开”的连接。
-        //destory the connection
-        pc_client_t* client = conn_req->client;
-        pc_connect_req_destroy(conn_req);
-        
-        //fixme: pomelo forum guys said that
-        //we should not use pc_client_destory in worker thread
-        pc_client_stop(client);
+        mSocket->close();
+        delete mSocket;
     }
-    else
+    
+    //like pc_client_destroy(): unfinished ones are called back right here
+    if(mConn)
+        pc_connect_req_destroy(mConn);
+    while (!mJobs.empty())
     {
-        pc_connect_req_destroy(conn_req);
-        
-        gPomelo->_theMagic->mStatus = EPomeloConnected;
-        gPomelo->_theMagic->mAsyncConnStatus = status;
-        gPomelo->_theMagic->mAsyncConnDispatchPending = true;
-        gPomelo->_theMagic->mAsyncConn = NULL;
-        
-#if CCX3
-        CCDirector::getInstance()->getScheduler()->resumeTarget(gPomelo->_theMagic);
-#else
-        CCDirector::sharedDirector()->getScheduler()->resumeTarget(gPomelo->_theMagic);
-#endif
-        
+        Job& job = mJobs.front();
+        if(job.conn)
+        {
+            pc_connect_req_destroy(job.conn);
+        }
+        else if(job.req)
+        {
+            job.req->cb(job.req, -1, NULL);
+            pc_request_destroy(job.req);
+        }
+        else if(job.ntf)
+        {
+            job.ntf->cb(job.ntf, -1);
+            pc_notify_destroy(job.ntf);
+        }
+        json_decref(job.docs);
+        mJobs.pop();
+    }
+    for (map<uint32_t,pc_request_t*>::iterator it = mRequests.begin(); it != mRequests.end(); it++)
+    {
+        it->second->cb(it->second, -1, NULL);
+        pc_request_destroy(it->second);
     }
     
-    pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
 }
 
-void CCPomeloImpl::requestCallback(pc_request_t *request, int status, json_t *docs)
+pc_connect_t* _PomeloWebSocketTransport::connectAsync(struct sockaddr_in* address, pc_connect_cb cb)
 {
-    if(gPomelo->status() == EPomeloStopping)
+    mSocket = new cocos2d::network::WebSocket();
+    if(!mSocket->init(*this, mUrl))
     {
-        /*
+        delete mSocket;
+        mSocket = NULL;
+        return NULL;
+    }
+    pthread_mutex_lock(&mMutex);
+    mConn = pc_connect_req_new(address);
+    mConnCB = cb;
+    pc_connect_t* conn = mConn;
+    pthread_mutex_unlock(&mMutex);
+    return conn;
+}
+
+int _PomeloWebSocketTransport::request(pc_request_t* req, const char* route, json_t* msg, pc_request_cb cb)
+{
+    pthread_mutex_lock(&mMutex);
+    if(mState != kOpen)
+    {
+        pthread_mutex_unlock(&mMutex);
+        return -1;
+    }
+    uint32_t id = mNextId++;
+    string package = encode(kMessageRequest, id, route, msg);
+    if(package.empty())
+    {
+        pthread_mutex_unlock(&mMutex);
+        return -1;
+    }
+    //filled in like pc_request() does, pc_request_destroy() frees route
+    req->id = id;
+    req->route = strdup(route);
+    req->msg = msg;
+    req->cb = cb;
+    mRequests[id] = req;
+    pthread_mutex_unlock(&mMutex);
+    
+    mSocket->send((const unsigned char*)package.data(), (unsigned int)package.size());
+    return 0;
+}
+int _PomeloWebSocketTransport::notify(pc_notify_t* ntf, const char* route, json_t* msg, pc_notify_cb cb)
+{
+    pthread_mutex_lock(&mMutex);
+    string package = mState == kOpen ? encode(kMessageNotify, 0, route, msg) : string();
+    if(package.empty())
+    {
+        pthread_mutex_unlock(&mMutex);
+        return -1;
+    }
+    ntf->route = strdup(route);
+    ntf->msg = msg;
+    ntf->cb = cb;
+    
+    //done once handed to the socket, as libpomelo's are once written
+    Job job;
+    job.ntf = ntf;
+    post(job);
+    pthread_mutex_unlock(&mMutex);
+    
+    mSocket->send((const unsigned char*)package.data(), (unsigned int)package.size());
+    return 0;
+}
+
+void _PomeloWebSocketTransport::post(const Job& job)
+{
+    mJobs.push(job);
+    pthread_cond_signal(&mCond);
+}
+int _PomeloWebSocketTransport::send(int type, const string& body)
+{
+    string package;
+    if(!encodePackage(type, body, package))
+        return -1;
+    mSocket->send((const unsigned char*)package.data(), (unsigned int)package.size());
+    return 0;
+}
+//a data package, empty if it can not be encoded. mMutex held (route dictionary)
+string _PomeloWebSocketTransport::encode(int type, uint32_t id, const char* route, json_t* msg)
+{
+    map<string,int>::iterator code = mRouteCodes.find(route);
+    string body, message, package;
+    dumpBody(msg, body);
+    if(!encodeMessage(type, id, route, code != mRouteCodes.end() ? code->second : -1, body, message))
+        return string();
+    if(!encodePackage(kPackageData, message, package))
+        return string();
+    return package;
+}
+
+void _PomeloWebSocketTransport::onOpen(cocos2d::network::WebSocket*)
+{
+    json_t* sys = json_object();
+    json_object_set_new(sys, "type", json_string("cocos2dx-websocket"));
+    json_object_set_new(sys, "version", json_string("0.1.0"));
+    json_t* docs = json_object();
+    json_object_set_new(docs, "sys", sys);
+    json_object_set_new(docs, "user", json_object());
+    string body;
+    dumpJson(docs, body);
+    json_decref(docs);
+    
+    send(kPackageHandshake, body);
+}
+void _PomeloWebSocketTransport::onMessage(cocos2d::network::WebSocket*, const cocos2d::network::WebSocket::Data& data)
+{
+    vector<_PomeloPackage> packages;
+    bool whole = decodePackages(data.bytes, data.len, packages);
+    
+    for (size_t i = 0; i < packages.size(); i++)
+    {
+        pthread_mutex_lock(&mMutex);
+        if(mState == kClosed)
+        {
+            pthread_mutex_unlock(&mMutex);
+            return;
+        }
+        mLastReceived = nowSeconds();
+        
+        switch (packages[i].type)
+        {
+            case kPackageHandshake:
+                handshake(packages[i].body);
+                break;
+            case kPackageHeartbeat:
+                if(mHeartbeat > 0)
+                {
+                    mNextBeat = mLastReceived + mHeartbeat;
+                    pthread_cond_signal(&mCond);
+                }
+                break;
+            case kPackageData:
+                message(packages[i].body);
+                break;
+            case kPackageKick:
+                lost(true);
+                break;
+        }
+        pthread_mutex_unlock(&mMutex);
+    }
+    
+    if(!whole)
+    {
+        CCLOG("pomelo websocket: a frame that is not a package, %d bytes", (int)data.len);
+    }
+}
+void _PomeloWebSocketTransport::onClose(cocos2d::network::WebSocket*)
+{
+    pthread_mutex_lock(&mMutex);
+    lost(false);
+    pthread_mutex_unlock(&mMutex);
+}
+void _PomeloWebSocketTransport::onError(cocos2d::network::WebSocket*, const cocos2d::network::WebSocket::ErrorCode&)
+{
+    pthread_mutex_lock(&mMutex);
+    lost(false);
+    pthread_mutex_unlock(&mMutex);
+}
+
+//mMutex held
+void _PomeloWebSocketTransport::handshake(const string& body)
+{
+    json_t* docs = loadJson(body);
+    json_t* sys = json_object_get(docs, "sys");
+    if(mState != kConnecting || json_integer_value(json_object_get(docs, "code")) != 200)
+    {
+        json_decref(docs);
+        lost(false);
+        return;
+    }
+    
+    mHeartbeat = (double)json_integer_value(json_object_get(sys, "heartbeat"));
+    json_t* dict = json_object_get(sys, "dict");
+    for (void* it = json_object_iter(dict); it; it = json_object_iter_next(dict, it))
+    {
+        int code = (int)json_integer_value(json_object_iter_value(it));
+        mRouteCodes[json_object_iter_key(it)] = code;
+        mCodeRoutes[code] = json_object_iter_key(it);
+    }
+    json_decref(docs);
+    
+    send(kPackageHandshakeAck, string());
+    mState = kOpen;
+    
+    Job job;
+    job.conn = mConn;
+    job.status = 0;
+    post(job);
+    mConn = NULL;
+}
+//mMutex held
+void _PomeloWebSocketTransport::message(const string& body)
+{
+    _PomeloMessage msg;
+    if(!decodeMessage(body.data(), body.size(), msg))
+    {
+        CCLOG("pomelo websocket: a message that can not be decoded, %d bytes", (int)body.size());
+        return;
+    }
+    
+    Job job;
+    if(msg.type == kMessageResponse)
+    {
+        map<uint32_t,pc_request_t*>::iterator it = mRequests.find(msg.id);
+        if(it == mRequests.end())
+            return;
+        job.req = it->second;
+        job.docs = loadJson(msg.body);
+        job.status = job.docs ? 0 : -1;
+        mRequests.erase(it);
+    }
+    else if(msg.type == kMessagePush)
+    {
+        if(msg.routeCode >= 0)
+        {
+            map<int,string>::iterator it = mCodeRoutes.find(msg.routeCode);
+            if(it == mCodeRoutes.end())
+                return;
+            msg.route = it->second;
+        }
+        job.event = msg.route;
+        job.docs = loadJson(msg.body);
+        if(job.event.empty() || !job.docs)
+        {
+            json_decref(job.docs);
+            return;
+        }
+    }
+    else
+    {
+        return;
+    }
+    post(job);
+}
+//the connection failed, was closed or kicked. mMutex held
+void _PomeloWebSocketTransport::lost(bool kicked)
+{
+    if(mState == kClosed)
+        return;
+    
+    if(mState == kConnecting)
+    {
+        Job job;
+        job.conn = mConn;
+        job.status = -1;
+        mConn = NULL;
+        if(job.conn)
+            post(job);
+    }
+    else
+    {
+        Job job;
+        if(kicked)
+        {
+            job.event = PC_EVENT_KICK;
+            post(job);
+        }
+        job.event = PC_EVENT_DISCONNECT;
+        post(job);
+    }
+    mState = kClosed;
+}
+
+void* _PomeloWebSocketTransport::worker(void* arg)
+{
+    _PomeloWebSocketTransport* transport = (_PomeloWebSocketTransport*)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&transport->mMutex);
+        bool beat = false;
+        while (transport->mJobs.empty() && !transport->mQuit)
+        {
+            if(transport->mState != kOpen || transport->mHeartbeat <= 0)
+            {
+                pthread_cond_wait(&transport->mCond, &transport->mMutex);
+                continue;
+            }
+            
+            //the server is gone after missing a heartbeat for as long again
+            double now = nowSeconds();
+            double timeout = transport->mLastReceived + transport->mHeartbeat * 2;
+            if(now >= timeout)
+            {
+                CCLOG("pomelo websocket: heartbeat timeout");
+                transport->lost(false);
+                continue;
+            }
+            if(transport->mNextBeat > 0 && now >= transport->mNextBeat)
+            {
+                transport->mNextBeat = 0;
+                beat = true;
+                break;
+            }
+            
+            double deadline = transport->mNextBeat > 0 ? min(timeout, transport->mNextBeat) : timeout;
+            struct timespec ts;
+            ts.tv_sec = (time_t)deadline;
+            ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1000000000);
+            pthread_cond_timedwait(&transport->mCond, &transport->mMutex, &ts);
+        }
+        if(transport->mQuit)
+        {
+            pthread_mutex_unlock(&transport->mMutex);
+            break;
+        }
+        if(beat)
+        {
+            pthread_mutex_unlock(&transport->mMutex);
+            transport->send(kPackageHeartbeat, string());
+            continue;
+        }
+        Job job = transport->mJobs.front();
+        transport->mJobs.pop();
+        pthread_mutex_unlock(&transport->mMutex);
+        
+        transport->run(job);
+    }
+    return NULL;
+}
+void _PomeloWebSocketTransport::run(const Job& job)
+{
+    if(job.conn)
+    {
+        mConnCB(job.conn, job.status);
+    }
+    else if(job.req)
+    {
+        job.req->cb(job.req, job.status, job.docs);
+        json_decref(job.docs);
+    }
+    else if(job.ntf)
+    {
+        job.ntf->cb(job.ntf, 0);
+    }
+    else
+    {
+        mListeners.emit(job.event, job.docs);
+        json_decref(job.docs);
+    }
+}
+#endif
+
+//a connection attempt cancelled by stop(). The client can not be destroyed
+//while libpomelo is connecting, so it waits for its connect callback and is
+//then destroyed on cocos thread, see CCPomeloImpl::reapOrphans()
+struct _PomeloOrphan
+{
+    _PomeloTransport* transport;
+    pc_connect_t* conn;
+    bool done;  //connect callback has run
+};
+
+//token bucket of setRateLimit()
+struct _PomeloBucket
+{
+    float rate;     //tokens per second
+    float burst;    //capacity
+    double tokens;
+    double updatedAt;
+    CCPomeloLimitPolicy policy;
+};
+static bool refillBucket(_PomeloBucket* bucket, double now)
+{
+    if(!bucket)
+        return true;
+    bucket->tokens = min((double)bucket->burst, bucket->tokens + (now - bucket->updatedAt) * bucket->rate);
+    bucket->updatedAt = now;
+    return bucket->tokens >= 1;
+}
+
+//a message held back by a rate limiter
+struct _PomeloShaped
+{
+    char kind;      //kOutboxRequest or kOutboxNotify
+    string route;
+    json_t* body;   //owned
+    _PomeloUser* user;  //owned; merged notifies chained by nextSubscriber
+};
+
+//filter of subscribed event names, read lock-free by eventCallback.
+//One bit per hash bucket, 32 bits a word (long may be 32 bits wide):
+//a clear bit means nobody listens, a set one may be a collision.
+static const int kEventFilterWords = 32;
+static const unsigned int kEventFilterBits = kEventFilterWords * 32;
+
+CCPomeloRequestResult::CCPomeloRequestResult()
+:docs(NULL)
+{
+}
+void CCPomeloRequestResult::takeJsonMsg(std::string& out)
+{
+    out.clear();
+    if(docs && jsonMsg.empty())
+    {
+        dumpJson(docs, out);    //direct dispatch
+        docs = NULL;    //lent, taken like jsonMsg
+    }
+    else
+    {
+        out.swap(jsonMsg);
+    }
+}
+CCPomeloNotifyResult::CCPomeloNotifyResult()
+{
+}
+CCPomeloBatchResult::CCPomeloBatchResult()
+:status(0),
+timedOut(false)
+{
+}
+CCPomeloEvent::CCPomeloEvent()
+:docs(NULL)
+{
+}
+CCPomeloEventBatch::CCPomeloEventBatch()
+{
+}
+CCPomeloResponseChunk::CCPomeloResponseChunk()
+:status(0),
+last(false)
+{
+}
+void CCPomeloEvent::takeJsonMsg(std::string& out)
+{
+    out.clear();
+    if(docs && jsonMsg.empty())
+    {
+        dumpJson(docs, out);    //direct dispatch
+        docs = NULL;    //lent, taken like jsonMsg
+    }
+    else
+    {
+        out.swap(jsonMsg);
+    }
+}
+
+class CCPomeloImpl;
+
+//one-shot timer waking the paused dispatcher, see CCPomeloImpl::wakeAt().
+//A target of its own: pauseTarget() on the dispatcher pauses all its timers.
+class _PomeloWakeTimer :
+#if CCX3
+public cocos2d::Object
+#else
+public cocos2d::CCObject
+#endif
+{
+public:
+    explicit _PomeloWakeTimer(CCPomeloImpl* impl) : mImpl(impl) {}
+    void fire(float delta);
+    
+private:
+    CCPomeloImpl* mImpl;
+};
+
+class CCPomeloImpl : 
+#if CCX3
+public cocos2d::Object
+#else
+public cocos2d::CCObject
+#endif
+{
+    
+public:
+    CCPomeloImpl();
+    virtual ~CCPomeloImpl();
+    
+    CCPomeloStatus status() const;
+    
+    int connect(const char* host, int port);
+    
+#if CCX3
+    int connectAsnyc(const char* host, int port, const PomeloAsyncConnCallback& callback);
+    
+    int setDisconnectedCallback(const std::function<void()>& callback);
+    
+    int request(const char* route, const std::string& msg, _PomeloReqResultCB callback, bool direct);
+    int request(const char* route, json_t* msg, _PomeloReqResultCB callback, bool direct);
+    
+    int notify(const char* route, const std::string& msg, _PomeloNtfResultCB callback);
+    int notify(const char* route, json_t* msg, _PomeloNtfResultCB callback);
+    
+    int addListener(const char* event, unsigned int hash, _PomeloEventCB callback, bool direct);
+    int addPatternListener(const char* pattern, _PomeloEventCB callback, bool direct);
+    int addBatchListener(const char* event, _PomeloEventBatchCB callback);
+    
+    int requestStreamed(const char* route, const std::string& msg, size_t window, _PomeloReqChunkCB callback);
+    
+    int requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, _PomeloBatchCB callback);
+    
+    int requestOn(_PomeloExecutorCB executor, const char* route, const std::string& msg, _PomeloReqResultCB callback);
+    
+    template <typename M>
+    CCPomeloFuture<CCPomeloRequestResult> requestFuture(const char* route, M msg);
+#else
+    int connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector);
+
+    int setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d::SEL_CallFunc pSelector);
+    
+    int request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool direct);
+    int request(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool direct);
+    
+    int notify(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector);
+    int notify(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector);
+    
+    int addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool direct);
+    int addPatternListener(const char* pattern, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool direct);
+    int addBatchListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventBatchHandler pCallbackSelector);
+    
+    int requestStreamed(const char* route, const std::string& msg, size_t window, cocos2d::CCObject* pCallbackTarget, PomeloReqChunkHandler pCallbackSelector);
+    
+    int requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, cocos2d::CCObject* pCallbackTarget, PomeloBatchHandler pCallbackSelector);
+
+#endif
+    
+    void setProtoCache(const char* path, const char* file);
+    void setLoopbackServer(CCPomeloLoopbackServer* server);
+#if CCX3
+    void setWebSocket(const char* path, bool secure);
+#endif
+    
+    void setCompression(const char* route, int threshold);
+    
+    void setCachePolicy(const char* route, float ttl, int maxEntries);
+    CCPomeloCacheStats cacheStats() const;
+    
+    int setClockSync(const char* timeKey, const char* route, float interval);
+    CCPomeloNetStats netStats() const;
+    double serverTime() const;
+#if CCX3
+    void setNetStatsCallback(const PomeloNetStatsCallback& callback);
+#else
+    void setNetStatsCallback(cocos2d::CCObject* pTarget, PomeloNetStatsHandler pSelector);
+#endif
+    
+    void setRateLimit(const char* route, float rate, int burst, CCPomeloLimitPolicy policy);
+    CCPomeloRateLimitStats rateLimitStats() const;
+#if CCX3
+    void setRateLimitCallback(const PomeloRateLimitCallback& callback);
+#else
+    void setRateLimitCallback(cocos2d::CCObject* pTarget, PomeloRateLimitHandler pSelector);
+#endif
+    
+    void setRequestCollapsing(bool enabled);
+    
+    void clearCache();
+    
+    int enableOutbox(const char* path, size_t capacity);
+    void disableOutbox();
+    
+    int startRecording(const char* path);
+    void stopRecording();
+    int replay(const char* path, float speed);
+    bool isReplaying() const;
+    
+    int setDecodeWorkers(int count, int threshold);
+    
+    void setDeltaEvent(const char* event, const char* keyField, bool full);
+    void removeDeltaEvent(const char* event);
+    
+    void stop();
+    void removeListener(const char* event, unsigned int hash);
+    int listen(const char* event, unsigned int hash, _PomeloUser* user);
+    void unlisten(const char* event, unsigned int hash, bool transportSafe);
+    void removeAllListeners();
+    
+    int registerEventRoutes(const std::vector<std::string>& events);
+    void removePatternListener(const char* pattern);
+    long droppedEvents() const;
+    
+private:
+    _PomeloTransport* newTransport(const char* host, int port);
+    
+    bool zipThreshold(const char* route, size_t& threshold) const;
+    json_t* packBody(const char* route, const std::string& msg);
+    json_t* packBody(const char* route, json_t* msg);
+    
+    int stash(char kind, const char* route, const std::string& msg, _PomeloUser* user);
+    int stash(char kind, const char* route, json_t* msg, _PomeloUser* user);
+    void flushOutbox();
+    
+    void record(char kind, const char* route, int status, json_t* docs);
+    int replayMessage(char kind, const char* route, _PomeloUser* user);
+    void endReplay();
+    
+    int issueRequest(const char* route, const std::string& msg, _PomeloUser* user);
+    int submitRequest(const char* route, const std::string& msg, _PomeloUser* user);
+    int submitRequest(const char* route, json_t* msg, _PomeloUser* user);
+    
+    int startBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, _PomeloUser* user);
+    void landBatchEntry(_PomeloBatch* batch, size_t index, CCPomeloRequestResult& result);
+    void deliverBatch(_PomeloBatch* batch, bool timedOut);
+    void flushBatches();
+    
+    void addNetSample(double rtt, double serverTime, double now);
+    void resetNetStats();
+    int sendRequest(const char* route, json_t* body, _PomeloUser* user);
+    void refuse(char kind, const char* route, _PomeloUser* user);
+    int writeRequest(const char* route, json_t* body, _PomeloUser*& user);
+    int writeNotify(const char* route, json_t* body, _PomeloUser*& user);
+    bool shape(char kind, const char* route, json_t* body, _PomeloUser* user, int& ret);
+    void dispatchShaped();
+    
+    static string cacheKey(const char* route, json_t* msg);
+    bool lookupCache(const string& route, const string& key, string& resp);
+    void storeCache(const string& route, const string& key, const string& resp);
+    void evictCache(_PomeloCachePolicy& policy, list<string>::iterator key);
+    int sendNotify(const char* route, json_t* body, _PomeloUser* user);
+    
+    bool onCocosThread() const;
+    bool lockSubmit();
+    void unlockSubmit();
+    int submitFromAnyThread(char kind, const char* route, json_t* body, _PomeloUser* user);
+    void dispatchSubmissions();
+    void clearSubmissions();
+    
+private:
+    //callbacks for libpomelo
+    static void connectAsnycCallback(pc_connect_t* conn_req, int status);
+    static void requestCallback(pc_request_t *request, int status, json_t *docs);
+    static void notifyCallback(pc_notify_t *ntf, int status);
+    static void eventCallback(pc_client_t *client, const char *event, void *data);
+    static void disconnectedCallback(pc_client_t *client, const char *event, void *data);
+    
+private:
+    void ccDispatcher(float delta);
+    void dispatchAsyncConnCallback();
+    void dispatchRequestCallbacks();
+    void dispatchNotifyCallbacks();
+    void dispatchEventCallbacks();
+    void dispatchStreams();
+    void dispatchCacheHits();
+    void dispatchReplay();
+    void dispatchBatches();
+    void dispatchNetStats();
+    bool renderStream(_PomeloStream* stream);
+    
+    //results are taken by the callbacks
+    static void performReqCallback(_PomeloUser* user, CCPomeloRequestResult& result);
+    static void performReqCallbacks(_PomeloUser* user, CCPomeloRequestResult& result);
+    static void performChunkCallback(_PomeloUser* user, const CCPomeloResponseChunk& chunk);
+    static void performEventCallback(_PomeloUser* user, CCPomeloEvent& result);
+    static void performEventBatchCallback(_PomeloUser* user, CCPomeloEventBatch& batch);
+    static void performNtfCallback(_PomeloUser* user, const CCPomeloNotifyResult& result);
+    static void performShapedFailure(const _PomeloShaped& shaped);
+    static void performBatchCallback(_PomeloUser* user, CCPomeloBatchResult& result);
+    
+    void addReqUser(pc_request_t* req, _PomeloUser* user);
+    void addEventUser(const char* event, unsigned int hash, _PomeloUser* user);
+    void addNtfUser(pc_notify_t* ntf, _PomeloUser* user);
+    
+    void wakeDispatcher();
+    void wakeAt(double when);
+    void wakeTimerFired();
+    friend class _PomeloWakeTimer;
+    void updateWorkPending();
+    
+    void pushReqResult(_PomeloRequestResult* reqResult);
+    void pushNtfResult(_PomeloNotifyResult* ntfResult);
+    void pushEvent(_PomeloEvent* event);
+    
+    _PomeloRequestResult* popReqResult(bool lock = true);
+    _PomeloNotifyResult* popNtfResult(bool lock = true);
+    _PomeloEvent* popEvent(bool lock = true);
+    void takeEventBatch(const string& event, vector<string>& out);
+    
+    void clearReqResource();
+    void clearNtfResource();
+    void clearAllPendingEvents();
+    
+    int addPatternUser(const char* pattern, _PomeloUser* user);
+    void updateEventFilter();
+    json_t* applyDelta(const char* event, json_t* docs);
+    void resetDeltaDocs();
+    void registerDeltaEvents();
+    void reapOrphans();
+    bool maySubscribe(unsigned int hash) const;
+    bool mayDispatchDirect(unsigned int hash) const;
+    _PomeloUser* findEventUser(const char* event, unsigned int hash);
+    void retireEventUser(_PomeloUser* user);
+    bool isRoutedEvent(const string& event);
+    void deleteRetiredUsers();
+    void clearStreams(vector<pair<_PomeloUser*, CCPomeloResponseChunk> >& ended);
+    
+    void releaseDocs(json_t* docs);
+    void drainReleasedDocs(bool lock = true);
+    
+    bool isHeavy(json_t* docs) const;
+    _PomeloDecodeJob newDecodeJob(json_t* docs);
+    void queueDecodeJob(const _PomeloDecodeJob& job);
+    bool takeDecoded(unsigned int& seq, string& out);
+    void stopDecodeWorkers();
+    static void* decodeWorker(void* arg);
+    
+    void lock();
+    void unlock();
+    
+private:
+    CCPomeloStatus      mStatus;
+    _PomeloTransport*   mTransport;     //the connection, owned
+    CCPomeloLoopbackServer* mLoopbackServer;    //by ref, replaces tcp if set
+    string              mWebSocketPath; //3.x, replaces tcp if not empty
+    bool                mWebSocketSecure;
+    string              mProtoPath;
+    string              mProtoFile;
+    map<string,size_t>  mZipThresholds; //route => min body size to compress, guarded by mZipMutex
+    mutable pthread_mutex_t mZipMutex;  //packBody() runs on submitting threads too
+    
+    _PomeloUser*            mAsyncConnUser;
+    bool                    mAsyncConnDispatchPending;
+    _PomeloAtomic           mWorkPending;   //set by libpomelo thread, read lock-free by ccDispatcher
+    int                     mAsyncConnStatus;
+    pc_connect_t*       mAsyncConn; //by ref
+    
+    mutable pthread_mutex_t mMutex;
+    pthread_rwlock_t    mSubmitLock;    //read: submission off the cocos thread; write: stop()
+    pthread_mutex_t     mSubmitMutex;   //guards mSubmissions, never held while waiting for anything
+    list<_PomeloShaped> mSubmissions;   //off the cocos thread while not connected, see submitFromAnyThread()
+    pthread_t           mCocosThread;
+#if CCX3
+    std::function<void()> mDisconnectCB;
+#else
+    CCObject*           mDisconnectCbTarget;
+    SEL_CallFunc        mDisconnectCbSelector;
+#endif
+    
+    map<pc_request_t*,_PomeloUser*> mReqUserMap;
+    queue<_PomeloRequestResult*> mReqResultQueue;
+    
+    _PomeloEventUserMap mEventUserMap;
+    deque<_PomeloEvent*> mEventQueue;   //a deque, batch listeners take events out of the middle
+    
+    _PomeloRouteTrie<_PomeloUser> mPatternListeners;  //written on cocos thread, guarded by mMutex
+    set<string>         mRoutedEvents;      //registered with libpomelo for the patterns
+    vector<_PomeloUser*> mRetiredUsers;     //listeners removed off the cocos thread, or while called
+    _PomeloUser*        mPinnedEventUser;   //direct listener being called, guarded by mMutex
+    _PomeloAtomic       mEventFilter[kEventFilterWords];    //see updateEventFilter()
+    _PomeloAtomic       mDirectFilter[kEventFilterWords];   //the direct listeners among them
+    _PomeloAtomic       mDroppedEvents;     //pushed while nobody listened
+    
+    map<string,_PomeloDeltaEvent> mDeltaEvents;    //guarded by mDeltaMutex
+    pthread_mutex_t     mDeltaMutex;
+    _PomeloAtomic       mDeltaEventCount;   //read lock-free by eventCallback
+    
+    list<_PomeloOrphan> mOrphans;       //cancelled connection attempts, guarded by mMutex
+    _PomeloAtomic       mReapable;      //orphans done connecting
+    
+    map<pc_notify_t*,_PomeloUser*> mNtfUserMap;
+    queue<_PomeloNotifyResult*> mNtfResultQueue;
+    
+    list<_PomeloStream*> mStreams;      //cocos thread only
+    _PomeloStream*      mDeliveringStream;  //its chunk callback is running, see clearStreams()
+    
+    map<string,_PomeloCachePolicy> mCachePolicies;  //by route
+    map<string,_PomeloCacheEntry> mCache;           //by cacheKey()
+    queue<_PomeloCacheHit*> mCacheHitQueue;
+    CCPomeloCacheStats  mCacheStats;
+    
+    bool                mCollapseRequests;
+    map<string,_PomeloUser*> mInflightRequests;     //by collapseKey, by ref
+    
+    _PomeloOutbox       mOutbox;
+    map<unsigned int,_PomeloUser*> mOutboxUsers;    //by record seq
+    
+    list<_PomeloBatch*> mBatches;       //cocos thread only, each holds a reference
+    
+    CCPomeloNetStats    mNetStats;          //guarded by mMutex
+    bool                mNetStatsDirty;     //guarded by mMutex
+    double              mNetStatsNotifiedAt;
+    double              mClockSamples[8][2];    //recent {rtt, offset}, guarded by mMutex
+    unsigned int        mClockSampleCount;
+    string              mClockKey;
+    string              mClockRoute;
+    float               mClockInterval;
+    double              mNextClockPing;
+    _PomeloWakeTimer*   mWakeTimer;
+    double              mWakeAt;            //0: not armed, cocos thread only
+#if CCX3
+    PomeloNetStatsCallback mNetStatsCB;
+#else
+    CCObject*           mNetStatsCbTarget;
+    PomeloNetStatsHandler mNetStatsCbSelector;
+#endif
+    
+    //rate limiters, guarded by mMutex
+    map<string,_PomeloBucket> mRouteLimits;
+    _PomeloBucket       mGlobalLimit;       //off while rate is 0
+    _PomeloAtomic       mLimiterCount;      //read lock-free by sendRequest()/sendNotify()
+    list<_PomeloShaped> mShaped;            //held back, in submission order
+    map<string,unsigned int> mShapedRoutes; //route => number held back
+    map<string,CCPomeloRateLimitHit> mLimitHits;   //to be reported by dispatchShaped()
+    CCPomeloRateLimitStats mLimitStats;
+#if CCX3
+    PomeloRateLimitCallback mRateLimitCB;
+#else
+    CCObject*           mRateLimitCbTarget;
+    PomeloRateLimitHandler mRateLimitCbSelector;
+#endif
+    
+    _PomeloRecorder     mRecorder;
+    _PomeloReplay*      mReplay;
+    vector<json_t*> mReleasedDocs;      //guarded by mMutex, see releaseDocs()
+    
+    vector<pthread_t>   mDecodeThreads;
+    size_t              mDecodeThreshold;   //bytes of json text, see estimateJsonSize()
+    queue<_PomeloDecodeJob> mDecodeJobs;    //guarded by mDecodeMutex
+    bool                mDecodeQuit;        //guarded by mDecodeMutex
+    pthread_mutex_t     mDecodeMutex;
+    pthread_cond_t      mDecodeCond;
+    unsigned int        mDecodeSeq;         //guarded by mMutex
+    unsigned int        mDecodeGeneration;  //guarded by mMutex
+    map<unsigned int,string> mDecoded;      //finished jobs by seq, guarded by mMutex
+};
+
+void CCPomeloImpl::ccDispatcher(float)
+{
+    if(!mWorkPending.load())
+    {
+        //idle frame: no locking at all
+#if CCX3
+        //sleep until wakeDispatcher() resumes us
+        CCDirector::getInstance()->getScheduler()->pauseTarget(this);
+#endif
+        return;
+    }
+    
+    reapOrphans();
+    dispatchAsyncConnCallback();
+    dispatchSubmissions();  //after the outbox flush of a new connection
+    dispatchReplay();
+    dispatchRequestCallbacks();
+    dispatchNotifyCallbacks();
+    dispatchEventCallbacks();
+    dispatchStreams();
+    dispatchCacheHits();
+    dispatchBatches();
+    dispatchNetStats();
+    dispatchShaped();
+    
+    deleteRetiredUsers();   //their callbacks are done by now
+    updateWorkPending();
+}
+void CCPomeloImpl::wakeDispatcher()
+{
+    if(mWorkPending.exchange(1))
+        return; //already awake
+    
+#if CCX3
+    //resumeTarget() is not thread safe, let cocos thread do it for us
+    CCPomeloImpl* impl = this;
+    CCDirector::getInstance()->getScheduler()->performFunctionInCocosThread([impl]{
+        if(impl->mWorkPending.load())
+        {
+            CCDirector::getInstance()->getScheduler()->resumeTarget(impl);
+        }
+    });
+#else
+    //cocos2dx 2.x has no way to resume the target from another thread safely,
+    //so the dispatcher keeps running while connected and only reads the flag
+#endif
+}
+//the dispatcher runs again by when (nowSeconds()) at the latest, on cocos thread.
+//Deadlines arm a scheduler timer instead of keeping the dispatcher busy.
+void CCPomeloImpl::wakeAt(double when)
+{
+    if(mWakeAt > 0 && mWakeAt <= when)
+        return; //armed for earlier already
+    
+    double delay = when - nowSeconds();
+    if(delay <= 0)
+    {
+        wakeTimerFired();
+        return;
+    }
+    mWakeAt = when;
+#if CCX3
+    CCDirector::getInstance()->getScheduler()->unscheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer);
+    CCDirector::getInstance()->getScheduler()->scheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer, 0, 0, delay, false);
+#else
+    CCDirector::sharedDirector()->getScheduler()->unscheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer);
+    CCDirector::sharedDirector()->getScheduler()->scheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer, 0, 0, delay, false);
+#endif
+}
+void CCPomeloImpl::wakeTimerFired()
+{
+    mWakeAt = 0;
+    mWorkPending.store(1);
+#if CCX3
+    CCDirector::getInstance()->getScheduler()->resumeTarget(this);
+#else
+    CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
+#endif
+}
+void _PomeloWakeTimer::fire(float)
+{
+    mImpl->wakeTimerFired();
+}
+void CCPomeloImpl::updateWorkPending()
+{
+    //always locked: libpomelo may push the disconnect event before mStatus says so
+    pthread_mutex_lock(&mMutex);
+    //batches still waiting for members do not count, see dispatchBatches()
+    bool batchDone = false;
+    list<_PomeloBatch*>::iterator it;
+    for (it = mBatches.begin(); it != mBatches.end() && !batchDone; it++)
+    {
+        batchDone = (*it)->pending == 0;
+    }
+    
+    pthread_mutex_lock(&mSubmitMutex);  //pushed before the wake, see submitFromAnyThread()
+    bool submitted = !mSubmissions.empty();
+    pthread_mutex_unlock(&mSubmitMutex);
+    
+    //pushers set the flag with mMutex held, so it is safe to clear it here
+    if(!submitted && !mAsyncConnDispatchPending && mReqResultQueue.empty() && mNtfResultQueue.empty() && mEventQueue.empty()
+       && mStreams.empty() && mCacheHitQueue.empty() && !mReplay && !batchDone
+       && mShaped.empty() && mLimitHits.empty())
+    {
+        mWorkPending.store(0);
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+void CCPomeloImpl::dispatchAsyncConnCallback()
+{
+    if(mAsyncConnDispatchPending)
+    {
+        mAsyncConnDispatchPending = false;
+        
+        mTransport->addListener(PC_EVENT_DISCONNECT, disconnectedCallback);
+        
+        //messages sent while disconnected go out before anything new
+        if(mAsyncConnStatus == 0)
+        {
+            registerDeltaEvents();
+            flushOutbox();
+            mNextClockPing = 0;     //first ping below, in dispatchNetStats()
+        }
+        
+        _PomeloUser* user = mAsyncConnUser;
+#if CCX3
+        if(user && user->connCB)
+        {
+            user->connCB(mAsyncConnStatus);
+        }
+#else
+        if(user && user->target && user->connSel)
+        {
+            PomeloAsyncConnHandler sel = user->connSel;
+            (user->target->*sel)(mAsyncConnStatus);
+        }
+#endif
+        
+        if(mAsyncConnUser == user)  //just in case of stop() called in cb
+        {
+            delete mAsyncConnUser;
+            mAsyncConnUser = NULL;
+        }
+    }
+}
+void CCPomeloImpl::dispatchRequestCallbacks()
+{
+    _PomeloRequestResult* rst = popReqResult(mStatus == EPomeloConnected);
+    if(rst)
+    {
+        _PomeloUser* user = NULL;
+        
+        bool locked = mStatus == EPomeloConnected;
+        if(locked)
+            pthread_mutex_lock(&mMutex);    //requestCallback() looks up direct users from libpomelo thread
+        if(mReqUserMap.find(rst->request) != mReqUserMap.end())
+        {
+            user = mReqUserMap[rst->request];
+            mReqUserMap.erase(rst->request);
+        }
+        if(locked)
+            pthread_mutex_unlock(&mMutex);
+        
+        if(user && user->streamWindow > 0)
+        {
+            //ownership of request & user goes to the stream
+            _PomeloStream* stream = new _PomeloStream();
+            stream->request = rst->request;
+            stream->user = user;
+            stream->status = rst->status;
+            stream->docs = rst->docs;
+            stream->text.swap(rst->resp);
+            stream->textPos = 0;
+            stream->iter = NULL;
+            stream->index = 0;
+            stream->opened = false;
+            stream->closed = false;
+            mStreams.push_back(stream);
+            
+            delete rst;
+            return;
+        }
+        
+        if(user && rst->status == 0 && !user->cacheKey.empty())
+        {
+            storeCache(rst->request->route, user->cacheKey, rst->resp);
+        }
+        if(user && !user->collapseKey.empty())
+        {
+            mInflightRequests.erase(user->collapseKey);
+        }
+        
+        //here is the good place to perform callback
+        if(user)
+        {
+            CCPomeloRequestResult result;
+            result.requestRoute = rst->request->route;
+            result.status = rst->status;
+            result.jsonMsg.swap(rst->resp);     //hand over, no copy
+            
+            performReqCallbacks(user, result);
+        }
+
+        delete user;
+        
+        //fixme
+        json_decref(rst->request->msg);
+        pc_request_destroy(rst->request);
+        delete rst;
+    }
+}
+void CCPomeloImpl::dispatchNotifyCallbacks()
+{
+    _PomeloNotifyResult* rst = popNtfResult(mStatus == EPomeloConnected);
+    if(rst)
+    {
+        _PomeloUser* user = NULL;
+        
+        bool locked = mStatus == EPomeloConnected;
+        if(locked)
+            pthread_mutex_lock(&mMutex);    //notifies may be sent from any thread
+        if(mNtfUserMap.find(rst->notify) != mNtfUserMap.end())
+        {
+            user = mNtfUserMap[rst->notify];
+            mNtfUserMap.erase(rst->notify);
+        }
+        if(locked)
+            pthread_mutex_unlock(&mMutex);
+        if(user)
+        {
+            CCPomeloNotifyResult result;
+            result.notifyRoute = rst->notify->route;
+            result.status = rst->status;
+            
+            performNtfCallback(user, result);
+        }
+        delete user;
+        
+        //fixme
+        json_decref(rst->notify->msg);
+        pc_notify_destroy(rst->notify);
+        delete rst;
+    }
+}
+void CCPomeloImpl::dispatchEventCallbacks()
+{
+    _PomeloEvent* rst = popEvent(mStatus == EPomeloConnected);
+    if(rst)
+    {
+        if(rst->event.compare(PC_EVENT_DISCONNECT) == 0)
+        {
+            //connection lost
+            stop(); //release data
+            
+#if CCX3
+            if (mDisconnectCB) {
+                mDisconnectCB();
+            }
+#else
+            if(mDisconnectCbTarget && mDisconnectCbSelector)
+            {
+                (mDisconnectCbTarget->*mDisconnectCbSelector)();
+            }
+#endif
+
+        }
+        else    //for customized events
+        {
+            //other threads may add listeners
+            bool locked = mStatus == EPomeloConnected;
+            if(locked)
+                pthread_mutex_lock(&mMutex);
+            _PomeloUser* user = findEventUser(rst->event.c_str(), rst->hash);
+            CCPomeloEventBatch batch;
+            if(user && user->batchEvents)
+            {
+                batch.jsonMsgs.push_back(string());
+                batch.jsonMsgs.back().swap(rst->data);
+                takeEventBatch(rst->event, batch.jsonMsgs);
+            }
+            if(locked)
+                pthread_mutex_unlock(&mMutex);
+            
+            if(user && user->batchEvents)
+            {
+                batch.event.swap(rst->event);
+                performEventBatchCallback(user, batch);
+            }
+            else if(user)
+            {
+                CCPomeloEvent result;
+                result.event.swap(rst->event);
+                result.jsonMsg.swap(rst->data);
+                
+                performEventCallback(user, result);
+            }
+            
+
+        }
+        delete rst;
+    }
+}
+
+void CCPomeloImpl::dispatchStreams()
+{
+    list<_PomeloStream*>::iterator it = mStreams.begin();
+    while (it != mStreams.end())
+    {
+        _PomeloStream* stream = *it;
+        bool done = renderStream(stream);
+        
+        CCPomeloResponseChunk chunk;
+        chunk.requestRoute = stream->request->route;
+        chunk.status = stream->status;
+        if(done)
+        {
+            chunk.data.swap(stream->pending);
+            chunk.last = true;
+        }
+        else
+        {
+            chunk.data.assign(stream->pending, 0, stream->user->streamWindow);
+            stream->pending.erase(0, stream->user->streamWindow);
+        }
+        
+        mDeliveringStream = stream;
+        performChunkCallback(stream->user, chunk);
+        if(mDeliveringStream != stream)
+        {
+            //stop() called in cb: clearStreams() left this one to us and the
+            //list is gone, end it now that the callback is done with its user
+            if(!chunk.last)
+            {
+                CCPomeloResponseChunk end;
+                end.requestRoute = chunk.requestRoute;
+                end.status = -1;
+                end.last = true;
+                performChunkCallback(stream->user, end);
+            }
+            delete stream->user;
+            delete stream;
+            return;
+        }
+        mDeliveringStream = NULL;
+        
+        if(done)
+        {
+            releaseDocs(stream->docs);
+            json_decref(stream->request->msg);
+            pc_request_destroy(stream->request);
+            delete stream->user;
+            delete stream;
+            it = mStreams.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+void CCPomeloImpl::dispatchCacheHits()
+{
+    //hits never touched the network, deliver all of them
+    while (!mCacheHitQueue.empty())
+    {
+        _PomeloCacheHit* hit = mCacheHitQueue.front();
+        mCacheHitQueue.pop();
+        
+        CCPomeloRequestResult result;
+        result.requestRoute.swap(hit->route);
+        result.status = hit->status;
+        result.jsonMsg.swap(hit->resp);
+        
+        performReqCallback(hit->user, result);
+        
+        delete hit->user;
+        delete hit;
+    }
+}
+
+void CCPomeloImpl::dispatchReplay()
+{
+    if(!mReplay)
+        return;
+    
+    _PomeloReplay* rp = mReplay;
+    double now = (nowSeconds() - rp->start) * rp->speed;
+    while (rp->pos < rp->records.size() && (rp->speed <= 0 || rp->records[rp->pos].time <= now))
+    {
+        _PomeloRecord& rec = rp->records[rp->pos++];
+        if(rec.kind == kRecordEvent)
+        {
+            //through the event queue, just like a real push
+            _PomeloEvent* evt = new _PomeloEvent();
+            evt->event.swap(rec.route);
+            evt->hash = hashRoute(evt->event.c_str());
+            evt->data.swap(rec.data);
+            if(mDeltaEventCount.load())
+            {
+                //the log holds what came over the wire
+                json_t* docs = loadJson(evt->data);
+                json_t* delta = applyDelta(evt->event.c_str(), docs);
+                if(delta)
+                    dumpBody(delta, evt->data);
+                json_decref(delta);
+                json_decref(docs);
+            }
+            pushEvent(evt);
+        }
+        else if(rec.kind == kRecordResponse)
+        {
+            rp->responses[rec.route].push(rp->pos - 1);
+        }
+        //outgoing messages & notify acks are produced by the game itself this time
+    }
+    
+    //match responses with requests of the same route, both in order
+    map<string,queue<_PomeloUser*> >::iterator it;
+    for (it = rp->requests.begin(); it != rp->requests.end(); it++)
+    {
+        queue<size_t>& responses = rp->responses[it->first];
+        while (!it->second.empty() && !responses.empty())
+        {
+            _PomeloRecord& rec = rp->records[responses.front()];
+            responses.pop();
+            
+            _PomeloCacheHit* hit = new _PomeloCacheHit();
+            hit->user = it->second.front();
+            hit->route = it->first;
+            hit->status = rec.status;
+            hit->resp.swap(rec.data);
+            mCacheHitQueue.push(hit);
+            it->second.pop();
+        }
+    }
+    
+    while (!rp->notifies.empty())
+    {
+        CCPomeloNotifyResult result;
+        result.notifyRoute = rp->notifies.front().first;
+        result.status = 0;
+        _PomeloUser* user = rp->notifies.front().second;
+        rp->notifies.pop();
+        
+        performNtfCallback(user, result);
+        delete user;
+        if(mReplay != rp)
+            return; //stop() called in cb
+    }
+    
+    if(rp->pos == rp->records.size() && mEventQueue.empty() && mCacheHitQueue.empty())
+    {
+        //requests still waiting will never get a response
+        endReplay();
+    }
+}
+
+//render until at least one window is pending
+//@return: true if everything is rendered and pending fits into the last chunk
+bool CCPomeloImpl::renderStream(_PomeloStream* stream)
+{
+    size_t window = stream->user->streamWindow;
+    json_t* docs = stream->docs;
+    
+    if(!stream->text.empty() || !docs)
+    {
+        size_t n = min(window, stream->text.size() - stream->textPos);
+        stream->pending.append(stream->text, stream->textPos, n);
+        stream->textPos += n;
+        return stream->textPos >= stream->text.size();
+    }
+    
+    if(!json_is_object(docs) && !json_is_array(docs))
+    {
+        if(!stream->closed)
+            dumpJson(docs, stream->pending, true);
+        stream->closed = true;
+        return stream->pending.size() <= window;
+    }
+    
+    //one top level member at a time, so that only about one window of text
+    //exists besides the json tree itself
+    bool isObject = json_is_object(docs);
+    if(!stream->opened)
+    {
+        stream->opened = true;
+        stream->pending += isObject ? '{' : '[';
+        if(isObject)
+            stream->iter = json_object_iter(docs);
+    }
+    while (!stream->closed && stream->pending.size() < window)
+    {
+        if(isObject)
+        {
+            if(!stream->iter)
+            {
+                stream->pending += '}';
+                stream->closed = true;
+                break;
+            }
+            if(stream->index++ > 0)
+                stream->pending += ',';
+            json_t* key = json_string(json_object_iter_key(stream->iter));
+            json_dump_callback(key, appendToString, &stream->pending, JSON_ENCODE_ANY);
+            json_decref(key);
+            stream->pending += ':';
+            json_dump_callback(json_object_iter_value(stream->iter), appendToString, &stream->pending, JSON_COMPACT | JSON_ENCODE_ANY);
+            stream->iter = json_object_iter_next(docs, stream->iter);
+        }
+        else
+        {
+            if(stream->index >= json_array_size(docs))
+            {
+                stream->pending += ']';
+                stream->closed = true;
+                break;
+            }
+            if(stream->index > 0)
+                stream->pending += ',';
+            dumpJson(json_array_get(docs, stream->index++), stream->pending, true);
+        }
+    }
+    return stream->closed && stream->pending.size() <= window;
+}
+
+void CCPomeloImpl::performReqCallback(_PomeloUser* user, CCPomeloRequestResult& result)
+{
+    if(user->batch)
+    {
+        gPomelo->_theMagic->landBatchEntry(user->batch, user->batchIndex, result);
+        return;
+    }
+#if CCX3
+    if(user->executor)
+    {
+        //the task owns everything, it may run long after this returns
+        CCPomeloRequestResult owned;
+        owned.status = result.status;
+        owned.requestRoute.swap(result.requestRoute);
+        result.takeJsonMsg(owned.jsonMsg);
+        user->executor(PomeloTask(_PomeloExecutorTask(std::move(user->reqCB), std::move(owned))));
+    }
+    else if(user->reqCB)
+    {
+        user->reqCB(std::move(result));
+    }
+#else
+    if(user->target && user->reqSel)
+    {
+        PomeloReqResultHandler sel = user->reqSel;
+        (user->target->*sel)(result);
+    }
+#endif
+}
+//fan the result out to collapsed requests, each gets its own copy and the
+//first user gets the original last, since callbacks may takeJsonMsg()
+void CCPomeloImpl::performReqCallbacks(_PomeloUser* user, CCPomeloRequestResult& result)
+{
+    for (_PomeloUser* sub = user->nextSubscriber; sub; sub = sub->nextSubscriber)
+    {
+        CCPomeloRequestResult copy(result);
+        performReqCallback(sub, copy);
+    }
+    performReqCallback(user, result);
+}
+void CCPomeloImpl::performChunkCallback(_PomeloUser* user, const CCPomeloResponseChunk& chunk)
+{
+#if CCX3
+    if(user->chunkCB)
+    {
+        user->chunkCB(chunk);
+    }
+#else
+    if(user->target && user->chunkSel)
+    {
+        PomeloReqChunkHandler sel = user->chunkSel;
+        (user->target->*sel)(chunk);
+    }
+#endif
+}
+void CCPomeloImpl::performEventCallback(_PomeloUser* user, CCPomeloEvent& result)
+{
+#if CCX3
+    if(user->evtCB)
+    {
+        user->evtCB(std::move(result));
+    }
+#else
+    if(user->target && user->evtSel)
+    {
+        PomeloEventHandler sel = user->evtSel;
+        (user->target->*sel)(result);
+    }
+#endif
+}
+
+void CCPomeloImpl::performEventBatchCallback(_PomeloUser* user, CCPomeloEventBatch& batch)
+{
+#if CCX3
+    if(user->evtBatchCB)
+    {
+        user->evtBatchCB(std::move(batch));
+    }
+#else
+    if(user->target && user->evtBatchSel)
+    {
+        PomeloEventBatchHandler sel = user->evtBatchSel;
+        (user->target->*sel)(batch);
+    }
+#endif
+}
+
+void CCPomeloImpl::performNtfCallback(_PomeloUser* user, const CCPomeloNotifyResult& result)
+{
+    //notifies merged by a rate limiter share the ack
+    for (; user; user = user->nextSubscriber)
+    {
+#if CCX3
+        if(user->ntfCB)
+        {
+            user->ntfCB(result);
+        }
+#else
+        if(user->target && user->ntfSel)
+        {
+            PomeloNtfResultHandler sel = user->ntfSel;
+            (user->target->*sel)(result);
+        }
+#endif
+    }
+}
+
+void CCPomeloImpl::performBatchCallback(_PomeloUser* user, CCPomeloBatchResult& result)
+{
+#if CCX3
+    if(user->batchCB)
+    {
+        user->batchCB(std::move(result));
+    }
+#else
+    if(user->target && user->batchSel)
+    {
+        PomeloBatchHandler sel = user->batchSel;
+        (user->target->*sel)(result);
+    }
+#endif
+}
+
+void CCPomeloImpl::addReqUser(pc_request_t* req, _PomeloUser* user)
+{
+    pthread_mutex_lock(&mMutex);
+    mReqUserMap[req] = user;    //ownership transferred
+    pthread_mutex_unlock(&mMutex);
+}
+void CCPomeloImpl::addEventUser(const char* event, unsigned int hash, _PomeloUser* user)
+{
+    pthread_mutex_lock(&mMutex);
+    mEventUserMap.set(event, hash, user);   //ownership transferred
+    updateEventFilter();
+    pthread_mutex_unlock(&mMutex);
+}
+void CCPomeloImpl::addNtfUser(pc_notify_t* ntf, _PomeloUser* user)
+{
+    pthread_mutex_lock(&mMutex);
+    mNtfUserMap[ntf] = user;    //ownership transferred
+    pthread_mutex_unlock(&mMutex);
+}
+
+void CCPomeloImpl::pushReqResult(_PomeloRequestResult* reqResult)
+{
+    mReqResultQueue.push(reqResult);
+    wakeDispatcher();
+}
+void CCPomeloImpl::pushNtfResult(_PomeloNotifyResult* ntfResult)
+{
+    mNtfResultQueue.push(ntfResult);
+    wakeDispatcher();
+}
+void CCPomeloImpl::pushEvent(_PomeloEvent* event)
+{
+    mEventQueue.push_back(event);
+    wakeDispatcher();
+}
+
+_PomeloRequestResult* CCPomeloImpl::popReqResult(bool lock/* = true*/)
+{
+    _PomeloRequestResult* rst = NULL;
+    if(lock)
+        pthread_mutex_lock(&mMutex);
+    //results leave in arrival order, a heavy one blocks the queue until decoded
+    if (mReqResultQueue.size() > 0 && takeDecoded(mReqResultQueue.front()->decodeSeq, mReqResultQueue.front()->resp))
+    {
+        rst = mReqResultQueue.front();
+        mReqResultQueue.pop();
+    }
+    if(lock)
+        pthread_mutex_unlock(&mMutex);
+    return rst;
+}
+_PomeloNotifyResult* CCPomeloImpl::popNtfResult(bool lock/* = true*/)
+{
+    _PomeloNotifyResult* rst = NULL;
+    if(lock)
+        pthread_mutex_lock(&mMutex);
+    if (mNtfResultQueue.size() > 0)
+    {
+        rst = mNtfResultQueue.front();
+        mNtfResultQueue.pop();
+    }
+    if(lock)
+        pthread_mutex_unlock(&mMutex);
+    return rst;
+}
+/*
+ 批量订阅：取出队列中同一事件所有已就绪的消息。
+ Takes every queued event of the name, in order, up to the first one still
+ being decoded or a disconnect. mMutex held if connected.
+ */
+void CCPomeloImpl::takeEventBatch(const string& event, vector<string>& out)
+{
+    size_t kept = 0, i = 0;
+    for (; i < mEventQueue.size(); i++)
+    {
+        _PomeloEvent* evt = mEventQueue[i];
+        if(evt->event.compare(PC_EVENT_DISCONNECT) == 0)
+            break;
+        if(evt->event == event)
+        {
+            if(!takeDecoded(evt->decodeSeq, evt->data))
+                break;  //the rest waits, not to overtake it
+            out.push_back(string());
+            out.back().swap(evt->data);
+            delete evt;
+        }
+        else
+        {
+            mEventQueue[kept++] = evt;
+        }
+    }
+    mEventQueue.erase(mEventQueue.begin() + kept, mEventQueue.begin() + i);
+}
+_PomeloEvent* CCPomeloImpl::popEvent(bool lock/* = true*/)
+{
+    _PomeloEvent* evt = NULL;
+    if(lock)
+        pthread_mutex_lock(&mMutex);
+    if (mEventQueue.size() > 0 && takeDecoded(mEventQueue.front()->decodeSeq, mEventQueue.front()->data))
+    {
+        evt = mEventQueue.front();
+        mEventQueue.pop_front();
+    }
+    if(lock)
+        pthread_mutex_unlock(&mMutex);
+    return evt;
+}
+
+void CCPomeloImpl::connectAsnycCallback(pc_connect_t* conn_req, int status)
+{
+    pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
+    
+    if(gPomelo->_theMagic->mAsyncConn != conn_req)
+    {
+        //conn_req是一个已经被“断开”的连接。client交给cocos线程销毁。
+        //cancelled by stop(): pc_client_destroy() must not run on the
+        //worker thread (it joins it), so leave the client to reapOrphans()
+        CCPomeloImpl* impl = gPomelo->_theMagic;
+        list<_PomeloOrphan>::iterator it;
+        for (it = impl->mOrphans.begin(); it != impl->mOrphans.end(); it++)
+        {
+            if(it->conn == conn_req)
+            {
+                it->conn = NULL;
+                it->done = true;
+                impl->mReapable.add(1);
+                break;
+            }
+        }
+        pc_connect_req_destroy(conn_req);
+        
+        //on 2.x only the flag is set: the orphan is reaped by the next
+        //connect()/connectAsnyc(), the destructor, or the dispatcher if it is still running
+        impl->wakeDispatcher();
+    }
+    else
+    {
+        pc_connect_req_destroy(conn_req);
+        
+        gPomelo->_theMagic->mStatus = EPomeloConnected;
+        gPomelo->_theMagic->mAsyncConnStatus = status;
+        gPomelo->_theMagic->mAsyncConnDispatchPending = true;
+        gPomelo->_theMagic->mAsyncConn = NULL;
+        
+        //2.x: connectAsnyc() resumed the dispatcher already, it only needs the flag
+        gPomelo->_theMagic->wakeDispatcher();
+    }
+    
+    pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+}
+
+void CCPomeloImpl::requestCallback(pc_request_t *request, int status, json_t *docs)
+{
+    if(gPomelo->status() == EPomeloStopping)
+    {
+        /*
+         EPomeloStopping时，表示此函数是由pc_client_destory()内部触发。
+         此时处于主线程中。request会由libpomelo内部进行释放。
+         */
+        if(gPomelo->_theMagic->mReqUserMap.find(request) != gPomelo->_theMagic->mReqUserMap.end())
+        {
+            _PomeloUser* user = gPomelo->_theMagic->mReqUserMap[request];
+            gPomelo->_theMagic->mReqUserMap.erase(request);
+            
+            //here is the good place to perform callback
+            if(user && user->streamWindow > 0)
+            {
+                CCPomeloResponseChunk chunk;
+                chunk.requestRoute = request->route;
+                chunk.status = status;
+                chunk.last = true;
+                
+                performChunkCallback(user, chunk);
+            }
+            else if(user)
+            {
+                CCPomeloRequestResult result;
+                result.requestRoute = request->route;
+                result.status = status;
+                dumpBody(docs, result.jsonMsg);     //docs is NULL
+                
+                performReqCallbacks(user, result);
+            }
+            
+            delete user;
+            
+            //fixme
+            json_decref(request->msg);
+        }
+    }
+    else    //EPomeloConnected
+    {
+        CCPomeloImpl* impl = gPomelo->_theMagic;
+        _PomeloUser* user = NULL;
+        _PomeloUser* directUser = NULL;
+        
+        impl->drainReleasedDocs();
+        impl->record(kRecordResponse, request->route, status, docs);
+        
+        double now = nowSeconds();
+        double serverTime = -1;
+        if(!impl->mClockKey.empty() && json_is_object(docs))
+        {
+            json_t* time = json_object_get(docs, impl->mClockKey.c_str());
+            if(json_is_number(time))
+                serverTime = json_number_value(time) / 1000.0;
+        }
+        
+        pthread_mutex_lock(&impl->mMutex);
+        map<pc_request_t*,_PomeloUser*>::iterator it = impl->mReqUserMap.find(request);
+        if(it != impl->mReqUserMap.end())
+        {
+            user = it->second;
+            if(status == 0 && user->sentAt > 0)
+                impl->addNetSample(now - user->sentAt, serverTime, now);
+            if(user->direct)
+            {
+                directUser = user;
+                impl->mReqUserMap.erase(it);
+            }
+        }
+        pthread_mutex_unlock(&impl->mMutex);
+        
+        if(!directUser)
+        {
+            //the user stays in mReqUserMap until this result is dispatched, so
+            //it can be read without mMutex; convert before taking mMutex again
+            _PomeloRequestResult* rst = new _PomeloRequestResult();
+            rst->request = request;
+            rst->status = status;
+            
+            bool heavy = false;
+            if(user && user->streamWindow > 0 && docs && !unzipBody(docs, rst->resp))
+            {
+                //rendered later by dispatchStreams()
+                rst->docs = json_incref(docs);
+            }
+            else if(rst->resp.empty())
+            {
+                heavy = impl->isHeavy(docs);
+                if(!heavy)
+                    dumpBody(docs, rst->resp);
+            }
+            
+            _PomeloDecodeJob job = {0, 0, NULL};
+            pthread_mutex_lock(&impl->mMutex);
+            if(heavy)
+            {
+                job = impl->newDecodeJob(docs);
+                rst->decodeSeq = job.seq;
+            }
+            impl->pushReqResult(rst);
+            pthread_mutex_unlock(&impl->mMutex);
+            
+            if(heavy)
+                impl->queueDecodeJob(job);
+        }
+        else
+        {
+            //direct dispatch: call back right here on libpomelo thread, docs lent as it is
+            CCPomeloRequestResult result;
+            result.requestRoute = request->route;
+            result.status = status;
+            if(!unzipBody(docs, result.jsonMsg))
+                result.docs = docs;
+            
+            performReqCallback(directUser, result);
+            delete directUser;
+            
+            //fixme
+            json_decref(request->msg);
+            pc_request_destroy(request);
+        }
+    }
+}
+void CCPomeloImpl::notifyCallback(pc_notify_t *ntf, int status)
+{
+    if(gPomelo->status() == EPomeloStopping)
+    {
+        /*
          EPomeloStopping时，表示此函数是由pc_client_destory()内部触发。
-         此时处于主线程中。request会由libpomelo内部进行释放。
+         此时处于主线程中。ntf会由libpomelo内部进行释放。
          */
-        if(gPomelo->_theMagic->mReqUserMap.find(request) != gPomelo->_theMagic->mReqUserMap.end())
+        if(gPomelo->_theMagic->mNtfUserMap.find(ntf) != gPomelo->_theMagic->mNtfUserMap.end())
+        {
+            _PomeloUser* user = gPomelo->_theMagic->mNtfUserMap[ntf];
+            gPomelo->_theMagic->mNtfUserMap.erase(ntf);    //freed by the client, not clearNtfResource()
+            if(user)
+            {
+                CCPomeloNotifyResult result;
+                result.notifyRoute = ntf->route;
+                result.status = status;
+                
+                performNtfCallback(user, result);
+            }
+            delete user;
+            
+            //fixme
+            json_decref(ntf->msg);
+        }
+    }
+    else    //EPomeloConnected
+    {
+        gPomelo->_theMagic->record(kRecordNotifyAck, ntf->route, status, NULL);
+        
+        pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
+        
+        _PomeloNotifyResult* rst = new _PomeloNotifyResult();
+        rst->notify = ntf;
+        rst->status = status;
+        gPomelo->_theMagic->pushNtfResult(rst);
+        
+        pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+    }
+}
+void CCPomeloImpl::eventCallback(pc_client_t*, const char *event, void *data)
+{
+    CCPomeloImpl* impl = gPomelo->_theMagic;
+    json_t* docs = (json_t*)data;
+    
+    if(gPomelo->status() != EPomeloConnected)
+    {
+        //EPomeloStopping过程中不响应callback
+        return;
+    }
+    
+    impl->drainReleasedDocs();
+    impl->record(kRecordEvent, event, 0, docs);     //the log keeps them all
+    
+    //states follow every patch, listened to or not
+    json_t* delta = impl->applyDelta(event, docs);
+    if(delta)
+        docs = delta;   //the state (or the patch) is delivered instead
+    
+    unsigned int hash = hashRoute(event);   //once, every lookup below is by it
+    if(!impl->maySubscribe(hash))
+    {
+        //nobody listens: no copy, no allocation, no lock
+        impl->mDroppedEvents.add(1);
+        json_decref(delta);
+        return;
+    }
+    
+    if(impl->mayDispatchDirect(hash))
+    {
+        pthread_mutex_lock(&impl->mMutex);
+        _PomeloUser* user = impl->findEventUser(event, hash);
+        bool direct = user && user->direct && gPomelo->status() == EPomeloConnected;
+        if(direct)
+            impl->mPinnedEventUser = user;  //removed meanwhile: retired, see retireEventUser()
+        pthread_mutex_unlock(&impl->mMutex);
+        
+        if(direct)
+        {
+            //called without mMutex, so the listener may use the thread safe apis.
+            //No queue, no text: docs is lent as it is
+            CCPomeloEvent result;
+            result.event = event;
+            if(!unzipBody(docs, result.jsonMsg))
+                result.docs = docs;
+            impl->performEventCallback(user, result);
+            
+            pthread_mutex_lock(&impl->mMutex);
+            impl->mPinnedEventUser = NULL;
+            if(!impl->mRetiredUsers.empty())
+                impl->wakeDispatcher();
+            pthread_mutex_unlock(&impl->mMutex);
+            
+            json_decref(delta);
+            return;
+        }
+    }
+    
+    //convert before taking mMutex, heavy bodies are left to the decode workers
+    _PomeloEvent* rst = new _PomeloEvent();
+    rst->event = event;
+    rst->hash = hash;
+    bool heavy = impl->isHeavy(docs);
+    if(!heavy)
+        dumpBody(docs, rst->data);
+    
+    _PomeloDecodeJob job = {0, 0, NULL};
+    pthread_mutex_lock(&impl->mMutex);
+    
+    _PomeloUser* user = impl->findEventUser(event, hash);
+    if(gPomelo->status() != EPomeloConnected)
+    {
+        //stopped in the meantime
+        delete rst;
+        heavy = false;
+    }
+    else if(!user)
+    {
+        //a filter collision, or removed in the meantime
+        delete rst;
+        heavy = false;
+        impl->mDroppedEvents.add(1);
+    }
+    else
+    {
+        if(heavy)
+        {
+            job = impl->newDecodeJob(docs);
+            rst->decodeSeq = job.seq;
+        }
+        impl->pushEvent(rst);
+    }
+    
+    pthread_mutex_unlock(&impl->mMutex);
+    
+    if(heavy)
+        impl->queueDecodeJob(job);
+    json_decref(delta);
+}
+void CCPomeloImpl::disconnectedCallback(pc_client_t*, const char *event, void *data)
+{
+    _PomeloEvent* rst = new _PomeloEvent();
+    rst->event = event;
+    rst->hash = hashRoute(event);
+    pthread_mutex_lock(&gPomelo->_theMagic->mMutex);   //see updateWorkPending()
+    gPomelo->_theMagic->pushEvent(rst);
+    pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+    
+    free(data); //data === NULL ?? fixme
+}
+CCPomeloImpl::~CCPomeloImpl()
+{
+    //just in case
+    stop();
+    disableOutbox();
+    
+    while (!mDeltaEvents.empty())
+    {
+        string event = mDeltaEvents.begin()->first;
+        removeDeltaEvent(event.c_str());
+    }
+    pthread_mutex_destroy(&mDeltaMutex);
+    
+    stopDecodeWorkers();
+    drainReleasedDocs(false);
+    deleteRetiredUsers();
+    reapOrphans();  //attempts still connecting can not be destroyed safely
+    pthread_cond_destroy(&mDecodeCond);
+    pthread_mutex_destroy(&mDecodeMutex);
+    pthread_rwlock_destroy(&mSubmitLock);
+    clearSubmissions();
+    pthread_mutex_destroy(&mSubmitMutex);
+    pthread_mutex_destroy(&mZipMutex);
+    
+#if CCX3
+    CCDirector::getInstance()->getScheduler()->unscheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer);
+#else
+    CCDirector::sharedDirector()->getScheduler()->unscheduleSelector(schedule_selector(_PomeloWakeTimer::fire), mWakeTimer);
+#endif
+    mWakeTimer->release();
+    
+    _PomeloUser::trimPool();
+}
+
+CCPomeloImpl::CCPomeloImpl()
+:mStatus(EPomeloStopped),
+mTransport(NULL),
+mLoopbackServer(NULL),
+mWebSocketSecure(false),
+mAsyncConnUser(NULL),
+mAsyncConnDispatchPending(false),
+mAsyncConn(NULL),
+#if CCX3
+mDisconnectCB(NULL)
+#else
+mDisconnectCbTarget(NULL),
+mDisconnectCbSelector(NULL)
+#endif
+{
+    //paused by default
+#if CCX3
+        CCDirector::getInstance()->getScheduler()->scheduleSelector(schedule_selector(CCPomeloImpl::ccDispatcher), this, 0, true);
+#else
+        CCDirector::sharedDirector()->getScheduler()->scheduleSelector(schedule_selector(CCPomeloImpl::ccDispatcher), this, 0, true);
+#endif
+
+    
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_rwlock_init(&mSubmitLock, NULL);
+    pthread_mutex_init(&mSubmitMutex, NULL);
+    pthread_mutex_init(&mZipMutex, NULL);
+    mCocosThread = pthread_self();
+    
+    memset(&mCacheStats, 0, sizeof(mCacheStats));
+    mCollapseRequests = false;
+    mReplay = NULL;
+    mPinnedEventUser = NULL;
+    mDeliveringStream = NULL;
+    
+    pthread_mutex_init(&mDecodeMutex, NULL);
+    pthread_mutex_init(&mDeltaMutex, NULL);
+    pthread_cond_init(&mDecodeCond, NULL);
+    mDecodeThreshold = 0;
+    mDecodeQuit = false;
+    mDecodeSeq = 0;
+    mDecodeGeneration = 0;
+    
+    resetNetStats();
+    mClockInterval = 0;
+    mNextClockPing = 0;
+    mNetStatsNotifiedAt = 0;
+    mWakeTimer = new _PomeloWakeTimer(this);
+    mWakeAt = 0;
+#if !CCX3
+    mNetStatsCbTarget = NULL;
+    mNetStatsCbSelector = NULL;
+#endif
+    
+    memset(&mGlobalLimit, 0, sizeof(mGlobalLimit));
+    memset(&mLimitStats, 0, sizeof(mLimitStats));
+#if !CCX3
+    mRateLimitCbTarget = NULL;
+    mRateLimitCbSelector = NULL;
+#endif
+}
+
+CCPomeloStatus CCPomeloImpl::status() const
+{
+    return mStatus;
+}
+
+_PomeloTransport* CCPomeloImpl::newTransport(const char* host, int port)
+{
+    if(mLoopbackServer)
+        return new _PomeloLoopbackTransport(mLoopbackServer);
+#if CCX3
+    if(!mWebSocketPath.empty())
+    {
+        //the host name as given, for the gateway's virtual hosts & certificates
+        char url[512];
+        snprintf(url, sizeof(url), "%s://%s:%d%s", mWebSocketSecure ? "wss" : "ws", host, port, mWebSocketPath.c_str());
+        return new _PomeloWebSocketTransport(url);
+    }
+#else
+    (void)host;     //no websocket on 2.x
+    (void)port;
+#endif
+    return new _PomeloTcpTransport(mProtoPath, mProtoFile);
+}
+void CCPomeloImpl::setLoopbackServer(CCPomeloLoopbackServer* server)
+{
+    mLoopbackServer = server;
+}
+#if CCX3
+void CCPomeloImpl::setWebSocket(const char* path, bool secure)
+{
+    mWebSocketPath = path ? (*path == '/' ? path : string("/") + path) : "";
+    mWebSocketSecure = secure;
+}
+#endif
+void CCPomeloImpl::setProtoCache(const char* path, const char* file)
+{
+    mProtoPath = path ? path : "";
+    mProtoFile = file ? file : "";
+}
+
+void CCPomeloImpl::setCompression(const char* route, int threshold)
+{
+    pthread_mutex_lock(&mZipMutex);
+    if(threshold < 0)
+        mZipThresholds.erase(route);
+    else
+        mZipThresholds[route] = threshold;
+    pthread_mutex_unlock(&mZipMutex);
+}
+//@return: false if bodies of route are not compressed; any thread
+bool CCPomeloImpl::zipThreshold(const char* route, size_t& threshold) const
+{
+    pthread_mutex_lock(&mZipMutex);
+    map<string,size_t>::const_iterator it = mZipThresholds.find(route);
+    bool found = it != mZipThresholds.end();
+    if(found)
+        threshold = it->second;
+    pthread_mutex_unlock(&mZipMutex);
+    return found;
+}
+json_t* CCPomeloImpl::packBody(const char* route, const std::string& msg)
+{
+    size_t threshold;
+    if(zipThreshold(route, threshold) && msg.size() >= threshold)
+    {
+        json_t* envelope = zipBody(msg.data(), msg.size());
+        if(envelope)
+            return envelope;
+    }
+    
+    return loadJson(msg);
+}
+json_t* CCPomeloImpl::packBody(const char* route, json_t* msg)
+{
+    size_t threshold;
+    if(!msg || !zipThreshold(route, threshold))
+        return msg;
+    
+    json_t* envelope = NULL;
+    string json;
+    dumpJson(msg, json);
+    if(json.size() >= threshold)
+        envelope = zipBody(json.data(), json.size());
+    
+    if(!envelope)
+        return msg;
+    json_decref(msg);
+    return envelope;
+}
+
+int CCPomeloImpl::connect(const char* host, int port)
+{
+    if(mStatus == EPomeloStopping)
+        return -1;
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    
+    unsigned long vf_addr_ = inet_addr(host);
+    if(vf_addr_ == INADDR_NONE)
+    {
+        struct hostent *pHostEnt= NULL;
+        pHostEnt = gethostbyname(host);
+        if(pHostEnt != NULL)
+        {
+            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+        }
+    }
+    
+    address.sin_addr.s_addr = vf_addr_;
+    
+    //stop any connection
+    stop();
+    reapOrphans();
+    
+    mTransport = newTransport(host, port);
+    int ret = mTransport->connect(&address);
+    if(ret)
+    {
+        delete mTransport;
+        mTransport = NULL;
+    }
+    else
+    {
+        pthread_mutex_lock(&mMutex);    //see lockSubmit()
+        mStatus = EPomeloConnected;
+        pthread_mutex_unlock(&mMutex);
+        
+        mTransport->addListener(PC_EVENT_DISCONNECT, disconnectedCallback);
+        
+#if CCX3
+        CCDirector::getInstance()->getScheduler()->resumeTarget(this);
+#else
+        CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
+#endif
+        
+        registerDeltaEvents();
+        flushOutbox();
+        
+        mNextClockPing = 0;
+        if(mClockInterval > 0)
+            wakeAt(0);  //first ping right away
+    }
+    return ret;
+}
+
+#if CCX3
+int CCPomeloImpl::connectAsnyc(const char* host, int port, const PomeloAsyncConnCallback& callback)
+{
+    if(mStatus == EPomeloStopping)
+        return -1;
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    
+    unsigned long vf_addr_ = inet_addr(host);
+    if(vf_addr_ == INADDR_NONE)
+    {
+        struct hostent *pHostEnt= NULL;
+        pHostEnt = gethostbyname(host);
+        if(pHostEnt != NULL)
+        {
+            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+        }
+    }
+    
+    address.sin_addr.s_addr = vf_addr_;
+    
+    stop();
+    reapOrphans();
+    mTransport = newTransport(host, port);
+    
+    mAsyncConn = mTransport->connectAsync(&address, connectAsnycCallback);
+    int ret = mAsyncConn ? 0 : -1;
+    if(ret)
+    {
+        delete mTransport;
+        mTransport = NULL;
+    }
+    else
+    {
+        mStatus = EPomeloConnecting;
+        
+        mAsyncConnUser = new _PomeloUser();
+        mAsyncConnUser->connCB = callback;
+    }
+    return ret;
+}
+int CCPomeloImpl::setDisconnectedCallback(const std::function<void()>& callback)
+{
+    if(mStatus != EPomeloConnected)
+        return -1;
+    mDisconnectCB = callback;
+    return 0;
+}
+int CCPomeloImpl::request(const char* route, const std::string& msg, _PomeloReqResultCB callback, bool direct)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->reqCB = std::move(callback);
+    user->direct = direct;
+    return issueRequest(route, msg, user);
+}
+int CCPomeloImpl::request(const char* route, json_t* msg, _PomeloReqResultCB callback, bool direct)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->reqCB = std::move(callback);
+    user->direct = direct;
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxRequest, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxRequest, route, msg, user);
+    return submitRequest(route, msg, user);
+}
+int CCPomeloImpl::notify(const char* route, const std::string& msg, _PomeloNtfResultCB callback)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->ntfCB = std::move(callback);
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxNotify, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxNotify, route, msg, user);
+    return sendNotify(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::notify(const char* route, json_t* msg, _PomeloNtfResultCB callback)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->ntfCB = std::move(callback);
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxNotify, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxNotify, route, msg, user);
+    return sendNotify(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::requestStreamed(const char* route, const std::string& msg, size_t window, _PomeloReqChunkCB callback)
+{
+    if(mStatus != EPomeloConnected || window == 0)
+        return -1;
+    
+    _PomeloUser* user = new _PomeloUser();
+    user->chunkCB = std::move(callback);
+    user->streamWindow = window;
+    return sendRequest(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, _PomeloBatchCB callback)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->batchCB = std::move(callback);
+    return startBatch(requests, timeout, user);
+}
+int CCPomeloImpl::requestOn(_PomeloExecutorCB executor, const char* route, const std::string& msg, _PomeloReqResultCB callback)
+{
+    //direct dispatch, performReqCallback() hands the result over to the executor
+    _PomeloUser* user = new _PomeloUser();
+    user->reqCB = std::move(callback);
+    user->executor = std::move(executor);
+    user->direct = true;
+    return issueRequest(route, msg, user);
+}
+template <typename M>
+CCPomeloFuture<CCPomeloRequestResult> CCPomeloImpl::requestFuture(const char* route, M msg)
+{
+    CCPomeloFuture<CCPomeloRequestResult> future;
+    _PomeloReqResultCB resolve = [future](CCPomeloRequestResult&& result){
+        future.resolve(std::move(result));
+    };
+    
+    int ret = request(route, msg, std::move(resolve), false);
+    if(ret != 0)
+    {
+        CCPomeloRequestResult value;
+        value.status = ret;
+        value.requestRoute = route;
+        future.resolve(std::move(value));   //ignored if the callback got there first
+    }
+    return future;
+}
+int CCPomeloImpl::addListener(const char* event, unsigned int hash, _PomeloEventCB callback, bool direct)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->evtCB = std::move(callback);
+    user->direct = direct;
+    return listen(event, hash, user);
+}
+int CCPomeloImpl::addBatchListener(const char* event, _PomeloEventBatchCB callback)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->evtBatchCB = std::move(callback);
+    user->batchEvents = true;
+    return listen(event, hashRoute(event), user);
+}
+int CCPomeloImpl::addPatternListener(const char* pattern, _PomeloEventCB callback, bool direct)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->evtCB = std::move(callback);
+    user->direct = direct;
+    
+    return addPatternUser(pattern, user);
+}
+#else
+int CCPomeloImpl::connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    
+    unsigned long vf_addr_ = inet_addr(host);
+    if(vf_addr_ == INADDR_NONE)
+    {
+        struct hostent *pHostEnt= NULL;
+        pHostEnt = gethostbyname(host);
+        if(pHostEnt != NULL)
+        {
+            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+        }
+    }
+    
+    address.sin_addr.s_addr = vf_addr_;
+    
+    stop();
+    reapOrphans();
+    mTransport = newTransport(host, port);
+    
+    mAsyncConn = mTransport->connectAsync(&address, connectAsnycCallback);
+    int ret = mAsyncConn ? 0 : -1;
+    if(ret)
+    {
+        delete mTransport;
+        mTransport = NULL;
+    }
+    else
+    {
+        mStatus = EPomeloConnecting;
+        
+        mAsyncConnUser = new _PomeloUser();
+        mAsyncConnUser->target = pCallbackTarget;
+        mAsyncConnUser->connSel = pCallbackSelector;
+        
+        //2.x's scheduler is not thread safe: the dispatcher waits for the
+        //connect callback's flag instead of being resumed by it
+        CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
+    }
+    return ret;
+}
+
+int CCPomeloImpl::request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool direct)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->reqSel = pCallbackSelector;
+    user->direct = direct;
+    return issueRequest(route, msg, user);
+}
+int CCPomeloImpl::request(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool direct)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->reqSel = pCallbackSelector;
+    user->direct = direct;
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxRequest, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxRequest, route, msg, user);
+    return submitRequest(route, msg, user);
+}
+
+int CCPomeloImpl::notify(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->ntfSel = pCallbackSelector;
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxNotify, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxNotify, route, msg, user);
+    return sendNotify(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::notify(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->ntfSel = pCallbackSelector;
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxNotify, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxNotify, route, msg, user);
+    return sendNotify(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d::SEL_CallFunc pSelector)
+{
+    if(mStatus != EPomeloConnected)
+        return -1;
+    mDisconnectCbTarget = pTarget;
+    mDisconnectCbSelector = pSelector;
+    return 0;
+}
+int CCPomeloImpl::requestStreamed(const char* route, const std::string& msg, size_t window, cocos2d::CCObject* pCallbackTarget, PomeloReqChunkHandler pCallbackSelector)
+{
+    if(mStatus != EPomeloConnected || window == 0)
+        return -1;
+    
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->chunkSel = pCallbackSelector;
+    user->streamWindow = window;
+    return sendRequest(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, cocos2d::CCObject* pCallbackTarget, PomeloBatchHandler pCallbackSelector)
+{
+    _PomeloUser* user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->batchSel = pCallbackSelector;
+    return startBatch(requests, timeout, user);
+}
+int CCPomeloImpl::addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool direct)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->evtSel = pCallbackSelector;
+    user->direct = direct;
+    return listen(event, hashRoute(event), user);
+}
+int CCPomeloImpl::addBatchListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventBatchHandler pCallbackSelector)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->evtBatchSel = pCallbackSelector;
+    user->batchEvents = true;
+    return listen(event, hashRoute(event), user);
+}
+int CCPomeloImpl::addPatternListener(const char* pattern, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool direct)
+{
+    _PomeloUser *user = new _PomeloUser();
+    user->target = pCallbackTarget;
+    user->evtSel = pCallbackSelector;
+    user->direct = direct;
+    
+    return addPatternUser(pattern, user);
+}
+#endif
+
+int CCPomeloImpl::issueRequest(const char* route, const std::string& msg, _PomeloUser* user)
+{
+    if(!onCocosThread())
+        return submitFromAnyThread(kOutboxRequest, route, packBody(route, msg), user);
+    if(mStatus != EPomeloConnected)
+        return stash(kOutboxRequest, route, msg, user);
+    return submitRequest(route, msg, user);
+}
+int CCPomeloImpl::submitRequest(const char* route, const std::string& msg, _PomeloUser* user)
+{
+    if(!user->direct && (mCollapseRequests || mCachePolicies.find(route) != mCachePolicies.end()))
+    {
+        //the cache/collapse key needs the parsed message anyway
+        return submitRequest(route, loadJson(msg), user);
+    }
+    return sendRequest(route, packBody(route, msg), user);
+}
+int CCPomeloImpl::submitRequest(const char* route, json_t* msg, _PomeloUser* user)
+{
+    if(user->direct)
+        return sendRequest(route, packBody(route, msg), user);
+    
+    bool cached = mCachePolicies.find(route) != mCachePolicies.end();
+    string key;
+    if(cached || mCollapseRequests)
+        key = cacheKey(route, msg);
+    
+    if(cached)
+    {
+        user->cacheKey = key;
+        
+        string resp;
+        if(lookupCache(route, user->cacheKey, resp))
+        {
+            json_decref(msg);
+            
+            _PomeloCacheHit* hit = new _PomeloCacheHit();
+            hit->user = user;
+            hit->route = route;
+            hit->status = 0;
+            hit->resp.swap(resp);
+            mCacheHitQueue.push(hit);
+            wakeDispatcher();
+            return 0;
+        }
+    }
+    
+    if(mCollapseRequests)
+    {
+        map<string,_PomeloUser*>::iterator it = mInflightRequests.find(key);
+        if(it != mInflightRequests.end())
+        {
+            //same request already on the wire, just wait for its response
+            json_decref(msg);
+            
+            _PomeloUser* last = it->second;
+            while (last->nextSubscriber)
+                last = last->nextSubscriber;
+            last->nextSubscriber = user;
+            return 0;
+        }
+    }
+    
+    int ret = sendRequest(route, packBody(route, msg), user);
+    if(ret == 0 && mCollapseRequests)
+    {
+        user->collapseKey = key;
+        mInflightRequests[key] = user;
+    }
+    return ret;
+}
+int CCPomeloImpl::sendRequest(const char* route, json_t* body, _PomeloUser* user)
+{
+    int ret;
+    if(mLimiterCount.load() && shape(kOutboxRequest, route, body, user, ret))
+        return ret;
+    ret = writeRequest(route, body, user);
+    if(ret != 0)
+        refuse(kOutboxRequest, route, user);
+    return ret;
+}
+int CCPomeloImpl::sendNotify(const char* route, json_t* body, _PomeloUser* user)
+{
+    int ret;
+    if(mLimiterCount.load() && shape(kOutboxNotify, route, body, user, ret))
+        return ret;
+    ret = writeNotify(route, body, user);
+    if(ret != 0)
+        refuse(kOutboxNotify, route, user);
+    return ret;
+}
+//a message that could not be sent: the caller learns it from the return value,
+//unless it was queued by submitFromAnyThread() and already got 0 back
+void CCPomeloImpl::refuse(char kind, const char* route, _PomeloUser* user)
+{
+    if(user && user->queued)
+    {
+        _PomeloShaped shaped = {kind, route, NULL, user};
+        performShapedFailure(shaped);
+        return;
+    }
+    delete user;
+}
+/*
+ @return: non-zero if libpomelo refused the message. The user is then taken
+ back out of mReqUserMap and handed back to the caller, body & req are freed.
+ If the callback got to the user first (it owns it then), user is set to NULL.
+ */
+int CCPomeloImpl::writeRequest(const char* route, json_t* body, _PomeloUser*& user)
+{
+    user->sentAt = nowSeconds();
+    record(kRecordRequest, route, 0, body);
+    
+    pc_request_t *req = pc_request_new();
+    addReqUser(req, user);
+    
+    int ret = mTransport->request(req, route, body, requestCallback);
+    if(ret != 0)
+    {
+        pthread_mutex_lock(&mMutex);
+        bool unanswered = mReqUserMap.erase(req) > 0;
+        pthread_mutex_unlock(&mMutex);
+        
+        if(unanswered)
+        {
+            //pc_request_destroy does NOT deal with req->msg, see clearReqResource()
+            json_decref(body);
+            pc_request_destroy(req);
+        }
+        else
+        {
+            user = NULL;
+        }
+    }
+    return ret;
+}
+//see writeRequest()
+int CCPomeloImpl::writeNotify(const char* route, json_t* body, _PomeloUser*& user)
+{
+    record(kRecordNotify, route, 0, body);
+    
+    pc_notify_t *ntf = pc_notify_new();
+    addNtfUser(ntf, user);
+    
+    int ret = mTransport->notify(ntf, route, body, notifyCallback);
+    if(ret != 0)
+    {
+        pthread_mutex_lock(&mMutex);
+        bool unanswered = mNtfUserMap.erase(ntf) > 0;
+        pthread_mutex_unlock(&mMutex);
+        
+        if(unanswered)
+        {
+            json_decref(body);
+            pc_notify_destroy(ntf);
+        }
+        else
+        {
+            user = NULL;
+        }
+    }
+    return ret;
+}
+
+/*
+ 批量请求的成员使用direct方式（跳过逐帧派发的队列），结果在到达的线程中直接写入_PomeloBatch，
+ 最后一个到达（或超时）后由ccDispatcher统一回调一次。
+ Batch members are direct requests: each result is stored into the batch
+ right where it lands, skipping the one-per-frame result queue, and
+ dispatchBatches() fires the single callback once the last one is in or the
+ batch times out. Late results of a timed out batch are simply dropped.
+ */
+int CCPomeloImpl::startBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, _PomeloUser* user)
+{
+    if(!onCocosThread() || mStatus == EPomeloStopping)
+    {
+        delete user;
+        return -1;
+    }
+    
+    _PomeloBatch* batch = new _PomeloBatch();
+    batch->user = user;
+    batch->entries.resize(requests.size());
+    batch->pending = requests.size();
+    batch->deadline = timeout > 0 ? nowSeconds() + timeout : 0;
+    batch->refs.store(requests.size() + 1);
+    
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        batch->entries[i].route = requests[i].first;
+        batch->entries[i].status = -1;
+        batch->entries[i].landed = false;
+    }
+    
+    mBatches.push_back(batch);
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        _PomeloUser* member = new _PomeloUser();
+        member->direct = true;
+        member->batch = batch;
+        member->batchIndex = i;
+        
+        int ret = issueRequest(requests[i].first.c_str(), requests[i].second, member);
+        if(ret != 0)
+        {
+            CCPomeloRequestResult result;
+            result.status = ret;
+            landBatchEntry(batch, i, result);
+        }
+    }
+    
+    if(batch->deadline > 0)
+        wakeAt(batch->deadline);
+    mWorkPending.store(1);  //members refused right away may have completed it
+#if CCX3
+    CCDirector::getInstance()->getScheduler()->resumeTarget(this);
+#else
+    CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
+#endif
+    return 0;
+}
+//any thread
+void CCPomeloImpl::landBatchEntry(_PomeloBatch* batch, size_t index, CCPomeloRequestResult& result)
+{
+    string resp;
+    result.takeJsonMsg(resp);   //rendered outside mMutex
+    
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    
+    _PomeloBatchEntry& entry = batch->entries[index];
+    bool last = false;
+    if(!entry.landed)
+    {
+        entry.landed = true;
+        entry.status = result.status;
+        entry.resp.swap(resp);
+        last = --batch->pending == 0;
+    }
+    
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
+    
+    if(last)
+        wakeDispatcher();
+}
+void CCPomeloImpl::deliverBatch(_PomeloBatch* batch, bool timedOut)
+{
+    CCPomeloBatchResult result;
+    result.timedOut = timedOut;
+    result.status = timedOut ? -1 : 0;
+    
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    for (size_t i = 0; i < batch->entries.size(); i++)
+    {
+        _PomeloBatchEntry& entry = batch->entries[i];
+        result.results.push_back(CCPomeloRequestResult());
+        CCPomeloRequestResult& one = result.results.back();
+        one.requestRoute = entry.route;
+        one.status = entry.landed ? entry.status : -1;
+        one.jsonMsg.swap(entry.resp);
+        
+        if(result.status == 0)
+            result.status = one.status;
+        entry.landed = true;    //too late for the ones still coming
+    }
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
+    
+    performBatchCallback(batch->user, result);
+}
+void CCPomeloImpl::dispatchBatches()
+{
+    if(mBatches.empty())
+        return;
+    
+    double now = nowSeconds();
+    double nextDeadline = 0;
+    vector<_PomeloBatch*> done;
+    vector<bool> timedOut;
+    
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    list<_PomeloBatch*>::iterator it = mBatches.begin();
+    while (it != mBatches.end())
+    {
+        _PomeloBatch* batch = *it;
+        bool expired = batch->deadline > 0 && now >= batch->deadline;
+        if(batch->pending == 0 || expired)
         {
-            char* json = json_dumps(docs, JSON_COMPACT);    //json is NULL
-            _PomeloUser* user = gPomelo->_theMagic->mReqUserMap[request];
-            gPomelo->_theMagic->mReqUserMap.erase(request);
-            
-#if CCX3
-            //here is the good place to perform callback
-            if(user && user->reqCB)
-            {
-                CCPomeloRequestResult result;
-                result.requestRoute = request->route;
-                result.status = status;
-                result.jsonMsg = json ? json : "";
-                
-                user->reqCB(result);
-            }
-#else
-            //here is the good place to perform callback
-            if(user && user->target && user->reqSel)
-            {
-                CCPomeloRequestResult result;
-                result.requestRoute = request->route;
-                result.status = status;
-                result.jsonMsg = json ? json : "";
-                
-                PomeloReqResultHandler sel = user->reqSel;
-                (user->target->*sel)(result);
-            }
-#endif
-            
-            delete user;
-            
-            //fixme
-            json_decref(request->msg);
-            
-            free(json);
+            done.push_back(batch);
+            timedOut.push_back(batch->pending > 0);
+            it = mBatches.erase(it);
+        }
+        else
+        {
+            if(batch->deadline > 0 && (nextDeadline == 0 || batch->deadline < nextDeadline))
+                nextDeadline = batch->deadline;
+            it++;
         }
     }
-    else    //EPomeloConnected
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
+    
+    //the last member landing wakes us, the timeout is a timer's job
+    if(nextDeadline > 0)
+        wakeAt(nextDeadline);
+    
+    //callbacks may stop() or start new batches, done ones are ours alone
+    for (size_t i = 0; i < done.size(); i++)
     {
-        pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
-        
-        char* json = json_dumps(docs, JSON_COMPACT);
-        _PomeloRequestResult* rst = new _PomeloRequestResult();
-        rst->request = request;
-        if(json)
-            rst->resp = json;
-        rst->status = status;
-        gPomelo->_theMagic->pushReqResult(rst);
-        free(json);
-        
-        pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+        deliverBatch(done[i], timedOut[i]);
+        releaseBatch(done[i]);
     }
 }
-void CCPomeloImpl::notifyCallback(pc_notify_t *ntf, int status)
+//stop(): whatever has landed by now is all there will be
+void CCPomeloImpl::flushBatches()
 {
-    if(gPomelo->status() == EPomeloStopping)
+    list<_PomeloBatch*> batches;
+    batches.swap(mBatches);
+    
+    list<_PomeloBatch*>::iterator it;
+    for (it = batches.begin(); it != batches.end(); it++)
     {
-        /*
-         EPomeloStopping时，表示此函数是由pc_client_destory()内部触发。
-         此时处于主线程中。ntf会由libpomelo内部进行释放。
-         */
-        if(gPomelo->_theMagic->mNtfUserMap.find(ntf) != gPomelo->_theMagic->mNtfUserMap.end())
+        deliverBatch(*it, false);
+        releaseBatch(*it);
+    }
+}
+
+bool CCPomeloImpl::onCocosThread() const
+{
+    return pthread_equal(pthread_self(), mCocosThread) != 0;
+}
+/*
+ 非主线程的提交在mSubmitLock读锁下进行，stop()持有写锁，因此提交期间mTransport一直有效。
+ 使用try：stop()过程中网络线程上的direct回调发起的提交直接失败，而不是等待stop()（会死锁）。
+ Submissions off the cocos thread hold mSubmitLock for reading and stop()
+ takes it for writing, so mTransport stays valid while they use it. Only a try
+ lock: a direct callback submitting on the network thread while stop() waits
+ for that very thread must fail instead of blocking.
+ */
+bool CCPomeloImpl::lockSubmit()
+{
+    if(pthread_rwlock_tryrdlock(&mSubmitLock) != 0)
+        return false;
+    
+    pthread_mutex_lock(&mMutex);
+    bool connected = mStatus == EPomeloConnected;
+    pthread_mutex_unlock(&mMutex);
+    
+    if(!connected)
+        pthread_rwlock_unlock(&mSubmitLock);
+    return connected;
+}
+void CCPomeloImpl::unlockSubmit()
+{
+    pthread_rwlock_unlock(&mSubmitLock);
+}
+int CCPomeloImpl::submitFromAnyThread(char kind, const char* route, json_t* body, _PomeloUser* user)
+{
+    if(user->streamWindow > 0)
+    {
+        json_decref(body);
+        delete user;
+        return -1;
+    }
+    if(!lockSubmit())
+    {
+        //connect()/stop() under way, or not connected: cocos thread sends it
+        //or stashes it into the outbox, refusals reach the callback
+        user->queued = true;
+        _PomeloShaped shaped = {kind, route, body, user};
+        pthread_mutex_lock(&mSubmitMutex);
+        mSubmissions.push_back(shaped);
+        pthread_mutex_unlock(&mSubmitMutex);
+        wakeDispatcher();
+        return 0;
+    }
+    
+    int ret;
+    if(kind == kOutboxRequest)
+        ret = sendRequest(route, body, user);
+    else
+        ret = sendNotify(route, body, user);
+    
+    unlockSubmit();
+    return ret;
+}
+
+//cocos thread, as if request()/notify() were called here now
+void CCPomeloImpl::dispatchSubmissions()
+{
+    list<_PomeloShaped> queued;
+    pthread_mutex_lock(&mSubmitMutex);
+    queued.swap(mSubmissions);
+    pthread_mutex_unlock(&mSubmitMutex);
+    
+    while (!queued.empty())
+    {
+        _PomeloShaped& shaped = queued.front();
+        if(mStatus != EPomeloConnected)
+            stash(shaped.kind, shaped.route.c_str(), shaped.body, shaped.user);
+        else if(shaped.kind == kOutboxRequest)
+            sendRequest(shaped.route.c_str(), shaped.body, shaped.user);
+        else
+            sendNotify(shaped.route.c_str(), shaped.body, shaped.user);
+        queued.pop_front();
+    }
+}
+//destructor only, nobody is called back
+void CCPomeloImpl::clearSubmissions()
+{
+    pthread_mutex_lock(&mSubmitMutex);
+    while (!mSubmissions.empty())
+    {
+        json_decref(mSubmissions.front().body);
+        delete mSubmissions.front().user;
+        mSubmissions.pop_front();
+    }
+    pthread_mutex_unlock(&mSubmitMutex);
+}
+
+int CCPomeloImpl::enableOutbox(const char* path, size_t capacity)
+{
+    disableOutbox();    //users stashed into the old file are for its sequence numbers
+    if(!mOutbox.open(path, capacity))
+        return -1;
+    
+    if(mStatus == EPomeloConnected)
+        flushOutbox();  //left over from last run
+    return 0;
+}
+void CCPomeloImpl::disableOutbox()
+{
+    mOutbox.close();
+    
+    map<unsigned int,_PomeloUser*>::iterator it;
+    for (it = mOutboxUsers.begin(); it != mOutboxUsers.end(); it++)
+    {
+        delete it->second;
+    }
+    mOutboxUsers.clear();
+}
+int CCPomeloImpl::stash(char kind, const char* route, const std::string& msg, _PomeloUser* user)
+{
+    if(mReplay)
+        return replayMessage(kind, route, user);
+    
+    unsigned int seq = 0;
+    if(mStatus == EPomeloStopping || user->streamWindow > 0 || !mOutbox.push(kind, route, msg, seq))
+    {
+        refuse(kind, route, user);
+        return -1;
+    }
+    
+    mOutboxUsers[seq] = user;
+    return 0;
+}
+int CCPomeloImpl::stash(char kind, const char* route, json_t* msg, _PomeloUser* user)
+{
+    string text;
+    if(msg)
+        dumpJson(msg, text, true);
+    json_decref(msg);
+    return stash(kind, route, text, user);
+}
+void CCPomeloImpl::flushOutbox()
+{
+    char kind;
+    string route;
+    string msg;
+    unsigned int seq;
+    while (mStatus == EPomeloConnected && mOutbox.front(kind, route, msg, seq))
+    {
+        _PomeloUser* user = NULL;
+        map<unsigned int,_PomeloUser*>::iterator it = mOutboxUsers.find(seq);
+        if(it != mOutboxUsers.end())
         {
-            _PomeloUser* user = gPomelo->_theMagic->mNtfUserMap[ntf];
+            user = it->second;
+            mOutboxUsers.erase(it);
+        }
+        else
+        {
+            user = new _PomeloUser();   //stashed by an earlier run, nobody to call back
+        }
+        
+        //the user is gone either way, a retry goes out without callback
+        int ret;
+        if(kind == kOutboxRequest)
+            ret = submitRequest(route.c_str(), msg, user);
+        else
+            ret = sendNotify(route.c_str(), packBody(route.c_str(), msg), user);
+        if(ret != 0)
+            break;  //kept for the next connection
+        mOutbox.pop();
+    }
+}
+
+void CCPomeloImpl::record(char kind, const char* route, int status, json_t* docs)
+{
+    if(!mRecorder.isOpen())
+        return;
+    
+    string text;
+    dumpBody(docs, text);
+    mRecorder.write(kind, route, status, text);
+}
+int CCPomeloImpl::startRecording(const char* path)
+{
+    return mRecorder.open(path) ? 0 : -1;
+}
+void CCPomeloImpl::stopRecording()
+{
+    mRecorder.close();
+}
+int CCPomeloImpl::replay(const char* path, float speed)
+{
+    if(mStatus != EPomeloStopped)
+        return -1;
+    
+    _PomeloReplay* rp = new _PomeloReplay();
+    if(!_PomeloRecorder::load(path, rp->records))
+    {
+        delete rp;
+        return -1;
+    }
+    
+    endReplay();
+    rp->pos = 0;
+    rp->start = nowSeconds();
+    rp->speed = speed;
+    mReplay = rp;
+    
+    mWorkPending.store(1);
 #if CCX3
-            if(user && user->ntfCB)
-            {
-                CCPomeloNotifyResult result;
-                result.notifyRoute = ntf->route;
-                result.status = status;
-                
-                user->ntfCB(result);
-            }
+    CCDirector::getInstance()->getScheduler()->resumeTarget(this);
 #else
-            if(user && user->target && user->ntfSel)
-            {
-                CCPomeloNotifyResult result;
-                result.notifyRoute = ntf->route;
-                result.status = status;
-                
-                PomeloNtfResultHandler sel = user->ntfSel;
-                (user->target->*sel)(result);
-            }
+    CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
 #endif
-            delete user;
-            
-            //fixme
-            json_decref(ntf->msg);
-        }
+    return 0;
+}
+bool CCPomeloImpl::isReplaying() const
+{
+    return mReplay != NULL;
+}
+//request()/notify() while replaying: nothing goes out, see dispatchReplay()
+int CCPomeloImpl::replayMessage(char kind, const char* route, _PomeloUser* user)
+{
+    if(user->streamWindow > 0)
+    {
+        delete user;
+        return -1;
     }
-    else    //EPomeloConnected
+    
+    if(kind == kOutboxRequest)
+        mReplay->requests[route].push(user);
+    else
+        mReplay->notifies.push(make_pair(string(route), user));
+    return 0;
+}
+void CCPomeloImpl::endReplay()
+{
+    if(!mReplay)
+        return;
+    
+    map<string,queue<_PomeloUser*> >::iterator it;
+    for (it = mReplay->requests.begin(); it != mReplay->requests.end(); it++)
     {
-        pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
+        for (; !it->second.empty(); it->second.pop())
+            delete it->second.front();
+    }
+    for (; !mReplay->notifies.empty(); mReplay->notifies.pop())
+        delete mReplay->notifies.front().second;
+    delete mReplay;
+    mReplay = NULL;
+    
+    clearAllPendingEvents();
+    while (!mCacheHitQueue.empty())
+    {
+        delete mCacheHitQueue.front()->user;
+        delete mCacheHitQueue.front();
+        mCacheHitQueue.pop();
+    }
+    
+#if CCX3
+    CCDirector::getInstance()->getScheduler()->pauseTarget(this);
+#else
+    CCDirector::sharedDirector()->getScheduler()->pauseTarget(this);
+#endif
+}
+
+int CCPomeloImpl::setClockSync(const char* timeKey, const char* route, float interval)
+{
+    if(mStatus != EPomeloStopped)
+        return -1;  //timeKey is read by libpomelo thread
+    
+    mClockKey = timeKey ? timeKey : "";
+    mClockRoute = route ? route : "";
+    mClockInterval = !mClockKey.empty() && !mClockRoute.empty() ? interval : 0;
+    mNextClockPing = 0;
+    return 0;
+}
+CCPomeloNetStats CCPomeloImpl::netStats() const
+{
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    CCPomeloNetStats stats = mNetStats;
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
+    return stats;
+}
+double CCPomeloImpl::serverTime() const
+{
+    return nowSeconds() + netStats().clockOffset;
+}
+#if CCX3
+void CCPomeloImpl::setNetStatsCallback(const PomeloNetStatsCallback& callback)
+{
+    mNetStatsCB = callback;
+}
+#else
+void CCPomeloImpl::setNetStatsCallback(cocos2d::CCObject* pTarget, PomeloNetStatsHandler pSelector)
+{
+    mNetStatsCbTarget = pTarget;
+    mNetStatsCbSelector = pSelector;
+}
+#endif
+void CCPomeloImpl::resetNetStats()
+{
+    memset(&mNetStats, 0, sizeof(mNetStats));
+    memset(mClockSamples, 0, sizeof(mClockSamples));
+    mClockSampleCount = 0;
+    mNetStatsDirty = false;
+}
+//called with mMutex held on libpomelo thread
+//serverTime: < 0 if the response does not carry it; now: when the response landed
+void CCPomeloImpl::addNetSample(double rtt, double serverTime, double now)
+{
+    CCPomeloNetStats& s = mNetStats;
+    if(s.samples == 0)
+    {
+        s.rtt = rtt;
+        s.rttVar = rtt / 2;
+        s.minRtt = rtt;
+    }
+    else
+    {
+        //RFC 6298: alpha = 1/8, beta = 1/4
+        s.rttVar = 0.75f * s.rttVar + 0.25f * fabs(s.rtt - rtt);
+        s.rtt = 0.875f * s.rtt + 0.125f * rtt;
+        s.minRtt = min(s.minRtt, (float)rtt);
+    }
+    s.lastRtt = rtt;
+    s.samples++;
+    
+    if(serverTime >= 0)
+    {
+        //the server stamped somewhere in the middle of the round trip
+        double offset = serverTime - (now - rtt / 2);
         
-        _PomeloNotifyResult* rst = new _PomeloNotifyResult();
-        rst->notify = ntf;
-        rst->status = status;
-        gPomelo->_theMagic->pushNtfResult(rst);
+        //keep the last few, trust the one with the shortest round trip
+        size_t slot = mClockSampleCount++ % 8;
+        mClockSamples[slot][0] = rtt;
+        mClockSamples[slot][1] = offset;
         
-        pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+        size_t count = min(mClockSampleCount, 8u);
+        size_t best = 0;
+        for (size_t i = 1; i < count; i++)
+        {
+            if(mClockSamples[i][0] < mClockSamples[best][0])
+                best = i;
+        }
+        s.clockOffset = mClockSamples[best][1];
+        s.clockSynced = true;
     }
+    
+    mNetStatsDirty = true;
+    wakeDispatcher();   //clock pings are direct, nothing else would
 }
-void CCPomeloImpl::eventCallback(pc_client_t *client, const char *event, void *data)
+void CCPomeloImpl::dispatchNetStats()
 {
-    pthread_mutex_lock(&gPomelo->_theMagic->mMutex);
+    double now = nowSeconds();
+    if(mClockInterval > 0 && mStatus == EPomeloConnected)
+    {
+        if(now >= mNextClockPing)
+        {
+            mNextClockPing = now + mClockInterval;
+            
+            //no callback: only the round trip & the time stamp matter
+            _PomeloUser* user = new _PomeloUser();
+            user->direct = true;
+            if(sendRequest(mClockRoute.c_str(), json_object(), user) != 0)
+                mNextClockPing = now + 1;   //refused (user freed by sendRequest), retry soon
+        }
+        wakeAt(mNextClockPing);
+    }
+    
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    bool dirty = mNetStatsDirty;
+    bool due = now >= mNetStatsNotifiedAt + 1;
+    if(due)
+        mNetStatsDirty = false;
+    CCPomeloNetStats stats = mNetStats;
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
     
-    if(gPomelo->status() == EPomeloConnected)
+    if(!dirty)
+        return;
+    if(!due)
     {
-        char* json = json_dumps((json_t*)data, JSON_COMPACT);
-        _PomeloEvent* rst = new _PomeloEvent();
-        rst->event = event;
-        if(json)
-            rst->data = json;
-        gPomelo->_theMagic->pushEvent(rst);
-        free(json);
+        wakeAt(mNetStatsNotifiedAt + 1);    //at most once a second
+        return;
     }
-    else    //EPomeloStopping
+    mNetStatsNotifiedAt = now;
+    
+#if CCX3
+    if(mNetStatsCB)
     {
-        //EPomeloStopping过程中不响应callback
+        mNetStatsCB(stats);
+    }
+#else
+    if(mNetStatsCbTarget && mNetStatsCbSelector)
+    {
+        (mNetStatsCbTarget->*mNetStatsCbSelector)(stats);
+    }
+#endif
+}
+
+void CCPomeloImpl::setRequestCollapsing(bool enabled)
+{
+    //requests already in flight keep collapsing until answered
+    mCollapseRequests = enabled;
+}
+
+void CCPomeloImpl::setCachePolicy(const char* route, float ttl, int maxEntries)
+{
+    map<string,_PomeloCachePolicy>::iterator it = mCachePolicies.find(route);
+    if(it != mCachePolicies.end())
+    {
+        //drop what was cached under the old policy
+        while (!it->second.keys.empty())
+        {
+            mCache.erase(it->second.keys.front());
+            it->second.keys.pop_front();
+        }
+        mCachePolicies.erase(it);
     }
     
-    pthread_mutex_unlock(&gPomelo->_theMagic->mMutex);
+    if(ttl > 0 && maxEntries > 0)
+    {
+        _PomeloCachePolicy& policy = mCachePolicies[route];
+        policy.ttl = ttl;
+        policy.maxEntries = maxEntries;
+    }
 }
-void CCPomeloImpl::disconnectedCallback(pc_client_t *client, const char *event, void *data)
+CCPomeloCacheStats CCPomeloImpl::cacheStats() const
 {
-    _PomeloEvent* rst = new _PomeloEvent();
-    rst->event = event;
-    gPomelo->_theMagic->pushEvent(rst);
+    CCPomeloCacheStats stats = mCacheStats;
+    stats.entries = mCache.size();
+    return stats;
+}
+void CCPomeloImpl::setRateLimit(const char* route, float rate, int burst, CCPomeloLimitPolicy policy)
+{
+    pthread_mutex_lock(&mMutex);
+    _PomeloBucket* bucket = &mGlobalLimit;
+    if(route)
+    {
+        if(rate <= 0)
+        {
+            if(mRouteLimits.erase(route))
+                mLimiterCount.add(-1);
+            bucket = NULL;
+        }
+        else
+        {
+            if(mRouteLimits.find(route) == mRouteLimits.end())
+                mLimiterCount.add(1);
+            bucket = &mRouteLimits[route];
+        }
+    }
+    else if((rate > 0) != (mGlobalLimit.rate > 0))
+    {
+        mLimiterCount.add(rate > 0 ? 1 : -1);
+    }
     
-    free(data); //data === NULL ?? fixme
+    if(bucket)
+    {
+        bucket->rate = max(rate, 0.0f);
+        bucket->burst = max(burst, 1);
+        bucket->tokens = bucket->burst;
+        bucket->updatedAt = nowSeconds();
+        bucket->policy = policy;
+    }
+    pthread_mutex_unlock(&mMutex);
 }
-CCPomeloImpl::~CCPomeloImpl()
+CCPomeloRateLimitStats CCPomeloImpl::rateLimitStats() const
 {
-    //just in case
-    stop();
+    pthread_mutex_lock(&mMutex);
+    CCPomeloRateLimitStats stats = mLimitStats;
+    stats.pending = mShaped.size();
+    pthread_mutex_unlock(&mMutex);
+    return stats;
 }
-
-CCPomeloImpl::CCPomeloImpl()
-:mStatus(EPomeloStopped),
-mClient(NULL),
-mAsyncConnUser(NULL),
-mAsyncConnDispatchPending(false),
-mAsyncConn(NULL),
 #if CCX3
-mDisconnectCB(NULL)
-#else
-mDisconnectCbTarget(NULL),
-mDisconnectCbSelector(NULL)
-#endif
+void CCPomeloImpl::setRateLimitCallback(const PomeloRateLimitCallback& callback)
 {
-    //paused by default
-#if CCX3
-        CCDirector::getInstance()->getScheduler()->scheduleSelector(schedule_selector(CCPomeloImpl::ccDispatcher), this, 0, true);
-#else
-        CCDirector::sharedDirector()->getScheduler()->scheduleSelector(schedule_selector(CCPomeloImpl::ccDispatcher), this, 0, true);
-#endif
-
-    
-    pthread_mutex_init(&mMutex, NULL);
+    mRateLimitCB = callback;
 }
-
-CCPomeloStatus CCPomeloImpl::status() const
+#else
+void CCPomeloImpl::setRateLimitCallback(cocos2d::CCObject* pTarget, PomeloRateLimitHandler pSelector)
 {
-    return mStatus;
+    mRateLimitCbTarget = pTarget;
+    mRateLimitCbSelector = pSelector;
 }
-
-int CCPomeloImpl::connect(const char* host, int port)
+#endif
+/*
+ 出站限流：每条消息需要从route的令牌桶和全局令牌桶各取一个令牌，取不到时按策略排队、丢弃或合并。
+ Outgoing messages take a token from the bucket of their route and from the
+ global one, if set. Otherwise the policy of the limiter in the way applies:
+ queue (sent by dispatchShaped() once tokens are back, in order per route),
+ drop (the call fails), or merge (a notify replaces the one of its route
+ still held back; both are acked together). Requests never merge, they queue.
+ @return: true if the message was held back, merged or dropped, ret tells
+ the caller which.
+ */
+bool CCPomeloImpl::shape(char kind, const char* route, json_t* body, _PomeloUser* user, int& ret)
 {
-    if(mStatus == EPomeloStopping)
-        return -1;
+    pthread_mutex_lock(&mMutex);
+    map<string,_PomeloBucket>::iterator it = mRouteLimits.find(route);
+    _PomeloBucket* routeLimit = it != mRouteLimits.end() ? &it->second : NULL;
+    _PomeloBucket* globalLimit = mGlobalLimit.rate > 0 ? &mGlobalLimit : NULL;
     
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(struct sockaddr_in));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
+    //nothing overtakes a message of its route held back
+    double now = nowSeconds();
+    bool behind = mShapedRoutes.find(route) != mShapedRoutes.end();
+    bool routeReady = refillBucket(routeLimit, now);
+    bool globalReady = refillBucket(globalLimit, now);
+    if(!behind && routeReady && globalReady)
+    {
+        if(routeLimit)
+            routeLimit->tokens -= 1;
+        if(globalLimit)
+            globalLimit->tokens -= 1;
+        mLimitStats.passed++;
+        pthread_mutex_unlock(&mMutex);
+        return false;
+    }
     
-    unsigned long vf_addr_ = inet_addr(host);
-    if(vf_addr_ == INADDR_NONE)
+    CCPomeloLimitPolicy policy = EPomeloLimitQueue;
+    if(routeLimit && (behind || !routeReady))
+        policy = routeLimit->policy;
+    else if(globalLimit)
+        policy = globalLimit->policy;
+    if(policy == EPomeloLimitMergeLatest && kind != kOutboxNotify)
+        policy = EPomeloLimitQueue;
+    
+    _PomeloShaped* merged = NULL;
+    if(policy == EPomeloLimitMergeLatest)
     {
-        struct hostent *pHostEnt= NULL;
-        pHostEnt = gethostbyname(host);
-        if(pHostEnt != NULL)
+        list<_PomeloShaped>::reverse_iterator last;
+        for (last = mShaped.rbegin(); last != mShaped.rend(); last++)
         {
-            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+            if(last->kind == kind && last->route == route)
+            {
+                merged = &*last;
+                break;
+            }
         }
+        if(!merged)
+            policy = EPomeloLimitQueue;
     }
     
-    address.sin_addr.s_addr = vf_addr_;
-    
-    //stop any connection
-    stop();
+    CCPomeloRateLimitHit& hit = mLimitHits[route];
+    hit.route = route;
+    hit.action = policy;
+    hit.count++;
     
-    mClient = pc_client_new();
-    int ret = pc_client_connect(mClient, &address);
-    if(ret)
+    ret = 0;
+    if(policy == EPomeloLimitDrop)
+    {
+        mLimitStats.dropped++;
+        ret = -1;
+    }
+    else if(merged)
     {
-        pc_client_destroy(mClient);
-        mClient = NULL;
+        //the latest body wins, the callbacks of both fire on its ack
+        mLimitStats.merged++;
+        json_decref(merged->body);
+        merged->body = body;
+        _PomeloUser* tail = merged->user;
+        while (tail->nextSubscriber)
+            tail = tail->nextSubscriber;
+        tail->nextSubscriber = user;
     }
     else
     {
-        mStatus = EPomeloConnected;
-        
-        pc_add_listener(mClient, PC_EVENT_DISCONNECT, disconnectedCallback);
-        
-#if CCX3
-        CCDirector::getInstance()->getScheduler()->resumeTarget(this);
-#else
-        CCDirector::sharedDirector()->getScheduler()->resumeTarget(this);
-#endif
-        
+        mLimitStats.queued++;
+        _PomeloShaped shaped = {kind, route, body, user};
+        mShaped.push_back(shaped);
+        mShapedRoutes[route]++;
     }
-    return ret;
+    wakeDispatcher();   //for the queue and the callback
+    pthread_mutex_unlock(&mMutex);
+    
+    if(ret != 0)
+    {
+        json_decref(body);
+        delete user;
+    }
+    return true;
 }
-
-#if CCX3
-int CCPomeloImpl::connectAsnyc(const char* host, int port, const PomeloAsyncConnCallback& callback)
+void CCPomeloImpl::dispatchShaped()
 {
-    if(mStatus == EPomeloStopping)
-        return -1;
+    if(!mLimiterCount.load() && !mWorkPending.load())
+        return;
     
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(struct sockaddr_in));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
+    vector<_PomeloShaped> ready;
+    map<string,CCPomeloRateLimitHit> hits;
     
-    unsigned long vf_addr_ = inet_addr(host);
-    if(vf_addr_ == INADDR_NONE)
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    
+    double now = nowSeconds();
+    _PomeloBucket* globalLimit = mGlobalLimit.rate > 0 ? &mGlobalLimit : NULL;
+    set<string> blocked;
+    list<_PomeloShaped>::iterator it = mShaped.begin();
+    while (it != mShaped.end() && refillBucket(globalLimit, now))
     {
-        struct hostent *pHostEnt= NULL;
-        pHostEnt = gethostbyname(host);
-        if(pHostEnt != NULL)
+        map<string,_PomeloBucket>::iterator limit = mRouteLimits.find(it->route);
+        _PomeloBucket* routeLimit = limit != mRouteLimits.end() ? &limit->second : NULL;
+        if(blocked.count(it->route) || !refillBucket(routeLimit, now))
         {
-            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+            blocked.insert(it->route);  //keep the order within the route
+            it++;
+            continue;
         }
+        
+        if(routeLimit)
+            routeLimit->tokens -= 1;
+        if(globalLimit)
+            globalLimit->tokens -= 1;
+        if(--mShapedRoutes[it->route] == 0)
+            mShapedRoutes.erase(it->route);
+        ready.push_back(*it);
+        it = mShaped.erase(it);
     }
+    hits.swap(mLimitHits);
     
-    address.sin_addr.s_addr = vf_addr_;
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
     
-    stop();
-    mClient = pc_client_new();
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        _PomeloShaped& shaped = ready[i];
+        if(mStatus != EPomeloConnected)
+        {
+            performShapedFailure(shaped);   //stopped by a callback meanwhile
+            continue;
+        }
+        
+        int ret;
+        if(shaped.kind == kOutboxRequest)
+            ret = writeRequest(shaped.route.c_str(), shaped.body, shaped.user);
+        else
+            ret = writeNotify(shaped.route.c_str(), shaped.body, shaped.user);
+        if(ret != 0 && shaped.user)
+        {
+            //refused, failed like the ones never sent (the body is freed already)
+            shaped.body = NULL;
+            performShapedFailure(shaped);
+        }
+    }
     
-    mAsyncConn = pc_connect_req_new(&address);
-    int ret = pc_client_connect2(mClient, mAsyncConn, connectAsnycCallback);
-    if(ret)
+    map<string,CCPomeloRateLimitHit>::iterator hit;
+    for (hit = hits.begin(); hit != hits.end(); hit++)
+    {
+#if CCX3
+        if(mRateLimitCB)
+        {
+            mRateLimitCB(hit->second);
+        }
+#else
+        if(mRateLimitCbTarget && mRateLimitCbSelector)
+        {
+            (mRateLimitCbTarget->*mRateLimitCbSelector)(hit->second);
+        }
+#endif
+    }
+}
+//a held back message that will never be sent, on cocos thread
+void CCPomeloImpl::performShapedFailure(const _PomeloShaped& shaped)
+{
+    json_decref(shaped.body);
+    if(shaped.kind == kOutboxRequest)
     {
-        pc_connect_req_destroy(mAsyncConn);
-        pc_client_destroy(mClient);
-        mClient = NULL;
-        mAsyncConn = NULL;
+        CCPomeloRequestResult result;
+        result.requestRoute = shaped.route;
+        result.status = -1;
+        performReqCallbacks(shaped.user, result);
     }
     else
     {
-        mStatus = EPomeloConnecting;
-        
-        mAsyncConnUser = new _PomeloUser();
-        mAsyncConnUser->connCB = callback;
+        CCPomeloNotifyResult result;
+        result.notifyRoute = shaped.route;
+        result.status = -1;
+        performNtfCallback(shaped.user, result);
     }
-    return ret;
+    delete shaped.user;
 }
-int CCPomeloImpl::setDisconnectedCallback(const std::function<void()>& callback)
+void CCPomeloImpl::clearCache()
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
-    mDisconnectCB = callback;
-    return 0;
+    map<string,_PomeloCachePolicy>::iterator it;
+    for (it = mCachePolicies.begin(); it != mCachePolicies.end(); it++)
+    {
+        it->second.keys.clear();
+    }
+    mCache.clear();
+}
+
+//route plus the message with sorted keys, so that {"a":1,"b":2} and {"b":2,"a":1} share an entry
+string CCPomeloImpl::cacheKey(const char* route, json_t* msg)
+{
+    string key = route;
+    key += '\n';
+    if(msg)
+        json_dump_callback(msg, appendToString, &key, JSON_COMPACT | JSON_SORT_KEYS | JSON_ENCODE_ANY);
+    return key;
 }
-int CCPomeloImpl::request(const char* route, const std::string& msg, const PomeloReqResultCallback& callback)
+bool CCPomeloImpl::lookupCache(const string& route, const string& key, string& resp)
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
+    map<string,_PomeloCacheEntry>::iterator it = mCache.find(key);
+    if(it != mCache.end() && it->second.expireAt <= nowSeconds())
+    {
+        _PomeloCachePolicy& policy = mCachePolicies[route];
+        evictCache(policy, find(policy.keys.begin(), policy.keys.end(), key));
+        it = mCache.end();
+    }
     
-    pc_request_t *req = pc_request_new();
-    _PomeloUser* user = new _PomeloUser();
-    user->reqCB = callback;
-    mReqUserMap[req] = user;    //ownership transferred
+    if(it == mCache.end())
+    {
+        mCacheStats.misses++;
+        return false;
+    }
     
-    json_error_t err;
-    json_t* j = json_loads(msg.c_str(), JSON_COMPACT, &err);
-    int ret = pc_request(mClient, req, route, j, requestCallback);
-    //json_decref(j);
-    return ret;
+    mCacheStats.hits++;
+    resp = it->second.resp;
+    return true;
 }
-int CCPomeloImpl::notify(const char* route, const std::string& msg, const PomeloNtfResultCallback& callback)
+void CCPomeloImpl::storeCache(const string& route, const string& key, const string& resp)
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
+    map<string,_PomeloCachePolicy>::iterator it = mCachePolicies.find(route);
+    if(it == mCachePolicies.end())
+        return; //policy removed while the request was in flight
     
-    pc_notify_t *ntf = pc_notify_new();
-    _PomeloUser* user = new _PomeloUser();
-    user->ntfCB = callback;
-    mNtfUserMap[ntf] = user;    //ownership transferred
+    _PomeloCachePolicy& policy = it->second;
+    list<string>::iterator old = find(policy.keys.begin(), policy.keys.end(), key);
+    if(old != policy.keys.end())
+        policy.keys.erase(old);
+    else if(policy.keys.size() >= policy.maxEntries)
+        evictCache(policy, policy.keys.begin());
     
-    json_error_t err;
-    json_t* j = json_loads(msg.c_str(), JSON_COMPACT, &err);
-    int ret = pc_notify(mClient, ntf, route, j, notifyCallback);
-    //json_decref(j);
-    return ret;
+    _PomeloCacheEntry& entry = mCache[key];
+    entry.resp = resp;
+    entry.expireAt = nowSeconds() + policy.ttl;
+    policy.keys.push_back(key);
 }
-int CCPomeloImpl::addListener(const char* event, const PomeloEventCallback& callback)
+void CCPomeloImpl::evictCache(_PomeloCachePolicy& policy, list<string>::iterator key)
 {
-    if(mStatus != EPomeloConnected)
+    if(key == policy.keys.end())
+        return;
+    
+    mCache.erase(*key);
+    policy.keys.erase(key);
+    mCacheStats.evictions++;
+}
+
+void CCPomeloImpl::removeListener(const char* event, unsigned int hash)
+{
+    //off the cocos thread mTransport may only be used under the submit lock,
+    //without it (not connected, or stop() running) only the listener goes
+    bool foreign = !onCocosThread();
+    bool locked = foreign && lockSubmit();
+    unlisten(event, hash, !foreign || locked);
+    if(locked)
+        unlockSubmit();
+}
+//replace the listener of event with user, ownership transferred (deleted on failure)
+int CCPomeloImpl::listen(const char* event, unsigned int hash, _PomeloUser* user)
+{
+    bool foreign = !onCocosThread();
+    if(foreign ? !lockSubmit() : mStatus != EPomeloConnected && !mReplay)
+    {
+        delete user;
         return -1;
+    }
     
-    removeListener(event);
+    unlisten(event, hash, true);    //off the cocos thread the submit lock is held
     
-    int ret = pc_add_listener(mClient, event, eventCallback);
+    //routed events are registered with libpomelo already
+    int ret = (mReplay && !foreign) || isRoutedEvent(event) ? 0 : mTransport->addListener(event, eventCallback);
     if(ret == 0)
-    {
-        _PomeloUser *user = new _PomeloUser();
-        user->evtCB = callback;
-        
-        mEventUserMap[event] = user;
-    }
+        addEventUser(event, hash, user);
+    else
+        delete user;
     
+    if(foreign)
+        unlockSubmit();
     return ret;
 }
-#else
-int CCPomeloImpl::connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector)
+//transportSafe: on cocos thread, or the submit lock is held
+void CCPomeloImpl::unlisten(const char* event, unsigned int hash, bool transportSafe)
 {
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(struct sockaddr_in));
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
+    pthread_mutex_lock(&mMutex);    //listeners may be added from any thread
+    bool found = mEventUserMap.find(event, hash) != mEventUserMap.end();
+    bool routed = mRoutedEvents.count(event) > 0;
+    pthread_mutex_unlock(&mMutex);
     
-    unsigned long vf_addr_ = inet_addr(host);
-    if(vf_addr_ == INADDR_NONE)
+    if(found)
     {
-        struct hostent *pHostEnt= NULL;
-        pHostEnt = gethostbyname(host);
-        if(pHostEnt != NULL)
+        //do not hold mMutex here: libpomelo holds its own lock while calling eventCallback
+        if(transportSafe && mTransport && !routed)
+            mTransport->removeListener(event, eventCallback);
+        
+        pthread_mutex_lock(&mMutex);
+        _PomeloEventUserMap::iterator it = mEventUserMap.find(event, hash);
+        if(it != mEventUserMap.end())
         {
-            vf_addr_ = *((unsigned long*)pHostEnt->h_addr_list[0]);
+            retireEventUser(it->second.user);
+            mEventUserMap.erase(it);
+            updateEventFilter();
         }
+        pthread_mutex_unlock(&mMutex);
     }
-    
-    address.sin_addr.s_addr = vf_addr_;
-    
-    stop();
-    mClient = pc_client_new();
-    
-    mAsyncConn = pc_connect_req_new(&address);
-    int ret = pc_client_connect2(mClient, mAsyncConn, connectAsnycCallback);
-    if(ret)
+}
+//a listener removed, mMutex held
+void CCPomeloImpl::retireEventUser(_PomeloUser* user)
+{
+    if(onCocosThread() && user != mPinnedEventUser)
     {
-        pc_connect_req_destroy(mAsyncConn);
-        pc_client_destroy(mClient);
-        mClient = NULL;
-        mAsyncConn = NULL;
+        delete user;
     }
     else
     {
-        mStatus = EPomeloConnecting;
+        //ccDispatcher or a direct eventCallback may be calling it right now
+        mRetiredUsers.push_back(user);
+        wakeDispatcher();
+    }
+}
+void CCPomeloImpl::removeAllListeners()
+{
+    if(mTransport)
+    {
+        set<string> events(mRoutedEvents);  //each one registered once
+        _PomeloEventUserMap::iterator it;
+        for (it = mEventUserMap.begin(); it != mEventUserMap.end(); it++)
+        {
+            events.insert(it->second.event);
+        }
         
-        mAsyncConnUser = new _PomeloUser();
-        mAsyncConnUser->target = pCallbackTarget;
-        mAsyncConnUser->connSel = pCallbackSelector;
+        set<string>::iterator event;
+        for (event = events.begin(); event != events.end(); event++)
+        {
+            mTransport->removeListener(event->c_str(), eventCallback);
+        }
     }
-    return ret;
+    
+    pthread_mutex_lock(&mMutex);
+    vector<_PomeloUser*> users;
+    _PomeloEventUserMap::iterator it;
+    for (it = mEventUserMap.begin(); it != mEventUserMap.end(); it++)
+    {
+        users.push_back(it->second.user);
+    }
+    mEventUserMap.clear();
+    mPatternListeners.clear(&users);
+    for (size_t i = 0; i < users.size(); i++)
+    {
+        retireEventUser(users[i]);
+    }
+    mRoutedEvents.clear();
+    updateEventFilter();
+    
+    //drop all pending callback events
+    clearAllPendingEvents();
+    pthread_mutex_unlock(&mMutex);
 }
 
-int CCPomeloImpl::request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector)
+int CCPomeloImpl::addPatternUser(const char* pattern, _PomeloUser* user)
 {
-    if(mStatus != EPomeloConnected)
+    if(!pattern || !*pattern)
+    {
+        delete user;
         return -1;
+    }
     
-    pc_request_t *req = pc_request_new();
-    _PomeloUser* user = new _PomeloUser();
-    user->target = pCallbackTarget;
-    user->reqSel = pCallbackSelector;
-    mReqUserMap[req] = user;    //ownership transferred
+    pthread_mutex_lock(&mMutex);    //eventCallback reads the patterns
+    _PomeloUser* old = mPatternListeners.insert(pattern, user);
+    updateEventFilter();
+    if(old)
+        retireEventUser(old);
+    pthread_mutex_unlock(&mMutex);
+    return 0;
+}
+void CCPomeloImpl::removePatternListener(const char* pattern)
+{
+    pthread_mutex_lock(&mMutex);
+    _PomeloUser* user = mPatternListeners.remove(pattern);
+    updateEventFilter();
+    if(user)
+        retireEventUser(user);
+    pthread_mutex_unlock(&mMutex);
+}
+int CCPomeloImpl::registerEventRoutes(const std::vector<std::string>& events)
+{
+    if(mStatus != EPomeloConnected && !mReplay)
+        return -1;
     
-    json_error_t err;
-    json_t* j = json_loads(msg.c_str(), JSON_COMPACT, &err);
-    int ret = pc_request(mClient, req, route, j, requestCallback);
-    //json_decref(j);
-    return ret;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const string& event = events[i];
+        pthread_mutex_lock(&mMutex);
+        //an exact listener has registered it already
+        bool registered = mRoutedEvents.count(event) || mEventUserMap.find(event.c_str(), hashRoute(event.c_str())) != mEventUserMap.end();
+        pthread_mutex_unlock(&mMutex);
+        
+        //do not hold mMutex here, see removeListener()
+        if(!registered && !mReplay && mTransport->addListener(event.c_str(), eventCallback) != 0)
+            return -1;
+        
+        pthread_mutex_lock(&mMutex);
+        mRoutedEvents.insert(event);
+        updateEventFilter();
+        pthread_mutex_unlock(&mMutex);
+    }
+    return 0;
+}
+//exact listener first, then the most specific pattern.
+//mMutex held, or on cocos thread while not connected
+_PomeloUser* CCPomeloImpl::findEventUser(const char* event, unsigned int hash)
+{
+    _PomeloEventUserMap::iterator it = mEventUserMap.find(event, hash);
+    if(it != mEventUserMap.end())
+        return it->second.user;
+    return mPatternListeners.match(event);
+}
+//destroy the clients of cancelled connection attempts that are done
+//connecting, on cocos thread
+void CCPomeloImpl::reapOrphans()
+{
+    if(!mReapable.load())
+        return;
+    
+    vector<_PomeloTransport*> transports;
+    pthread_mutex_lock(&mMutex);
+    list<_PomeloOrphan>::iterator it = mOrphans.begin();
+    while (it != mOrphans.end())
+    {
+        if(it->done)
+        {
+            transports.push_back(it->transport);
+            it = mOrphans.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+    mReapable.add(-(long)transports.size());
+    pthread_mutex_unlock(&mMutex);
+    
+    //outside mMutex: it waits for the libpomelo thread, which may want mMutex
+    for (size_t i = 0; i < transports.size(); i++)
+    {
+        delete transports[i];   //pc_client_destroy() for tcp
+    }
 }
-
-int CCPomeloImpl::notify(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector)
+void CCPomeloImpl::setDeltaEvent(const char* event, const char* keyField, bool full)
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
+    pthread_mutex_lock(&mDeltaMutex);
+    if(mDeltaEvents.find(event) == mDeltaEvents.end())
+        mDeltaEventCount.add(1);
     
-    pc_notify_t *ntf = pc_notify_new();
-    _PomeloUser* user = new _PomeloUser();
-    user->target = pCallbackTarget;
-    user->ntfSel = pCallbackSelector;
-    mNtfUserMap[ntf] = user;    //ownership transferred
+    _PomeloDeltaEvent& delta = mDeltaEvents[event];
+    delta.keyField = keyField ? keyField : "";
+    delta.full = full;
+    pthread_mutex_unlock(&mDeltaMutex);
     
-    json_error_t err;
-    json_t* j = json_loads(msg.c_str(), JSON_COMPACT, &err);
-    int ret = pc_notify(mClient, ntf, route, j, notifyCallback);
-    //json_decref(j);
-    return ret;
+    if(mStatus == EPomeloConnected && onCocosThread())
+        registerEventRoutes(vector<string>(1, event));
 }
-int CCPomeloImpl::setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d::SEL_CallFunc pSelector)
+void CCPomeloImpl::removeDeltaEvent(const char* event)
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
-    mDisconnectCbTarget = pTarget;
-    mDisconnectCbSelector = pSelector;
-    return 0;
+    pthread_mutex_lock(&mDeltaMutex);
+    map<string,_PomeloDeltaEvent>::iterator it = mDeltaEvents.find(event);
+    if(it != mDeltaEvents.end())
+    {
+        //eventCallback may be holding them, see releaseDocs()
+        map<string,json_t*>::iterator doc;
+        for (doc = it->second.docs.begin(); doc != it->second.docs.end(); doc++)
+        {
+            releaseDocs(doc->second);
+        }
+        mDeltaEvents.erase(it);
+        mDeltaEventCount.add(-1);
+    }
+    pthread_mutex_unlock(&mDeltaMutex);
 }
-int CCPomeloImpl::addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector)
+void CCPomeloImpl::resetDeltaDocs()
 {
-    if(mStatus != EPomeloConnected)
-        return -1;
-    
-    removeListener(event);
-    
-    int ret = pc_add_listener(mClient, event, eventCallback);
-    if(ret == 0)
+    pthread_mutex_lock(&mDeltaMutex);
+    map<string,_PomeloDeltaEvent>::iterator it;
+    for (it = mDeltaEvents.begin(); it != mDeltaEvents.end(); it++)
     {
-        _PomeloUser *user = new _PomeloUser();
-        user->target = pCallbackTarget;
-        user->evtSel = pCallbackSelector;
-        
-        mEventUserMap[event] = user;
+        map<string,json_t*>::iterator doc;
+        for (doc = it->second.docs.begin(); doc != it->second.docs.end(); doc++)
+        {
+            json_decref(doc->second);
+        }
+        it->second.docs.clear();
+    }
+    pthread_mutex_unlock(&mDeltaMutex);
+}
+//delta events stay registered with libpomelo as routed events, so that their
+//states keep up while no listener is attached. On cocos thread once connected
+void CCPomeloImpl::registerDeltaEvents()
+{
+    vector<string> events;
+    pthread_mutex_lock(&mDeltaMutex);
+    map<string,_PomeloDeltaEvent>::iterator it;
+    for (it = mDeltaEvents.begin(); it != mDeltaEvents.end(); it++)
+    {
+        events.push_back(it->first);
     }
+    pthread_mutex_unlock(&mDeltaMutex);
     
-    return ret;
+    registerEventRoutes(events);
 }
-#endif
-
-void CCPomeloImpl::removeListener(const char* event)
+//update the state of a delta event, on libpomelo thread.
+//@return: new reference to what the listener gets, NULL if event is not a delta event
+json_t* CCPomeloImpl::applyDelta(const char* event, json_t* docs)
 {
-    if(mEventUserMap.find(event) != mEventUserMap.end())
+    if(!mDeltaEventCount.load() || !docs)
+        return NULL;
+    
+    pthread_mutex_lock(&mDeltaMutex);
+    map<string,_PomeloDeltaEvent>::iterator it = mDeltaEvents.find(event);
+    if(it == mDeltaEvents.end())
     {
-        pc_remove_listener(mClient, event, eventCallback);
-        
-        delete mEventUserMap[event];
-        mEventUserMap.erase(event);
+        pthread_mutex_unlock(&mDeltaMutex);
+        return NULL;
+    }
+    _PomeloDeltaEvent& delta = it->second;
+    
+    //patches may be compressed as well
+    json_t* body = json_incref(docs);
+    string raw;
+    if(unzipBody(docs, raw))
+    {
+        json_decref(body);
+        body = loadJson(raw);
     }
+    
+    json_t* patch = json_object_size(body) == 1 ? json_object_get(body, POMELO_DELTA_KEY) : NULL;
+    json_t* doc = patch ? patch : body;
+    json_t*& state = delta.docs[delta.keyField.empty() ? "" : deltaKey(json_object_get(doc, delta.keyField.c_str()))];
+    
+    json_t* next = patch ? mergePatch(state, patch) : json_incref(body);
+    json_decref(state);
+    state = next;
+    
+    json_t* out = json_incref(delta.full ? next : doc);
+    pthread_mutex_unlock(&mDeltaMutex);
+    
+    json_decref(body);
+    return out;
 }
-void CCPomeloImpl::removeAllListeners()
+//rebuild the filter of eventCallback, mMutex held.
+//Words are stored one by one, each from its old value straight to the new
+//one, so an event subscribed both before and after never looks unsubscribed.
+void CCPomeloImpl::updateEventFilter()
 {
-    if(!mEventUserMap.empty())
+    unsigned long words[kEventFilterWords] = {0};
+    unsigned long direct[kEventFilterWords] = {0};
+    
+    _PomeloEventUserMap::iterator it;
+    for (it = mEventUserMap.begin(); it != mEventUserMap.end(); it++)
     {
-        map<string,_PomeloUser*>::iterator it;
-        for (it = mEventUserMap.begin(); it != mEventUserMap.end(); it++)
+        unsigned int bit = it->first % kEventFilterBits;
+        words[bit / 32] |= 1UL << (bit % 32);
+        if(it->second.user->direct)
+            direct[bit / 32] |= 1UL << (bit % 32);
+    }
+    //patterns only ever see routed events
+    set<string>::iterator event;
+    for (event = mRoutedEvents.begin(); event != mRoutedEvents.end(); event++)
+    {
+        _PomeloUser* user = mPatternListeners.match(event->c_str());
+        if(user)
         {
-            string event = (*it).first;
-            pc_remove_listener(mClient, event.c_str(), eventCallback);
-            
-            delete mEventUserMap[event];
+            unsigned int bit = hashRoute(event->c_str()) % kEventFilterBits;
+            words[bit / 32] |= 1UL << (bit % 32);
+            if(user->direct)
+                direct[bit / 32] |= 1UL << (bit % 32);
         }
     }
-    mEventUserMap.clear();
     
-    //drop all pending callback events
+    for (int i = 0; i < kEventFilterWords; i++)
+    {
+        mEventFilter[i].store(words[i]);
+        mDirectFilter[i].store(direct[i]);
+    }
+}
+bool CCPomeloImpl::maySubscribe(unsigned int hash) const
+{
+    unsigned int bit = hash % kEventFilterBits;
+    return (mEventFilter[bit / 32].load() >> (bit % 32)) & 1;
+}
+//false: the listener of event, if any, is a queued one
+bool CCPomeloImpl::mayDispatchDirect(unsigned int hash) const
+{
+    unsigned int bit = hash % kEventFilterBits;
+    return (mDirectFilter[bit / 32].load() >> (bit % 32)) & 1;
+}
+long CCPomeloImpl::droppedEvents() const
+{
+    return mDroppedEvents.load();
+}
+bool CCPomeloImpl::isRoutedEvent(const string& event)
+{
     pthread_mutex_lock(&mMutex);
-    clearAllPendingEvents();
+    bool routed = mRoutedEvents.count(event) > 0;
+    pthread_mutex_unlock(&mMutex);
+    return routed;
+}
+void CCPomeloImpl::deleteRetiredUsers()
+{
+    vector<_PomeloUser*> users;
+    pthread_mutex_lock(&mMutex);
+    users.swap(mRetiredUsers);
+    vector<_PomeloUser*>::iterator pinned = find(users.begin(), users.end(), mPinnedEventUser);
+    if(pinned != users.end())
+    {
+        //still being called, the next round gets it
+        mRetiredUsers.push_back(*pinned);
+        users.erase(pinned);
+    }
     pthread_mutex_unlock(&mMutex);
+    
+    for (size_t i = 0; i < users.size(); i++)
+    {
+        delete users[i];
+    }
 }
 
 void CCPomeloImpl::stop()
 {
+    //batches waiting on the outbox survive a stop() while already stopped
+    bool active = mReplay || mStatus == EPomeloConnecting || mStatus == EPomeloConnected;
+    list<_PomeloShaped> shaped;
+    vector<pair<_PomeloUser*, CCPomeloResponseChunk> > streams;
+    
+    endReplay();
+    
+    pthread_rwlock_wrlock(&mSubmitLock);    //wait for submissions from other threads
     pthread_mutex_lock(&mMutex);
     
     switch (mStatus) {
@@ -925,33 +4986,57 @@ void CCPomeloImpl::stop()
             {
                 /*
                  在libpomelo仍处于连接过程中销毁pc_connect_t或pc_client_t，会导致libuv崩溃。
+                 先记下来，连接回调之后再由cocos线程销毁。
                  */
                 //libuv crashes if we destory pc_connect_t or destory
                 //pc_client_t when libpomelo is connecting
-                //so we simply create a new pc_client_t and ignore
-                //the old pc_connect_t
+                //so the old one is kept aside and destroyed by reapOrphans()
+                //once its connect callback has run
+                _PomeloOrphan orphan = {mTransport, mAsyncConn, false};
+                mOrphans.push_back(orphan);
             }
             else    //EPomeloConnected
             {
-                pc_remove_listener(mClient, PC_EVENT_DISCONNECT, disconnectedCallback);
+                mTransport->removeListener(PC_EVENT_DISCONNECT, disconnectedCallback);
                 /*
                  注意：pc_client_destroy()内部会触发所有未完成的request/notify的回调。CCPomeloWrapper会将这些回调以【同步方式】扔回给客户端。
                  */
-                pc_client_destroy(mClient);
+                delete mTransport;  //pc_client_destroy() for tcp
             }
             
             mAsyncConn = NULL;
-            mClient = NULL;
+            mTransport = NULL;
             mStatus = EPomeloStopped;   //重置标记
             
             //release resources
             delete mAsyncConnUser;
             mAsyncConnUser = NULL;
             mAsyncConnDispatchPending = false;
+            mWorkPending.store(0);
             
             clearReqResource();
             clearNtfResource();
             clearAllPendingEvents();
+            clearStreams(streams);  //ended below, outside the locks
+            drainReleasedDocs(false);   //libpomelo thread is gone by now
+            
+            //results of decode jobs still running are dropped
+            mDecodeGeneration++;
+            mDecoded.clear();
+            
+            resetNetStats();    //a new connection may take another path
+            resetDeltaDocs();   //the server starts over with full documents
+            
+            shaped.swap(mShaped);   //failed below, outside the locks
+            mShapedRoutes.clear();
+            
+            //the cache itself survives, e.g. for gate -> connector switching
+            while (!mCacheHitQueue.empty())
+            {
+                delete mCacheHitQueue.front()->user;
+                delete mCacheHitQueue.front();
+                mCacheHitQueue.pop();
+            }
             
 #if CCX3
             CCDirector::getInstance()->getScheduler()->pauseTarget(this);
@@ -965,11 +5050,37 @@ void CCPomeloImpl::stop()
             break;
     }
 
+    mRoutedEvents.clear();  //registered with the client just destroyed
+    updateEventFilter();
+    
     pthread_mutex_unlock(&mMutex);
+    pthread_rwlock_unlock(&mSubmitLock);
+    
+    //queued while we were stopping, their wake was just cleared above
+    pthread_mutex_lock(&mSubmitMutex);
+    bool submitted = !mSubmissions.empty();
+    pthread_mutex_unlock(&mSubmitMutex);
+    if(submitted)
+        wakeDispatcher();
+    
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        performChunkCallback(streams[i].first, streams[i].second);
+        delete streams[i].first;
+    }
+    while (!shaped.empty())
+    {
+        performShapedFailure(shaped.front());
+        shaped.pop_front();
+    }
+    if(active)
+        flushBatches(); //outside the locks, callbacks may connect again
 }
 
 void CCPomeloImpl::clearReqResource()
 {
+    mInflightRequests.clear();
+    
     map<pc_request_t*, _PomeloUser*>::iterator reqIt;
     for (reqIt = mReqUserMap.begin(); reqIt != mReqUserMap.end(); reqIt++)
     {
@@ -985,10 +5096,13 @@ void CCPomeloImpl::clearReqResource()
     }
     mReqUserMap.clear();
     
-    _PomeloRequestResult* reqRst = NULL;
-    while((reqRst = popReqResult(false)))
+    while (!mReqResultQueue.empty())
     {
+        _PomeloRequestResult* reqRst = mReqResultQueue.front();
+        if(reqRst->docs)
+            releaseDocs(reqRst->docs);
         delete reqRst;
+        mReqResultQueue.pop();
     }
     queue<_PomeloRequestResult*> empty;
     swap(mReqResultQueue, empty);
@@ -1017,16 +5131,206 @@ void CCPomeloImpl::clearNtfResource()
     queue<_PomeloNotifyResult*> empty;
     swap(mNtfResultQueue, empty);
 }
+//the users are handed back with their last chunk, see stop()
+void CCPomeloImpl::clearStreams(vector<pair<_PomeloUser*, CCPomeloResponseChunk> >& ended)
+{
+    list<_PomeloStream*>::iterator it;
+    for (it = mStreams.begin(); it != mStreams.end(); it++)
+    {
+        _PomeloStream* stream = *it;
+        releaseDocs(stream->docs);
+        json_decref(stream->request->msg);
+        if(stream == mDeliveringStream)
+        {
+            //called from its chunk callback, dispatchStreams() ends and frees it
+            pc_request_destroy(stream->request);
+            stream->request = NULL;
+            stream->docs = NULL;
+            mDeliveringStream = NULL;
+            continue;
+        }
+        
+        CCPomeloResponseChunk chunk;
+        chunk.requestRoute = stream->request->route;
+        chunk.status = -1;
+        chunk.last = true;
+        ended.push_back(make_pair(stream->user, chunk));
+        
+        pc_request_destroy(stream->request);
+        delete stream;
+    }
+    mStreams.clear();
+}
+
+/*
+ json_t的引用计数不是线程安全的。libpomelo线程在回调返回后还会对docs做decref，
+ 所以主线程不能直接decref从回调中保留下来的docs，而是交还给libpomelo线程，
+ 在下一次回调时（此时libpomelo对同一docs的decref必然已经完成）释放。
+ jansson refcounts are not atomic and libpomelo drops its own reference
+ right after our callback returns. Docs retained from a callback are thus
+ handed back and released by the next callback on libpomelo thread, or by
+ stop() once that thread is gone.
+ */
+void CCPomeloImpl::releaseDocs(json_t* docs)
+{
+    if(!docs)
+        return;
+    
+    bool locked = mStatus == EPomeloConnected;
+    if(locked)
+        pthread_mutex_lock(&mMutex);
+    mReleasedDocs.push_back(docs);
+    if(locked)
+        pthread_mutex_unlock(&mMutex);
+}
+//called on libpomelo thread, or after that thread is gone
+//freeing big trees takes a while, so it is done outside mMutex
+void CCPomeloImpl::drainReleasedDocs(bool lock/* = true*/)
+{
+    vector<json_t*> docs;
+    if(lock)
+        pthread_mutex_lock(&mMutex);
+    docs.swap(mReleasedDocs);
+    if(lock)
+        pthread_mutex_unlock(&mMutex);
+    
+    for (size_t i = 0; i < docs.size(); i++)
+    {
+        json_decref(docs[i]);
+    }
+}
+
+/*
+ 超过阈值的响应/推送交给解码线程转换为json文本，libpomelo线程不会被大消息阻塞。
+ 结果按到达顺序派发：队首的消息未解码完成时，后面的消息也不会派发。
+ Heavy bodies are dumped by the decode workers so that libpomelo thread never
+ waits for a big message. The queued result/event keeps its place and holds
+ back the ones behind it until its text is ready. Workers only read docs;
+ the reference taken for them is handed back through mReleasedDocs.
+ */
+bool CCPomeloImpl::isHeavy(json_t* docs) const
+{
+    if(mDecodeThreads.empty() || !docs)
+        return false;
+    if(json_is_object(docs) && json_object_get(docs, POMELO_ZIP_KEY))
+        return true;
+    return estimateJsonSize(docs, mDecodeThreshold) >= mDecodeThreshold;
+}
+//called with mMutex held
+_PomeloDecodeJob CCPomeloImpl::newDecodeJob(json_t* docs)
+{
+    _PomeloDecodeJob job = {0, 0, NULL};
+    if(++mDecodeSeq == 0)
+        ++mDecodeSeq;   //0 means not decoding
+    job.seq = mDecodeSeq;
+    job.generation = mDecodeGeneration;
+    job.docs = json_incref(docs);
+    return job;
+}
+void CCPomeloImpl::queueDecodeJob(const _PomeloDecodeJob& job)
+{
+    pthread_mutex_lock(&mDecodeMutex);
+    mDecodeJobs.push(job);
+    pthread_cond_signal(&mDecodeCond);
+    pthread_mutex_unlock(&mDecodeMutex);
+}
+//called with mMutex held
+//@return: false if the job is still running
+bool CCPomeloImpl::takeDecoded(unsigned int& seq, string& out)
+{
+    if(seq == 0)
+        return true;
+    
+    map<unsigned int,string>::iterator it = mDecoded.find(seq);
+    if(it == mDecoded.end())
+        return false;
+    
+    out.swap(it->second);
+    mDecoded.erase(it);
+    seq = 0;
+    return true;
+}
+void* CCPomeloImpl::decodeWorker(void* arg)
+{
+    CCPomeloImpl* impl = (CCPomeloImpl*)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&impl->mDecodeMutex);
+        while (impl->mDecodeJobs.empty() && !impl->mDecodeQuit)
+            pthread_cond_wait(&impl->mDecodeCond, &impl->mDecodeMutex);
+        if(impl->mDecodeQuit)
+        {
+            pthread_mutex_unlock(&impl->mDecodeMutex);
+            break;
+        }
+        _PomeloDecodeJob job = impl->mDecodeJobs.front();
+        impl->mDecodeJobs.pop();
+        pthread_mutex_unlock(&impl->mDecodeMutex);
+        
+        string text;
+        dumpBody(job.docs, text);
+        
+        pthread_mutex_lock(&impl->mMutex);
+        if(job.generation == impl->mDecodeGeneration)
+        {
+            impl->mDecoded[job.seq].swap(text);
+            impl->wakeDispatcher();
+        }
+        impl->mReleasedDocs.push_back(job.docs);
+        pthread_mutex_unlock(&impl->mMutex);
+    }
+    return NULL;
+}
+int CCPomeloImpl::setDecodeWorkers(int count, int threshold)
+{
+    if(mStatus != EPomeloStopped)
+        return -1;
+    
+    stopDecodeWorkers();
+    
+    mDecodeThreshold = threshold > 0 ? threshold : 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, decodeWorker, this) != 0)
+            break;
+        mDecodeThreads.push_back(thread);
+    }
+    return count <= 0 || !mDecodeThreads.empty() ? 0 : -1;
+}
+//only while stopped: no more jobs are coming
+void CCPomeloImpl::stopDecodeWorkers()
+{
+    pthread_mutex_lock(&mDecodeMutex);
+    mDecodeQuit = true;
+    pthread_cond_broadcast(&mDecodeCond);
+    pthread_mutex_unlock(&mDecodeMutex);
+    
+    for (size_t i = 0; i < mDecodeThreads.size(); i++)
+    {
+        pthread_join(mDecodeThreads[i], NULL);
+    }
+    mDecodeThreads.clear();
+    
+    //jobs never picked up
+    while (!mDecodeJobs.empty())
+    {
+        mReleasedDocs.push_back(mDecodeJobs.front().docs);
+        mDecodeJobs.pop();
+    }
+    mDecodeQuit = false;
+}
+
 void CCPomeloImpl::clearAllPendingEvents()
 {
     while (!mEventQueue.empty())
     {
         _PomeloEvent* rst = mEventQueue.front();
         delete rst;
-        mEventQueue.pop();
+        mEventQueue.pop_front();
     }
     
-    queue<_PomeloEvent*> empty;
+    deque<_PomeloEvent*> empty;
     swap(mEventQueue, empty);
 }
 
@@ -1073,17 +5377,67 @@ int CCPomeloWrapper::setDisconnectedCallback(const std::function<void()>& callba
 {
     return _theMagic->setDisconnectedCallback(callback);
 }
-int CCPomeloWrapper::request(const char* route, const std::string& msg, const PomeloReqResultCallback& callback)
+int CCPomeloWrapper::request(const char* route, const std::string& msg, PomeloReqResultCallback callback, bool dispatchOnNetworkThread)
+{
+    return _theMagic->request(route, msg, std::move(callback), dispatchOnNetworkThread);
+}
+int CCPomeloWrapper::request(const char* route, json_t* msg, PomeloReqResultCallback callback, bool dispatchOnNetworkThread)
+{
+    return _theMagic->request(route, msg, std::move(callback), dispatchOnNetworkThread);
+}
+int CCPomeloWrapper::notify(const char* route, const std::string& msg, PomeloNtfResultCallback callback)
+{
+    return _theMagic->notify(route, msg, std::move(callback));
+}
+int CCPomeloWrapper::notify(const char* route, json_t* msg, PomeloNtfResultCallback callback)
+{
+    return _theMagic->notify(route, msg, std::move(callback));
+}
+int CCPomeloWrapper::requestStreamed(const char* route, const std::string& msg, size_t window, PomeloReqChunkCallback callback)
+{
+    return _theMagic->requestStreamed(route, msg, window, std::move(callback));
+}
+CCPomeloFuture<int> CCPomeloWrapper::connectAsnyc(const char* host, int port)
+{
+    CCPomeloFuture<int> future;
+    int ret = _theMagic->connectAsnyc(host, port, [future](int status){
+        future.resolve(status);
+    });
+    if(ret != 0)
+        future.resolve(ret);
+    return future;
+}
+CCPomeloFuture<CCPomeloRequestResult> CCPomeloWrapper::request(const char* route, const std::string& msg)
+{
+    return _theMagic->requestFuture<const std::string&>(route, msg);
+}
+CCPomeloFuture<CCPomeloRequestResult> CCPomeloWrapper::request(const char* route, json_t* msg)
+{
+    return _theMagic->requestFuture<json_t*>(route, msg);
+}
+int CCPomeloWrapper::requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, PomeloBatchCallback callback)
+{
+    return _theMagic->requestBatch(requests, timeout, std::move(callback));
+}
+int CCPomeloWrapper::requestOn(PomeloExecutor executor, const char* route, const std::string& msg, PomeloReqResultCallback callback)
+{
+    return _theMagic->requestOn(std::move(executor), route, msg, std::move(callback));
+}
+int CCPomeloWrapper::addListener(const char* event, PomeloEventCallback callback, bool dispatchOnNetworkThread)
+{
+    return _theMagic->addListener(event, hashRoute(event), std::move(callback), dispatchOnNetworkThread);
+}
+int CCPomeloWrapper::addListener(const char* event, unsigned int hash, PomeloEventCallback callback, bool dispatchOnNetworkThread)
 {
-    return _theMagic->request(route, msg, callback);
+    return _theMagic->addListener(event, hash, std::move(callback), dispatchOnNetworkThread);
 }
-int CCPomeloWrapper::notify(const char* route, const std::string& msg, const PomeloNtfResultCallback& callback)
+int CCPomeloWrapper::addBatchListener(const char* event, PomeloEventBatchCallback callback)
 {
-    return _theMagic->notify(route, msg, callback);
+    return _theMagic->addBatchListener(event, std::move(callback));
 }
-int CCPomeloWrapper::addListener(const char* event, const PomeloEventCallback& callback)
+int CCPomeloWrapper::addPatternListener(const char* pattern, PomeloEventCallback callback, bool dispatchOnNetworkThread)
 {
-    return _theMagic->addListener(event, callback);
+    return _theMagic->addPatternListener(pattern, std::move(callback), dispatchOnNetworkThread);
 }
 #else
 int CCPomeloWrapper::connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector)
@@ -1095,22 +5449,158 @@ int CCPomeloWrapper::setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d
     return _theMagic->setDisconnectedCallback(pTarget, pSelector);
 }
 
-int CCPomeloWrapper::request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector)
+int CCPomeloWrapper::request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool dispatchOnNetworkThread)
+{
+    return _theMagic->request(route, msg, pCallbackTarget, pCallbackSelector, dispatchOnNetworkThread);
+}
+int CCPomeloWrapper::request(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool dispatchOnNetworkThread)
 {
-    return _theMagic->request(route, msg, pCallbackTarget, pCallbackSelector);
+    return _theMagic->request(route, msg, pCallbackTarget, pCallbackSelector, dispatchOnNetworkThread);
 }
 
 int CCPomeloWrapper::notify(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector)
 {
     return _theMagic->notify(route, msg, pCallbackTarget, pCallbackSelector);
 }
-int CCPomeloWrapper::addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector)
+int CCPomeloWrapper::notify(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector)
+{
+    return _theMagic->notify(route, msg, pCallbackTarget, pCallbackSelector);
+}
+int CCPomeloWrapper::requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, cocos2d::CCObject* pCallbackTarget, PomeloBatchHandler pCallbackSelector)
+{
+    return _theMagic->requestBatch(requests, timeout, pCallbackTarget, pCallbackSelector);
+}
+int CCPomeloWrapper::requestStreamed(const char* route, const std::string& msg, size_t window, cocos2d::CCObject* pCallbackTarget, PomeloReqChunkHandler pCallbackSelector)
+{
+    return _theMagic->requestStreamed(route, msg, window, pCallbackTarget, pCallbackSelector);
+}
+int CCPomeloWrapper::addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool dispatchOnNetworkThread)
+{
+    return _theMagic->addListener(event, pCallbackTarget, pCallbackSelector, dispatchOnNetworkThread);
+}
+int CCPomeloWrapper::addBatchListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventBatchHandler pCallbackSelector)
+{
+    return _theMagic->addBatchListener(event, pCallbackTarget, pCallbackSelector);
+}
+int CCPomeloWrapper::addPatternListener(const char* pattern, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool dispatchOnNetworkThread)
+{
+    return _theMagic->addPatternListener(pattern, pCallbackTarget, pCallbackSelector, dispatchOnNetworkThread);
+}
+#endif
+
+
+
+void CCPomeloWrapper::setProtoCache(const char* path, const char* file)
+{
+    _theMagic->setProtoCache(path, file);
+}
+void CCPomeloWrapper::setLoopbackServer(CCPomeloLoopbackServer* server)
+{
+    _theMagic->setLoopbackServer(server);
+}
+#if CCX3
+void CCPomeloWrapper::setWebSocket(const char* path, bool secure)
 {
-    return _theMagic->addListener(event, pCallbackTarget, pCallbackSelector);
+    _theMagic->setWebSocket(path, secure);
 }
 #endif
 
+void CCPomeloWrapper::setCompression(const char* route, int threshold)
+{
+    _theMagic->setCompression(route, threshold);
+}
 
+void CCPomeloWrapper::setCachePolicy(const char* route, float ttl, int maxEntries)
+{
+    _theMagic->setCachePolicy(route, ttl, maxEntries);
+}
+int CCPomeloWrapper::enableOutbox(const char* path, size_t capacity)
+{
+    return _theMagic->enableOutbox(path, capacity);
+}
+void CCPomeloWrapper::disableOutbox()
+{
+    _theMagic->disableOutbox();
+}
+int CCPomeloWrapper::startRecording(const char* path)
+{
+    return _theMagic->startRecording(path);
+}
+void CCPomeloWrapper::stopRecording()
+{
+    _theMagic->stopRecording();
+}
+int CCPomeloWrapper::replay(const char* path, float speed)
+{
+    return _theMagic->replay(path, speed);
+}
+bool CCPomeloWrapper::isReplaying() const
+{
+    return _theMagic->isReplaying();
+}
+int CCPomeloWrapper::setDecodeWorkers(int count, int threshold)
+{
+    return _theMagic->setDecodeWorkers(count, threshold);
+}
+void CCPomeloWrapper::setDeltaEvent(const char* event, const char* keyField, bool deliverFullDocument)
+{
+    _theMagic->setDeltaEvent(event, keyField, deliverFullDocument);
+}
+void CCPomeloWrapper::removeDeltaEvent(const char* event)
+{
+    _theMagic->removeDeltaEvent(event);
+}
+int CCPomeloWrapper::setClockSync(const char* timeKey, const char* route, float interval)
+{
+    return _theMagic->setClockSync(timeKey, route, interval);
+}
+CCPomeloNetStats CCPomeloWrapper::netStats() const
+{
+    return _theMagic->netStats();
+}
+double CCPomeloWrapper::serverTime() const
+{
+    return _theMagic->serverTime();
+}
+#if CCX3
+void CCPomeloWrapper::setNetStatsCallback(const PomeloNetStatsCallback& callback)
+{
+    _theMagic->setNetStatsCallback(callback);
+}
+void CCPomeloWrapper::setRateLimitCallback(const PomeloRateLimitCallback& callback)
+{
+    _theMagic->setRateLimitCallback(callback);
+}
+#else
+void CCPomeloWrapper::setNetStatsCallback(cocos2d::CCObject* pTarget, PomeloNetStatsHandler pSelector)
+{
+    _theMagic->setNetStatsCallback(pTarget, pSelector);
+}
+void CCPomeloWrapper::setRateLimitCallback(cocos2d::CCObject* pTarget, PomeloRateLimitHandler pSelector)
+{
+    _theMagic->setRateLimitCallback(pTarget, pSelector);
+}
+#endif
+void CCPomeloWrapper::setRequestCollapsing(bool enabled)
+{
+    _theMagic->setRequestCollapsing(enabled);
+}
+CCPomeloCacheStats CCPomeloWrapper::cacheStats() const
+{
+    return _theMagic->cacheStats();
+}
+void CCPomeloWrapper::setRateLimit(const char* route, float rate, int burst, CCPomeloLimitPolicy policy)
+{
+    _theMagic->setRateLimit(route, rate, burst, policy);
+}
+CCPomeloRateLimitStats CCPomeloWrapper::rateLimitStats() const
+{
+    return _theMagic->rateLimitStats();
+}
+void CCPomeloWrapper::clearCache()
+{
+    _theMagic->clearCache();
+}
 
 void CCPomeloWrapper::stop()
 {
@@ -1119,12 +5609,30 @@ void CCPomeloWrapper::stop()
 
 void CCPomeloWrapper::removeListener(const char* event)
 {
-    _theMagic->removeListener(event);
+    _theMagic->removeListener(event, hashRoute(event));
+}
+#if CCX3
+void CCPomeloWrapper::removeListener(const char* event, unsigned int hash)
+{
+    _theMagic->removeListener(event, hash);
 }
+#endif
 void CCPomeloWrapper::removeAllListeners()
 {
     _theMagic->removeAllListeners();
 }
+int CCPomeloWrapper::registerEventRoutes(const std::vector<std::string>& events)
+{
+    return _theMagic->registerEventRoutes(events);
+}
+void CCPomeloWrapper::removePatternListener(const char* pattern)
+{
+    _theMagic->removePatternListener(pattern);
+}
+long CCPomeloWrapper::droppedEvents() const
+{
+    return _theMagic->droppedEvents();
+}
 CCPomeloWrapper::CCPomeloWrapper()
 {
     _theMagic = new CCPomeloImpl();
@@ -23,6 +23,17 @@
 #if COCOS2D_VERSION >= 0x00030000
     #define CCX3 1  //cocos2dx 3.0+
     #include <functional>
+    #include <memory>
+    #include <new>
+    #include <type_traits>
+    #include <vector>
+    #include <exception>
+    #if defined(__cpp_impl_coroutine)
+        #if __cpp_impl_coroutine >= 201902L
+            #define CCPOMELO_COROUTINES 1   //CCPomeloFuture can be co_await'ed
+            #include <coroutine>
+        #endif
+    #endif
 #else
     #define CCX3 0  //cocos2dx 2.x
 #endif
@@ -48,6 +59,9 @@ enum CCPomeloStatus
 
 
 class CCPomeloImpl;
+class _PomeloLoopbackTransport;
+struct _PomeloLoopbackLink;
+struct json_t;  //jansson document
 
 class CCPomeloRequestResult
 {
@@ -55,6 +69,22 @@ public:
     int status;         //status code
     std::string requestRoute;
     std::string jsonMsg;
+    //direct dispatch only: the body as parsed by libpomelo, borrowed until the
+    //callback returns. jsonMsg stays empty then, except for compressed bodies
+    //(docs is NULL, jsonMsg holds the unpacked text). NULL for queued callbacks.
+    //仅direct回调：libpomelo解析出的消息体，回调返回后失效；此时jsonMsg为空（压缩消息除外）
+    json_t* docs;
+    
+    //move jsonMsg into out without copying the buffer, jsonMsg is empty afterwards.
+    //jsonMsg is handed over from the network thread the same way, so a
+    //response is never copied on its way from libpomelo to your storage.
+    //In a direct callback the text is rendered from docs, which is NULL
+    //afterwards: a second call gets an empty string either way. 3.x callbacks
+    //own the result they get (an rvalue, each collapsed request its own), take
+    //it as CCPomeloRequestResult&& to call this.
+    //取走jsonMsg（不拷贝），之后jsonMsg为空；direct回调中由docs生成，之后docs为NULL。
+    //3.x回调的参数为右值，声明为CCPomeloRequestResult&&即可取走。
+    void takeJsonMsg(std::string& out);
     
 private:
     CCPomeloRequestResult();
@@ -77,26 +107,392 @@ class CCPomeloEvent
 public:
     std::string event;
     std::string jsonMsg;
+    json_t* docs;   //see CCPomeloRequestResult::docs
+    
+    //see CCPomeloRequestResult::takeJsonMsg()
+    void takeJsonMsg(std::string& out);
 private:
     CCPomeloEvent();
     friend class CCPomeloImpl;
 };
 
+//events of one name queued by the time the first of them is dispatched, see addBatchListener()
+class CCPomeloEventBatch
+{
+public:
+    std::string event;
+    std::vector<std::string> jsonMsgs;  //in arrival order, may be swapped out
+    
+private:
+    CCPomeloEventBatch();
+    friend class CCPomeloImpl;
+};
+
+class CCPomeloBatchResult
+{
+public:
+    int status;         //0--every request got status 0; -1--timed out; others--the first failure
+    bool timedOut;
+    std::vector<CCPomeloRequestResult> results;     //in batch order, unanswered ones have status -1
+    
+private:
+    CCPomeloBatchResult();
+    friend class CCPomeloImpl;
+};
+
+struct CCPomeloNetStats
+{
+    float rtt;          //smoothed round trip time (SRTT of RFC 6298), seconds
+    float rttVar;       //round trip time variation (RTTVAR)
+    float lastRtt;
+    float minRtt;
+    unsigned int samples;
+    bool clockSynced;   //clockOffset is valid
+    double clockOffset; //server clock - local clock, seconds
+};
+
+//what a rate limiter does with a message over the limit, see setRateLimit()
+enum CCPomeloLimitPolicy
+{
+    EPomeloLimitQueue = 0,      //hold it back until a token is free
+    EPomeloLimitDrop = 1,       //request()/notify() fails with -1
+    EPomeloLimitMergeLatest = 2 //a notify replaces the one of its route still held back
+};
+
+struct CCPomeloRateLimitStats
+{
+    unsigned int passed;    //sent right away
+    unsigned int queued;
+    unsigned int dropped;
+    unsigned int merged;
+    unsigned int pending;   //held back right now
+};
+
+//limits hit by route since the last report
+struct CCPomeloRateLimitHit
+{
+    CCPomeloRateLimitHit() : action(EPomeloLimitQueue), count(0) {}
+    std::string route;
+    CCPomeloLimitPolicy action; //the latest one
+    unsigned int count;
+};
+
+struct CCPomeloCacheStats
+{
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int evictions;     //dropped because of ttl or maxEntries
+    unsigned int entries;       //currently cached
+};
+
+class CCPomeloResponseChunk
+{
+public:
+    int status;
+    std::string requestRoute;
+    std::string data;   //next piece of the compact json text
+    bool last;          //all chunks joined together make up the whole response
+private:
+    CCPomeloResponseChunk();
+    friend class CCPomeloImpl;
+};
+
+/*
+ An in-process pomelo server for CCPomeloWrapper::setLoopbackServer(): no
+ socket, no protocol, but requests, notifies and pushes go through the same
+ threads, queues and callbacks as a real connection. Handy for tests and for
+ measuring dispatch throughput.
+ Subclass it and answer requests. onRequest()/onNotify() are called on the
+ loopback network thread, one at a time, in the order the client sent them.
+ 进程内的模拟服务器：没有socket，但消息经过与真实连接相同的线程、队列和回调。
+ 继承并实现onRequest()，它在模拟的网络线程中按发送顺序逐个调用。
+ */
+class CCPomeloLoopbackServer
+{
+public:
+    CCPomeloLoopbackServer();
+    virtual ~CCPomeloLoopbackServer();
+    
+    //@return: the response body (json text); not valid json fails the request
+    virtual std::string onRequest(const std::string& route, const std::string& msg) = 0;
+    virtual void onNotify(const std::string& route, const std::string& msg);
+    
+    //push an event (json text) to the connected client, from any thread
+    //@return: 0--pushed; others--no client connected or msg is not valid json
+    //向已连接的客户端推送事件，可在任意线程调用
+    int push(const char* event, const std::string& msg);
+    
+    //drop the connection as if the network was lost
+    //模拟断线
+    int disconnect();
+    
+private:
+    CCPomeloLoopbackServer(const CCPomeloLoopbackServer&);
+    CCPomeloLoopbackServer& operator=(const CCPomeloLoopbackServer&);
+    
+    _PomeloLoopbackLink* mLink;
+    friend class _PomeloLoopbackTransport;
+};
+
 #if CCX3
+#include "CCPomeloCallback.h"
+
     typedef std::function<void(int)> PomeloAsyncConnCallback;
-    typedef std::function<void(const CCPomeloRequestResult&)> PomeloReqResultCallback;
+    //results are handed over as rvalues: const& lambdas work, && ones may take from them
+    typedef std::function<void(CCPomeloRequestResult&&)> PomeloReqResultCallback;
     typedef std::function<void(const CCPomeloNotifyResult&)> PomeloNtfResultCallback;
-    typedef std::function<void(const CCPomeloEvent&)> PomeloEventCallback;
+    typedef std::function<void(CCPomeloEvent&&)> PomeloEventCallback;
+    typedef std::function<void(CCPomeloEventBatch&&)> PomeloEventBatchCallback;
+    typedef std::function<void(const CCPomeloResponseChunk&)> PomeloReqChunkCallback;
+    typedef std::function<void(CCPomeloBatchResult&&)> PomeloBatchCallback;
+    typedef std::function<void(const CCPomeloNetStats&)> PomeloNetStatsCallback;
+    typedef std::function<void(const CCPomeloRateLimitHit&)> PomeloRateLimitCallback;
+    typedef CCPomeloCallback<void()> PomeloTask;   //move only, it owns the result
+    typedef std::function<void(PomeloTask&&)> PomeloExecutor;  //runs (or moves away and later runs) the task on a thread of its choice
 #else
     typedef void (cocos2d::CCObject::*PomeloAsyncConnHandler)(int);
     typedef void (cocos2d::CCObject::*PomeloReqResultHandler)(const CCPomeloRequestResult&);
     typedef void (cocos2d::CCObject::*PomeloNtfResultHandler)(const CCPomeloNotifyResult&);
     typedef void (cocos2d::CCObject::*PomeloEventHandler)(const CCPomeloEvent&);
+    typedef void (cocos2d::CCObject::*PomeloEventBatchHandler)(const CCPomeloEventBatch&);
+    typedef void (cocos2d::CCObject::*PomeloReqChunkHandler)(const CCPomeloResponseChunk&);
+    typedef void (cocos2d::CCObject::*PomeloBatchHandler)(const CCPomeloBatchResult&);
+    typedef void (cocos2d::CCObject::*PomeloNetStatsHandler)(const CCPomeloNetStats&);
+    typedef void (cocos2d::CCObject::*PomeloRateLimitHandler)(const CCPomeloRateLimitHit&);
 
     #define pomelo_async_conn_cb_selector(_SEL) (PomeloAsyncConnHandler)(&_SEL)
     #define pomelo_req_result_cb_selector(_SEL) (PomeloReqResultHandler)(&_SEL)
     #define pomelo_ntf_result_cb_selector(_SEL) (PomeloNtfResultHandler)(&_SEL)
     #define pomelo_listener_cb_selector(_SEL) (PomeloEventHandler)(&_SEL)
+    #define pomelo_listener_batch_cb_selector(_SEL) (PomeloEventBatchHandler)(&_SEL)
+    #define pomelo_req_chunk_cb_selector(_SEL) (PomeloReqChunkHandler)(&_SEL)
+    #define pomelo_batch_cb_selector(_SEL) (PomeloBatchHandler)(&_SEL)
+    #define pomelo_net_stats_cb_selector(_SEL) (PomeloNetStatsHandler)(&_SEL)
+    #define pomelo_rate_limit_cb_selector(_SEL) (PomeloRateLimitHandler)(&_SEL)
+#endif
+
+#if CCX3
+template <typename T, typename R> struct _PomeloThen;
+
+/*
+ A value that becomes ready later, e.g. the result of request(route, msg).
+ Continuations run on the thread that resolves it (the cocos thread for
+ requests), so no locking is involved. Handles are cheap to copy and share
+ the same state.
+ 
+ request()的异步结果。then()注册后续操作，返回另一个CCPomeloFuture的后续操作可以串联；
+ CCPomeloWhenAll()等待多个结果。支持C++20时可以直接co_await。
+ 
+    auto gate = pomelo->request("gate.gateHandler.queryEntry", msg);
+    gate.then([=](const CCPomeloRequestResult& r){
+        ...
+        return pomelo->request("connector.entryHandler.entry", entryMsg);
+    }).then([=](const CCPomeloRequestResult& r){
+        ...
+    });
+ */
+template <typename T>
+class CCPomeloFuture
+{
+public:
+    typedef T value_type;
+    
+    CCPomeloFuture() : mState(std::make_shared<State>()) {}
+    
+    bool ready() const { return mState->value != nullptr; }
+    //only valid once ready()
+    const T& get() const { return *mState->value; }
+    
+    //call f(const T&) once ready, right away if it already is.
+    //f returning void: then() returns void;
+    //f returning CCPomeloFuture<U>: then() returns a CCPomeloFuture<U> of that result;
+    //f returning U: then() returns a CCPomeloFuture<U>.
+    template <typename F>
+    auto then(F f) const -> typename _PomeloThen<T, decltype(f(std::declval<const T&>()))>::type
+    {
+        return _PomeloThen<T, decltype(f(std::declval<const T&>()))>::chain(*this, f);
+    }
+    
+    //make it ready and run the continuations. Later calls are ignored.
+    void resolve(T value) const
+    {
+        std::shared_ptr<State> state = mState;  //continuations may drop the last handle
+        if(state->value)
+            return;
+        state->value = std::make_shared<const T>(std::move(value));
+        
+        std::vector<std::function<void(const T&)> > waiters;
+        waiters.swap(state->waiters);
+        for (size_t i = 0; i < waiters.size(); i++)
+        {
+            waiters[i](*state->value);
+        }
+    }
+    
+#if CCPOMELO_COROUTINES
+    bool await_ready() const { return ready(); }
+    void await_suspend(std::coroutine_handle<> handle) const { onReady([handle](const T&){ handle.resume(); }); }
+    const T& await_resume() const { return get(); }
+    
+    //a coroutine may return CCPomeloFuture<T> and co_return a T
+    struct promise_type
+    {
+        CCPomeloFuture future;
+        CCPomeloFuture get_return_object() { return future; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_value(T value) { future.resolve(std::move(value)); }
+        void unhandled_exception() { std::terminate(); }
+    };
+#endif
+    
+private:
+    struct State
+    {
+        std::shared_ptr<const T> value;
+        std::vector<std::function<void(const T&)> > waiters;
+    };
+    
+    void onReady(const std::function<void(const T&)>& f) const
+    {
+        if(ready())
+            f(get());
+        else
+            mState->waiters.push_back(f);
+    }
+    
+    std::shared_ptr<State> mState;
+    template <typename, typename> friend struct _PomeloThen;
+};
+
+//f returns a plain value
+template <typename T, typename R>
+struct _PomeloThen
+{
+    typedef CCPomeloFuture<R> type;
+    template <typename F>
+    static type chain(const CCPomeloFuture<T>& in, F f)
+    {
+        type out;
+        in.onReady([out, f](const T& value){ out.resolve(f(value)); });
+        return out;
+    }
+};
+//f returns nothing
+template <typename T>
+struct _PomeloThen<T, void>
+{
+    typedef void type;
+    template <typename F>
+    static void chain(const CCPomeloFuture<T>& in, F f)
+    {
+        in.onReady(f);
+    }
+};
+//f returns another future: flatten
+template <typename T, typename U>
+struct _PomeloThen<T, CCPomeloFuture<U> >
+{
+    typedef CCPomeloFuture<U> type;
+    template <typename F>
+    static type chain(const CCPomeloFuture<T>& in, F f)
+    {
+        type out;
+        in.onReady([out, f](const T& value){
+            f(value).onReady([out](const U& next){ out.resolve(next); });
+        });
+        return out;
+    }
+};
+
+//ready when all of futures are, with their values in the same order
+//全部就绪后就绪，结果顺序与futures一致
+template <typename T>
+CCPomeloFuture<std::vector<T> > CCPomeloWhenAll(const std::vector<CCPomeloFuture<T> >& futures)
+{
+    CCPomeloFuture<std::vector<T> > out;
+    std::shared_ptr<size_t> pending = std::make_shared<size_t>(futures.size() + 1);
+    std::function<void()> arrive = [out, futures, pending]{
+        if(--*pending > 0)
+            return;
+        std::vector<T> values;
+        values.reserve(futures.size());
+        for (size_t i = 0; i < futures.size(); i++)
+        {
+            values.push_back(futures[i].get());
+        }
+        out.resolve(std::move(values));
+    };
+    for (size_t i = 0; i < futures.size(); i++)
+    {
+        futures[i].then([arrive](const T&){ arrive(); });
+    }
+    arrive();   //the extra count keeps an all ready input from resolving early
+    return out;
+}
+
+/*
+ Typed routes: declare a route once as a tag bound to its payload types,
+ then use the tag instead of the route string. A misspelled tag does not
+ compile, nor does a notify route passed to request<>() or a payload of the
+ wrong type.
+ 类型化route：route只声明一次并绑定消息类型，之后使用标签代替字符串。拼错标签、误用route类型
+ 或消息类型不符都会在编译期报错。
+ 
+    CCPOMELO_REQUEST_ROUTE(QueryEntry, "gate.gateHandler.queryEntry", QueryEntryMsg, QueryEntryResult);
+    CCPOMELO_EVENT_ROUTE(OnChat, "onChat", ChatMsg);
+    
+    pomelo->request<QueryEntry>(msg, [](int status, const QueryEntryResult& result){ ... });
+    pomelo->addListener<OnChat>([](const ChatMsg& chat){ ... });
+ 
+ Payload types are converted by CCPomeloCodec, which has to be specialized
+ for each of them; std::string passes the json text through.
+ Listeners are kept by route hash, a tag brings its own from compile time.
+ */
+
+//FNV-1a of route, the key of the event listeners. The tags' is computed at
+//compile time, a pushed event's once on the network thread.
+constexpr unsigned int CCPomeloRouteHash(const char* route, unsigned int hash = 2166136261u)
+{
+    return *route ? CCPomeloRouteHash(route + 1, (hash ^ (unsigned char)*route) * 16777619u) : hash;
+}
+
+enum CCPomeloRouteKind
+{
+    EPomeloRequestRoute,
+    EPomeloNotifyRoute,
+    EPomeloEventRoute
+};
+
+#define CCPOMELO_ROUTE_TAG_(_TAG, _KIND, _ROUTE, _MSG, _RESULT) \
+    struct _TAG \
+    { \
+        typedef _MSG message_type; \
+        typedef _RESULT result_type; \
+        static constexpr CCPomeloRouteKind kind = _KIND; \
+        static constexpr unsigned int hash = CCPomeloRouteHash(_ROUTE); \
+        static const char* name() { return _ROUTE; } \
+    }
+#define CCPOMELO_REQUEST_ROUTE(_TAG, _ROUTE, _MSG, _RESULT) CCPOMELO_ROUTE_TAG_(_TAG, EPomeloRequestRoute, _ROUTE, _MSG, _RESULT)
+#define CCPOMELO_NOTIFY_ROUTE(_TAG, _ROUTE, _MSG) CCPOMELO_ROUTE_TAG_(_TAG, EPomeloNotifyRoute, _ROUTE, _MSG, void)
+#define CCPOMELO_EVENT_ROUTE(_TAG, _ROUTE, _MSG) CCPOMELO_ROUTE_TAG_(_TAG, EPomeloEventRoute, _ROUTE, _MSG, void)
+
+template <typename T> struct _PomeloAlwaysFalse { enum { value = 0 }; };
+
+//json text <=> T for the typed routes, specialize it for your payload types:
+//  static std::string encode(const T& value);
+//  static bool decode(const std::string& json, T& value);  //false: malformed
+template <typename T>
+struct CCPomeloCodec
+{
+    static_assert(_PomeloAlwaysFalse<T>::value, "specialize CCPomeloCodec for this payload type");
+};
+template <>
+struct CCPomeloCodec<std::string>
+{
+    static std::string encode(const std::string& value) { return value; }
+    static bool decode(const std::string& json, std::string& value) { value = json; return true; }
+};
 #endif
 
 class CCPomeloWrapper : 
@@ -122,12 +518,171 @@ public: //client APIs
     
 #if CCX3
     int connectAsnyc(const char* host, int port, const PomeloAsyncConnCallback& callback);
+    
+    //connectAsnyc() as a future of the connect status, see request(route, msg)
+    //返回CCPomeloFuture的异步连接，结果为连接状态
+    CCPomeloFuture<int> connectAsnyc(const char* host, int port);
 #else
     //@return: 0--connect request succeeded; others--connect request failed
     //异步连接服务器
     int connectAsnyc(const char* host, int port, cocos2d::CCObject* pCallbackTarget, PomeloAsyncConnHandler pCallbackSelector);
 #endif
     
+    //route dictionary & protobuf are negotiated by libpomelo during handshake
+    //when the server enables useDict/useProtobuf. Set a cache file so that the
+    //protos fetched in handshake are saved and only re-sent when the server's
+    //protos version changes. Takes effect on the next connect.
+    //设置protobuf协议缓存文件。服务端开启useDict/useProtobuf后，libpomelo在握手时协商路由字典和protos，
+    //route以短整型编码发送，消息体以protobuf编码。缓存后只有在服务端protos版本变化时才会重新下发。
+    void setProtoCache(const char* path, const char* file);
+    
+    //connect to server instead of a real one from the next connect() or
+    //connectAsnyc() on (host and port are ignored then), NULL to go back to
+    //libpomelo's tcp client. server is not retained: set NULL before deleting
+    //it. A connection outliving its server fails requests and notifies.
+    //之后的连接使用进程内的模拟服务器（忽略host和port），NULL表示恢复使用libpomelo的tcp连接。
+    void setLoopbackServer(CCPomeloLoopbackServer* server);
+    
+#if CCX3
+    //connect through a websocket to ws://host:port/path (wss:// if secure)
+    //from the next connectAsnyc() on, for servers behind a web gateway.
+    //NULL to go back to libpomelo's tcp client. Same protocol, json bodies
+    //only: routes the server encodes with protobuf are not supported and
+    //setProtoCache() does not apply. The blocking connect() fails.
+    //A loopback server, if set, takes precedence.
+    //之后的连接通过websocket（ws://host:port/path）进行，NULL表示恢复使用tcp。
+    //仅支持json消息体（不支持protobuf），只能使用connectAsnyc()。
+    void setWebSocket(const char* path, bool secure = false);
+#endif
+    
+    //compress request/notify bodies of route that are at least threshold
+    //bytes of json text (zlib + base64, see CCPomeloWrapper.cpp for the
+    //envelope format). threshold < 0 turns it off again.
+    //Compressed responses & pushes are always unpacked on libpomelo thread.
+    //对指定route中不小于threshold字节的消息体进行压缩。threshold < 0 表示关闭。
+    //收到的压缩消息总是在网络线程中自动解压。
+    void setCompression(const char* route, int threshold);
+    
+    //cache successful responses of an idempotent route (e.g. gate.gateHandler.queryEntry)
+    //for ttl seconds, at most maxEntries different messages, the oldest ones
+    //are evicted first. Messages are compared with sorted keys. A hit is
+    //delivered by the dispatcher on the next frame without touching the
+    //network. ttl <= 0 or maxEntries <= 0 turns it off and drops the entries.
+    //The cache is kept over stop()/connect.
+    //为幂等的route开启响应缓存：成功的响应缓存ttl秒，最多maxEntries条。命中时不发送请求，
+    //在下一帧通过正常的回调流程返回。ttl <= 0 或 maxEntries <= 0 表示关闭。
+    void setCachePolicy(const char* route, float ttl, int maxEntries);
+    CCPomeloCacheStats cacheStats() const;
+    void clearCache();
+    
+    //collapse identical requests (same route, same message with sorted keys):
+    //a request issued while an identical one is still waiting for its
+    //response is not sent again, it gets a copy of that response instead.
+    //Direct and streamed requests are never collapsed.
+    //合并相同的request：若相同route和消息的request尚未返回，则不再重复发送，而是共享其响应。
+    void setRequestCollapsing(bool enabled);
+    
+    //keep request()/notify() calls made while stopped or connecting in a
+    //memory mapped ring file of capacity bytes, and send them in order as soon
+    //as the next connection is up. The file survives app restarts; messages
+    //left from an earlier run are sent without a callback. Callbacks of
+    //stashed messages fire after the reconnect. request()/notify() return -1
+    //when the file is full. Not available on win32.
+    //@return: 0--outbox opened; others--failed
+    //开启离线发件箱：断开或连接中调用的request()/notify()会被写入内存映射文件，
+    //连接建立后按顺序发出。文件在应用重启后依然有效。文件写满时request()/notify()返回-1。
+    int enableOutbox(const char* path, size_t capacity);
+    void disableOutbox();
+    
+    //record the session into a compact binary log: outgoing requests &
+    //notifies, responses, notify acks and pushed events, with timestamps
+    //@return: 0--recording; others--can not open path
+    //录制会话：将发出的request/notify、响应、notify回执和推送事件连同时间戳写入二进制日志。
+    int startRecording(const char* path);
+    void stopRecording();
+    
+    //feed a recorded log back through the dispatcher without any server.
+    //Pushed events go to the listeners, recorded responses go to requests
+    //of the same route made during the replay, in order; notifies are acked
+    //at once and nothing is sent. speed: 1 for the recorded pace, 2 for twice
+    //as fast, 0 for as fast as the dispatcher goes. Only while stopped,
+    //connect()/stop() end the replay; requests left unanswered at the end
+    //are dropped without callback. Streamed requests are not replayed.
+    //@return: 0--replay started; others--failed
+    //回放录制的日志（无需服务器）：推送事件交给订阅者，响应按顺序交给回放期间发出的同route的request，
+    //notify立即回执。speed为1表示原速，0表示尽可能快。仅在断开状态下可用，connect()/stop()会结束回放。
+    int replay(const char* path, float speed);
+    bool isReplaying() const;
+    
+    //responses & pushes are converted to json text on libpomelo thread, outside
+    //of any lock. Bodies whose text would be at least threshold bytes (and
+    //compressed ones) can be left to count decode threads instead, so a big
+    //message never holds up the network. Callbacks still fire in arrival order.
+    //count 0 turns the workers off (default). Only while stopped.
+    //@return: 0--succeeded; others--failed
+    //设置解码线程：json文本不小于threshold字节（或经过压缩）的响应/推送交给count个解码线程转换，
+    //网络线程不会被大消息阻塞，回调顺序不变。count为0表示关闭（默认）。仅在断开状态下可用。
+    int setDecodeWorkers(int count, int threshold);
+    
+    //pushes of event may be patches: {"__delta":<JSON Merge Patch, RFC 7386>}
+    //is applied on libpomelo thread to the last document received, anything
+    //else replaces it. keyField names the member telling documents apart
+    //(e.g. "id", also present in the patches), NULL for one document per
+    //event. Listeners get the rebuilt document, or with deliverFullDocument
+    //false just the patch (changed fields). Documents are dropped on stop().
+    //The event is registered with the client like registerEventRoutes() does,
+    //so documents keep up while no listener is attached.
+    //增量推送：{"__delta":<JSON Merge Patch>}在网络线程中合并到上一次的完整文档，其他推送直接替换文档。
+    //keyField用于区分不同对象（如"id"），NULL表示该事件只有一个文档。
+    //deliverFullDocument为false时，回调只收到变化的字段。没有监听者时文档同样会更新。
+    void setDeltaEvent(const char* event, const char* keyField, bool deliverFullDocument = true);
+    void removeDeltaEvent(const char* event);
+    
+    //round trip time is sampled from every request/response pair (libpomelo
+    //keeps heartbeats to itself) and smoothed as in RFC 6298. Responses
+    //carrying a top-level timeKey field (server time in milliseconds since
+    //epoch) also give an NTP style clock offset; the sample with the lowest
+    //round trip of the last few wins. With a route and interval > 0 an empty
+    //request is sent to route every interval seconds to keep both fresh.
+    //timeKey NULL turns clock sync off. Only while stopped.
+    //@return: 0--succeeded; others--failed
+    //往返时延从每个request的往返中采样并按RFC 6298平滑。带有timeKey字段（服务器毫秒时间戳）的响应
+    //同时用于估算时钟偏差。指定route且interval > 0时，每interval秒向route发送一个空request。
+    int setClockSync(const char* timeKey, const char* route, float interval);
+    CCPomeloNetStats netStats() const;
+    //local time corrected by clockOffset, seconds since epoch
+    //按时钟偏差校正后的服务器时间（秒）
+    double serverTime() const;
+    
+#if CCX3
+    void setNetStatsCallback(const PomeloNetStatsCallback& callback);
+#else
+    //called on cocos thread with the latest netStats(), at most once a second
+    //and only when new samples came in
+    //连接质量回调：有新采样时最多每秒回调一次
+    void setNetStatsCallback(cocos2d::CCObject* pTarget, PomeloNetStatsHandler pSelector);
+#endif
+    
+    //token bucket limiter on outgoing requests & notifies of route: rate
+    //messages a second, bursts of up to burst. route NULL sets the global one
+    //every message also has to pass; rate <= 0 removes it. A message over the
+    //limit is queued (sent by the dispatcher once tokens are back, order kept
+    //within the route), dropped, or merged into the notify of its route still
+    //queued (the latest body is sent, all callbacks get its ack; requests are
+    //queued instead). Queued messages are called back with -1 on stop().
+    //出站令牌桶限流：route每秒rate条，突发最多burst条；route为NULL时设置全局限流，rate <= 0表示移除。
+    //超出时按policy排队（令牌恢复后按顺序发送）、丢弃或合并（同route尚在排队的notify只发送最新的一条）。
+    void setRateLimit(const char* route, float rate, int burst, CCPomeloLimitPolicy policy = EPomeloLimitQueue);
+    CCPomeloRateLimitStats rateLimitStats() const;
+    
+#if CCX3
+    void setRateLimitCallback(const PomeloRateLimitCallback& callback);
+#else
+    //called on cocos thread, once a frame for each route that hit its limit
+    //触发限流时在cocos线程中回调，每个route每帧最多一次
+    void setRateLimitCallback(cocos2d::CCObject* pTarget, PomeloRateLimitHandler pSelector);
+#endif
+    
     //stop the current connection
     //断开当前连接
     void stop();
@@ -140,17 +695,113 @@ public: //client APIs
     int setDisconnectedCallback(cocos2d::CCObject* pTarget, cocos2d::SEL_CallFunc pSelector);
 #endif
     
+    /*
+     direct dispatch (request/addListener的最后一个参数):
+     默认情况下所有回调都通过队列在cocos主线程的下一帧触发。设置为true后，回调会在libpomelo的
+     网络线程中直接触发，省去排队、内存分配以及字符串拷贝，没有一帧的延迟。
+     消息体以json_t（docs成员）借给回调，不转换为文本，需要文本时调用takeJsonMsg()。
+     在这种回调中：
+       1.不能访问任何cocos对象；
+       2.只能调用下面列出的可在任意线程调用的接口；
+       3.应尽快返回，否则会阻塞网络线程接收后续数据。
+     stop()时尚未完成的direct request仍在主线程中被同步回调，与普通request一致。
+     
+     With dispatchOnNetworkThread == true the callback is invoked directly on
+     the libpomelo network thread, skipping the queue and the frame delay. The
+     body is lent as parsed (the docs member) instead of being rendered to
+     text; takeJsonMsg() renders it on demand. Inside such a callback you must
+     NOT touch any cocos object, may only call the apis listed below as safe
+     from any thread, and should return as quickly as possible.
+     Pending direct requests are still called back synchronously on the main
+     thread by stop(), just like the queued ones.
+     
+     thread safety:
+     request()/notify()/addListener()/removeListener()可以在任意线程中调用。已连接时，非cocos主线程的
+     request/notify直接交给libpomelo的发送队列，不经过响应缓存和请求合并；未连接或正在连接/断开时进入提交队列，
+     由cocos主线程发送或存入离线发件箱，此时失败通过回调（status为-1）通知。2.x在断开状态下提交队列等到下次连接才处理。
+     request结果在cocos主线程触发（dispatchOnNetworkThread为true时在网络线程触发，requestOn()交给指定的executor）；
+     notify回执总是在cocos主线程触发。其它接口只能在cocos主线程调用。
+     
+     request(), notify(), addListener() and removeListener() may be called
+     from any thread. Off the cocos thread, while connected, requests and
+     notifies go straight to libpomelo's send queue, bypassing the response
+     cache and request collapsing. Otherwise (not connected, connect() or
+     stop() under way) they are queued and 0 is returned: the cocos thread
+     sends them or stashes them into the outbox as if called there, and a
+     refusal then reaches the callback with status -1. On 2.x the queue waits
+     for the next connect() while stopped.
+     Request results are delivered on the cocos thread, on the network thread
+     with dispatchOnNetworkThread, or on an executor of your choice with
+     requestOn() (3.x). Notify acks always come on the cocos thread.
+     Every other api is cocos thread only, and getInstance() must first be
+     called there.
+     */
+    
 #if CCX3
-    int request(const char* route, const std::string& msg, const PomeloReqResultCallback& callback);
+    int request(const char* route, const std::string& msg, PomeloReqResultCallback callback, bool dispatchOnNetworkThread = false);
 #else
     //send request to server
     //@return: 0--request sent succeeded; others--request sent failed
     //发送request
-    int request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector);
+    int request(const char* route, const std::string& msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool dispatchOnNetworkThread = false);
 #endif
     
 #if CCX3
-    int notify(const char* route, const std::string& msg, const PomeloNtfResultCallback& callback);
+    //request() as a future: issue independent requests together and chain
+    //dependent ones with then(), or co_await it in a C++20 coroutine.
+    //Resolved on the cocos thread; if the request can not be sent, it is
+    //resolved at once with a non-zero status.
+    //返回CCPomeloFuture的request：无依赖的请求可以同时发出，再用then()/CCPomeloWhenAll()/co_await组织流程。
+    CCPomeloFuture<CCPomeloRequestResult> request(const char* route, const std::string& msg);
+    CCPomeloFuture<CCPomeloRequestResult> request(const char* route, json_t* msg);
+#endif
+    
+#if CCX3
+    int request(const char* route, json_t* msg, PomeloReqResultCallback callback, bool dispatchOnNetworkThread = false);
+#else
+    //send a jansson document as is, skipping the text parsing.
+    //With protobuf enabled, typed values (integers, reals...) map directly to
+    //the proto fields. Ownership of msg is transferred, even on failure.
+    //直接发送jansson对象，省去json文本解析。msg的所有权转移给CCPomeloWrapper（失败时也会被释放）。
+    int request(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloReqResultHandler pCallbackSelector, bool dispatchOnNetworkThread = false);
+#endif
+    
+#if CCX3
+    //like request(), from any thread, with the result handed to executor
+    //(e.g. a job queue of your worker thread) right from the network thread.
+    //The task owns the result and callback; it is move only, queue it with std::move().
+    //从任意线程发送request，结果从网络线程直接交给executor执行回调
+    int requestOn(PomeloExecutor executor, const char* route, const std::string& msg, PomeloReqResultCallback callback);
+#endif
+    
+#if CCX3
+    int requestStreamed(const char* route, const std::string& msg, size_t window, PomeloReqChunkCallback callback);
+#else
+    //send request and receive a (very large) response in chunks of at most
+    //window bytes, one chunk per frame. The response is rendered from the
+    //json tree one top level member at a time, so besides the tree itself only
+    //about one window of text is ever held in memory and no frame has to
+    //serialize the whole response.
+    //The callback is called at least once, chunk.last is true on the final one.
+    //A response cut short by stop() ends with a last chunk of status -1 and no data.
+    //发送request，并按每帧一块、每块不超过window字节的方式分块接收响应，适用于超大的响应。
+    int requestStreamed(const char* route, const std::string& msg, size_t window, cocos2d::CCObject* pCallbackTarget, PomeloReqChunkHandler pCallbackSelector);
+#endif
+    
+#if CCX3
+    int requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, PomeloBatchCallback callback);
+#else
+    //send several independent requests (route, msg) at once and get a single
+    //callback with all of their results, as soon as the last one lands or
+    //after timeout seconds (timeout <= 0: no timeout) with whatever has landed.
+    //Results skip the per-request queue. Cocos thread only.
+    //@return: 0--batch started; others--failed
+    //批量发送多个相互独立的request，全部返回（或超时）后只回调一次，结果顺序与requests一致。
+    int requestBatch(const std::vector<std::pair<std::string,std::string> >& requests, float timeout, cocos2d::CCObject* pCallbackTarget, PomeloBatchHandler pCallbackSelector);
+#endif
+    
+#if CCX3
+    int notify(const char* route, const std::string& msg, PomeloNtfResultCallback callback);
 #else
     //send notify to server
     //@return: 0--notify sent succeeded; others--notify sent failed
@@ -161,27 +812,131 @@ public: //client APIs
 #endif
     
 #if CCX3
-    int addListener(const char* event, const PomeloEventCallback& callback);
+    int notify(const char* route, json_t* msg, PomeloNtfResultCallback callback);
+#else
+    //see request(const char*, json_t*, ...)
+    int notify(const char* route, json_t* msg, cocos2d::CCObject* pCallbackTarget, PomeloNtfResultHandler pCallbackSelector);
+#endif
+    
+#if CCX3
+    int addListener(const char* event, PomeloEventCallback callback, bool dispatchOnNetworkThread = false);
 #else
     //listen to event
     //only one listener allowed for one event currently
     //@return: 0--add listener succeeded; others--add listener failed
     //订阅事件。对于同一种事件，目前只支持一个观察者。也就是说对同一事件多次订阅，前一个订阅者自动被移除。
-    int addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector);
+    int addListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool dispatchOnNetworkThread = false);
 #endif
     
     //remove listener for specific event
     //移除事件订阅
     void removeListener(const char* event);
     
-    //remove all listeners for all events
-    //移除所有事件订阅
+#if CCX3
+    int addBatchListener(const char* event, PomeloEventBatchCallback callback);
+#else
+    //listen to event in batches: once one is due, every event of that name
+    //already queued comes along in one call, bodies in arrival order. Other
+    //events keep their order. Replaces the listener of event like
+    //addListener(), removed with removeListener().
+    //批量订阅事件：派发时把队列中同名的事件一次性交给回调。
+    int addBatchListener(const char* event, cocos2d::CCObject* pCallbackTarget, PomeloEventBatchHandler pCallbackSelector);
+#endif
+    
+#if CCX3
+    int addPatternListener(const char* pattern, PomeloEventCallback callback, bool dispatchOnNetworkThread = false);
+#else
+    //listen to every event matching pattern: '*' matches any run of
+    //characters, '?' exactly one, e.g. "onRoom.*" or "battle.*.hit".
+    //An exact listener wins over patterns, a more specific pattern over a
+    //looser one. Patterns are kept in a trie, so events no pattern matches
+    //cost a few character compares. Cocos thread only; survive stop().
+    //按模式订阅事件（'*'匹配任意字符串，'?'匹配单个字符）。精确订阅优先于模式订阅。
+    //@return: 0--succeeded; others--invalid pattern
+    int addPatternListener(const char* pattern, cocos2d::CCObject* pCallbackTarget, PomeloEventHandler pCallbackSelector, bool dispatchOnNetworkThread = false);
+#endif
+    
+    //remove the listener added with exactly this pattern
+    //移除模式订阅
+    void removePatternListener(const char* pattern);
+    
+    //libpomelo only delivers events registered by name, so tell it which
+    //events the server may push for the patterns. Registered once for all
+    //patterns, whatever the number of listeners. Like addListener(), call it
+    //again after every connect.
+    //libpomelo只投递按名字注册过的事件，模式订阅需要先声明服务器可能推送的事件名。每次连接后都需要重新声明。
+    //@return: 0--succeeded; others--not connected or registering failed
+    int registerEventRoutes(const std::vector<std::string>& events);
+    
+    //remove all listeners for all events, patterns included
+    //移除所有事件订阅（包括模式订阅）
     void removeAllListeners();
     
+#if CCX3
+    //typed routes, see CCPOMELO_REQUEST_ROUTE. status is -1 if the response
+    //can not be decoded, result is default constructed unless status is 0.
+    //类型化的request/notify/addListener，见CCPOMELO_REQUEST_ROUTE
+    template <typename Route>
+    int request(const typename Route::message_type& msg, const std::function<void(int, const typename Route::result_type&)>& callback, bool dispatchOnNetworkThread = false)
+    {
+        static_assert(Route::kind == EPomeloRequestRoute, "not a request route");
+        typedef typename Route::result_type Result;
+        return request(Route::name(), CCPomeloCodec<typename Route::message_type>::encode(msg), [callback](CCPomeloRequestResult&& response){
+            Result result;
+            int status = response.status;
+            std::string text;
+            response.takeJsonMsg(text);
+            if(status == 0 && !CCPomeloCodec<Result>::decode(text, result))
+                status = -1;
+            callback(status, result);
+        }, dispatchOnNetworkThread);
+    }
+    template <typename Route>
+    int notify(const typename Route::message_type& msg, const std::function<void(int)>& callback = nullptr)
+    {
+        static_assert(Route::kind == EPomeloNotifyRoute, "not a notify route");
+        return notify(Route::name(), CCPomeloCodec<typename Route::message_type>::encode(msg), [callback](const CCPomeloNotifyResult& result){
+            if(callback)
+                callback(result.status);
+        });
+    }
+    //events that can not be decoded are dropped
+    template <typename Route>
+    int addListener(const std::function<void(const typename Route::message_type&)>& callback, bool dispatchOnNetworkThread = false)
+    {
+        static_assert(Route::kind == EPomeloEventRoute, "not an event route");
+        typedef typename Route::message_type Payload;
+        return addListener(Route::name(), Route::hash, [callback](CCPomeloEvent&& event){
+            Payload payload;
+            std::string text;
+            event.takeJsonMsg(text);
+            if(CCPomeloCodec<Payload>::decode(text, payload))
+                callback(payload);
+        }, dispatchOnNetworkThread);
+    }
+    template <typename Route>
+    void removeListener()
+    {
+        static_assert(Route::kind == EPomeloEventRoute, "not an event route");
+        removeListener(Route::name(), Route::hash);
+    }
+#endif
+    
+    //number of pushed events nobody listened to. They are dropped on the
+    //network thread before being converted or queued.
+    //无人订阅而被丢弃的推送事件数（在网络线程中直接丢弃，不做任何转换和排队）
+    long droppedEvents() const;
+    
     
 private:
     CCPomeloWrapper();
     
+#if CCX3
+    //the typed routes', hash is CCPomeloRouteHash(event)
+    int addListener(const char* event, unsigned int hash, PomeloEventCallback callback, bool dispatchOnNetworkThread);
+    void removeListener(const char* event, unsigned int hash);
+#endif
+    
 private:
     CCPomeloImpl*   _theMagic;
     friend class CCPomeloImpl;
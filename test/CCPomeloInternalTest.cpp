@@ -0,0 +1,461 @@
+//
+//  CCPomeloInternalTest.cpp
+//
+//  Tests of the cocos2d-x free parts of CCPomeloWrapper: the compressed body
+//  envelope, the outbox ring, pattern listeners, delta merge patches, the
+//  pomelo protocol codec and CCPomeloCallback.
+//  CCPomeloWrapper中不依赖cocos2d-x部分的测试。
+
+#include "CCPomeloInternal.h"
+#include "CCPomeloCallback.h"
+#include <memory>
+#include <stdlib.h>
+
+static int gFailures = 0;
+
+#define CHECK(_COND) \
+    do { \
+        if(!(_COND)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #_COND); \
+            gFailures++; \
+        } \
+    } while(0)
+
+static json_t* parse(const char* text)
+{
+    json_error_t err;
+    return json_loads(text, JSON_DECODE_ANY, &err);
+}
+static std::string dump(json_t* json)
+{
+    std::string out;
+    dumpJson(json, out, true);
+    return out;
+}
+
+//==================== body compression ====================
+static void testBase64()
+{
+    std::string raw, b64, back;
+    for (int len = 0; len < 64; len++)
+    {
+        raw.push_back((char)(len * 37 + 11));
+        base64Encode((const unsigned char*)raw.data(), raw.size(), b64);
+        CHECK(b64.size() == (raw.size() + 2) / 3 * 4);
+        CHECK(base64Decode(b64.data(), b64.size(), back));
+        CHECK(back == raw);
+    }
+    base64Encode((const unsigned char*)"foobar", 6, b64);
+    CHECK(b64 == "Zm9vYmFy");
+    base64Encode((const unsigned char*)"fo", 2, b64);
+    CHECK(b64 == "Zm8=");
+    CHECK(!base64Decode("Zm9v!", 5, back));
+}
+static void testEnvelope()
+{
+    std::string raw = "{\"list\":[";
+    for (int i = 0; i < 500; i++)
+        raw += "{\"id\":1,\"name\":\"player\"},";
+    raw += "{}]}";
+
+    json_t* envelope = zipBody(raw.data(), raw.size());
+    CHECK(envelope != NULL);
+    std::string out;
+    CHECK(unzipBody(envelope, out));
+    CHECK(out == raw);
+
+    //the envelope as it arrives from the wire
+    json_t* received = parse(dump(envelope).c_str());
+    CHECK(unzipBody(received, out) && out == raw);
+    dumpBody(received, out);
+    CHECK(out == raw);
+    json_decref(received);
+
+    //sizes from the wire are checked before allocating
+    json_object_set_new(envelope, POMELO_ZIP_LEN_KEY, json_integer(-1));
+    CHECK(!unzipBody(envelope, out));
+    json_object_set_new(envelope, POMELO_ZIP_LEN_KEY, json_integer(kMaxUnzippedSize + 1));
+    CHECK(!unzipBody(envelope, out));
+    json_object_set_new(envelope, POMELO_ZIP_LEN_KEY, json_integer(10));
+    CHECK(!unzipBody(envelope, out));
+    CHECK(out.empty());
+    json_object_set_new(envelope, POMELO_ZIP_KEY, json_string("not base64!"));
+    CHECK(!unzipBody(envelope, out));
+    json_decref(envelope);
+
+    //not worth it
+    CHECK(zipBody("{\"a\":1}", 7) == NULL);
+
+    json_t* plain = parse("{\"__zip\":\"x\",\"other\":1}");
+    CHECK(!unzipBody(plain, out));
+    dumpBody(plain, out);
+    CHECK(out == "{\"__zip\":\"x\",\"other\":1}");
+    json_decref(plain);
+}
+static void testEstimateSize()
+{
+    const char* texts[] = {
+        "{}", "[]", "{\"a\":1}", "[true,false,null]", "[-1234567,0,42]",
+        "{\"list\":[{\"id\":1,\"name\":\"player\"},{\"id\":22,\"pos\":[1.5,-2.25]}]}",
+    };
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+    {
+        json_t* json = parse(texts[i]);
+        size_t real = dump(json).size();
+        size_t estimate = estimateJsonSize(json, (size_t)-1);
+        CHECK(estimate + 4 >= real && estimate <= real * 2 + 4);
+        json_decref(json);
+    }
+
+    //a big body is not walked to the end
+    json_t* list = json_array();
+    for (int i = 0; i < 100000; i++)
+        json_array_append_new(list, json_string("player"));
+    size_t estimate = estimateJsonSize(list, 1024);
+    CHECK(estimate >= 1024 && estimate < 1100);
+    CHECK(estimateJsonSize(list, (size_t)-1) > 100000 * 8);
+    json_decref(list);
+}
+
+//==================== delta events ====================
+static void testMergePatch()
+{
+    //RFC 7386 appendix A, a few of them
+    const char* cases[][3] = {
+        {"{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}"},
+        {"{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}"},
+        {"{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}"},
+        {"[1,2]", "{\"a\":\"b\"}", "{\"a\":\"b\"}"},
+        {"{\"a\":\"foo\"}", "null", "null"},
+        {"{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}"},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        json_t* target = parse(cases[i][0]);
+        json_t* patch = parse(cases[i][1]);
+        json_t* expected = parse(cases[i][2]);
+        json_t* result = mergePatch(target, patch);
+        CHECK(json_equal(result, expected));
+
+        //target is left alone
+        json_t* original = parse(cases[i][0]);
+        CHECK(json_equal(target, original));
+
+        json_decref(original);
+        json_decref(result);
+        json_decref(expected);
+        json_decref(patch);
+        json_decref(target);
+    }
+}
+static void testDeltaKey()
+{
+    json_t* s = json_string("hero");
+    json_t* n = json_integer(42);
+    json_t* o = parse("{\"x\":1}");
+    CHECK(deltaKey(s) == "hero");
+    CHECK(deltaKey(n) == "42");
+    CHECK(deltaKey(o) == "{\"x\":1}");
+    CHECK(deltaKey(NULL).empty());
+    json_decref(o);
+    json_decref(n);
+    json_decref(s);
+}
+
+//==================== outbox ====================
+static void testOutbox()
+{
+#if POMELO_OUTBOX_SUPPORTED
+    char path[] = "/tmp/ccpomelo_outbox_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    ::close(fd);
+
+    const size_t capacity = 256;
+    _PomeloOutbox outbox;
+    CHECK(outbox.open(path, capacity));
+
+    char kind;
+    std::string route, msg;
+    unsigned int seq, pushed;
+    CHECK(!outbox.front(kind, route, msg, seq));
+
+    //many times around the ring, records split at its end
+    unsigned int expected = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        std::string body(i % 50, (char)('a' + i % 26));
+        CHECK(outbox.push(i % 2 ? kOutboxNotify : kOutboxRequest, "area.playerHandler.move", body, pushed));
+        CHECK(outbox.front(kind, route, msg, seq));
+        CHECK(kind == (i % 2 ? kOutboxNotify : kOutboxRequest));
+        CHECK(route == "area.playerHandler.move");
+        CHECK(msg == body);
+        CHECK(seq == expected && pushed == expected);
+        expected++;
+        outbox.pop();
+    }
+
+    //full
+    int count = 0;
+    while (outbox.push(kOutboxRequest, "r", std::string(20, 'x'), pushed))
+        count++;
+    CHECK(count == (int)(capacity / (4 + 7 + 1 + 20)));
+
+    //survives reopening
+    outbox.close();
+    CHECK(outbox.open(path, capacity));
+    int left = 0;
+    while (outbox.front(kind, route, msg, seq))
+    {
+        CHECK(route == "r" && msg == std::string(20, 'x'));
+        outbox.pop();
+        left++;
+    }
+    CHECK(left == count);
+
+    //a torn size field drops everything instead of reading past the tail
+    CHECK(outbox.push(kOutboxRequest, "r", "{}", pushed));
+    outbox.close();
+    FILE* file = fopen(path, "r+b");
+    CHECK(file != NULL);
+    if(file)
+    {
+        std::vector<char> bytes(4096);
+        size_t n = fread(&bytes[0], 1, bytes.size(), file);
+        unsigned int garbage = 0x7fffffff;
+        for (size_t i = n - capacity; i + 4 <= n; i += 4)
+            memcpy(&bytes[i], &garbage, 4);
+        fseek(file, 0, SEEK_SET);
+        fwrite(&bytes[0], 1, n, file);
+        fclose(file);
+    }
+    CHECK(outbox.open(path, capacity));
+    CHECK(!outbox.front(kind, route, msg, seq));
+    CHECK(!outbox.front(kind, route, msg, seq));
+    outbox.close();
+    unlink(path);
+#endif
+}
+
+//==================== pattern listeners ====================
+struct TestUser
+{
+    explicit TestUser(int i) : id(i) { alive++; }
+    ~TestUser() { alive--; }
+    int id;
+    static int alive;
+};
+int TestUser::alive = 0;
+
+static int matchId(const _PomeloRouteTrie<TestUser>& trie, const char* event)
+{
+    TestUser* user = trie.match(event);
+    return user ? user->id : 0;
+}
+static void testRouteTrie()
+{
+    {
+        _PomeloRouteTrie<TestUser> trie;
+        CHECK(trie.empty());
+        CHECK(trie.insert("onChat", new TestUser(1)) == NULL);
+        CHECK(trie.insert("on*", new TestUser(2)) == NULL);
+        CHECK(trie.insert("on?hat", new TestUser(3)) == NULL);
+        CHECK(trie.insert("area.*.update", new TestUser(4)) == NULL);
+        CHECK(trie.insert("*", new TestUser(5)) == NULL);
+
+        CHECK(matchId(trie, "onChat") == 1);     //literal wins
+        CHECK(matchId(trie, "onXhat") == 3);     //'?' over '*'
+        CHECK(matchId(trie, "onAdd") == 2);
+        CHECK(matchId(trie, "on") == 2);         //'*' matches nothing too
+        CHECK(matchId(trie, "area.1.update") == 4);
+        CHECK(matchId(trie, "area.1.2.update") == 4);
+        CHECK(matchId(trie, "area.1.updated") == 5);
+        CHECK(matchId(trie, "") == 5);
+
+        TestUser* old = trie.insert("on*", new TestUser(6));
+        CHECK(old && old->id == 2);
+        delete old;
+        CHECK(matchId(trie, "onAdd") == 6);
+
+        TestUser* removed = trie.remove("on?hat");
+        CHECK(removed && removed->id == 3);
+        delete removed;
+        CHECK(trie.remove("on?hat") == NULL);
+        CHECK(trie.remove("o") == NULL);
+        CHECK(matchId(trie, "onXhat") == 6);
+
+        std::vector<TestUser*> users;
+        trie.clear(&users);
+        CHECK(users.size() == 4);
+        CHECK(trie.empty() && matchId(trie, "onChat") == 0);
+        for (size_t i = 0; i < users.size(); i++)
+            delete users[i];
+
+        trie.insert("x", new TestUser(7));
+    }
+    CHECK(TestUser::alive == 0);    //the destructor deletes what is left
+}
+
+//==================== pomelo protocol ====================
+static void testPackages()
+{
+    std::string wire;
+    CHECK(encodePackage(kPackageHeartbeat, "", wire));
+    CHECK(encodePackage(kPackageData, "abc", wire));
+    CHECK(wire.size() == 4 + 7);
+    CHECK(wire.compare(0, 4, std::string("\x03\0\0\0", 4)) == 0);
+    CHECK(wire.compare(4, 4, std::string("\x04\0\0\x03", 4)) == 0);
+
+    std::vector<_PomeloPackage> packages;
+    CHECK(decodePackages(wire.data(), wire.size(), packages));
+    CHECK(packages.size() == 2);
+    CHECK(packages[0].type == kPackageHeartbeat && packages[0].body.empty());
+    CHECK(packages[1].type == kPackageData && packages[1].body == "abc");
+
+    //lengths are 24 bits, big endian
+    std::string big(70000, 'x');
+    wire.clear();
+    CHECK(encodePackage(kPackageData, big, wire));
+    CHECK((unsigned char)wire[1] == 0x01 && (unsigned char)wire[2] == 0x11 && (unsigned char)wire[3] == 0x70);
+    packages.clear();
+    CHECK(decodePackages(wire.data(), wire.size(), packages) && packages[0].body == big);
+
+    //cut short
+    packages.clear();
+    CHECK(!decodePackages(wire.data(), wire.size() - 1, packages));
+    CHECK(!decodePackages(wire.data(), 3, packages));
+}
+
+static void testMessages()
+{
+    std::string wire;
+    CHECK(encodeMessage(kMessageRequest, 300, "connector.entryHandler.entry", -1, "{}", wire));
+    //flag, id 300 = 0xac 0x02, route length + route, body
+    CHECK(wire[0] == 0);
+    CHECK((unsigned char)wire[1] == 0xac && wire[2] == 0x02);
+    CHECK(wire[3] == 28 && wire.compare(4, 28, "connector.entryHandler.entry") == 0);
+
+    _PomeloMessage msg;
+    CHECK(decodeMessage(wire.data(), wire.size(), msg));
+    CHECK(msg.type == kMessageRequest && msg.id == 300 && msg.routeCode == -1);
+    CHECK(msg.route == "connector.entryHandler.entry" && msg.body == "{}");
+
+    //dictionary codes replace routes
+    wire.clear();
+    CHECK(encodeMessage(kMessagePush, 0, "onChat", 0x0102, "{\"a\":1}", wire));
+    CHECK(wire[0] == (kMessagePush << 1 | 1) && wire[1] == 1 && wire[2] == 2);
+    CHECK(decodeMessage(wire.data(), wire.size(), msg));
+    CHECK(msg.type == kMessagePush && msg.routeCode == 0x0102 && msg.route.empty() && msg.body == "{\"a\":1}");
+
+    //responses have an id and no route, notifies a route and no id
+    wire.clear();
+    CHECK(encodeMessage(kMessageResponse, 0xffffffff, "ignored", -1, "[]", wire));
+    CHECK(wire.size() == 1 + 5 + 2);
+    CHECK(decodeMessage(wire.data(), wire.size(), msg));
+    CHECK(msg.type == kMessageResponse && msg.id == 0xffffffff && msg.route.empty() && msg.body == "[]");
+    wire.clear();
+    CHECK(encodeMessage(kMessageNotify, 7, "chat.send", -1, "", wire));
+    CHECK(wire.size() == 1 + 1 + 9);
+    CHECK(decodeMessage(wire.data(), wire.size(), msg));
+    CHECK(msg.type == kMessageNotify && msg.id == 0 && msg.route == "chat.send" && msg.body.empty());
+
+    CHECK(!encodeMessage(kMessageNotify, 0, std::string(256, 'r'), -1, "", wire));
+    CHECK(!decodeMessage("\x02", 1, msg));    //route missing
+    CHECK(!decodeMessage("\x04\x80", 2, msg)); //id cut short
+    CHECK(!decodeMessage("\x16", 1, msg));    //gzip'ed
+}
+
+//==================== CCPomeloCallback ====================
+struct Counted
+{
+    Counted() { alive++; }
+    Counted(const Counted&) { alive++; }
+    ~Counted() { alive--; }
+    static int alive;
+};
+int Counted::alive = 0;
+
+struct TakeString
+{
+    explicit TakeString(int* v) : owned(v) {}
+    int operator()(std::string&& s)
+    {
+        std::string mine(std::move(s));
+        return *owned + (int)mine.size();
+    }
+    std::unique_ptr<int> owned;
+};
+
+static void testCallback()
+{
+    CCPomeloCallback<int(int)> empty;
+    CHECK(!empty);
+    CCPomeloCallback<int(int)> fromNull(nullptr);
+    CHECK(!fromNull);
+    CCPomeloCallback<int(int)> fromEmptyFunction = std::function<int(int)>();
+    CHECK(!fromEmptyFunction);
+    int (*noFunction)(int) = NULL;
+    CCPomeloCallback<int(int)> fromNullPointer(noFunction);
+    CHECK(!fromNullPointer);
+
+    //inline
+    int base = 10;
+    CCPomeloCallback<int(int)> add = [base](int v){ return base + v; };
+    CHECK(add && add(5) == 15);
+
+    //too big to be stored inline
+    char big[128] = {3};
+    CCPomeloCallback<int(int)> heap = [big](int v){ return big[0] * v; };
+    CHECK(heap(4) == 12);
+    CCPomeloCallback<int(int)> moved(std::move(heap));
+    CHECK(!heap && moved(5) == 15);
+
+    //move only callables, rvalue arguments
+    CCPomeloCallback<int(std::string&&)> take = TakeString(new int(7));
+    std::string text = "abc";
+    CHECK(take(std::move(text)) == 10);
+    CHECK(text.empty());
+
+    //captures are destroyed once, wherever they were moved
+    {
+        Counted counted;
+        CCPomeloCallback<void()> a = [counted]{};
+        CCPomeloCallback<void()> b = std::move(a);
+        CCPomeloCallback<void()> c;
+        c = std::move(b);
+        CHECK(Counted::alive == 2);
+        c = nullptr;
+        CHECK(Counted::alive == 1);
+
+        char pad[128] = {0};
+        CCPomeloCallback<void()> d = [counted, pad]{ (void)pad; };
+        CCPomeloCallback<void()> e = std::move(d);
+        CHECK(Counted::alive == 2);
+    }
+    CHECK(Counted::alive == 0);
+}
+
+int main()
+{
+    testBase64();
+    testEnvelope();
+    testEstimateSize();
+    testMergePatch();
+    testDeltaKey();
+    testOutbox();
+    testRouteTrie();
+    testPackages();
+    testMessages();
+    testCallback();
+
+    if(gFailures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", gFailures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+//
+//  CCPomeloJsonBench.cpp
+//
+//  writeJson()/readJson() against jansson on a response shaped like a game
+//  server's: a list of players with names, positions and some chat text.
+//  Build with optimizations (-DCMAKE_BUILD_TYPE=Release) before reading the numbers.
+//  快速JSON读写与jansson的性能对比。
+
+#define CCPOMELO_FAST_JSON_WRITER 1
+#define CCPOMELO_FAST_JSON_PARSER 1
+#include "CCPomeloInternal.h"
+#include <stdlib.h>
+#include <chrono>
+
+static json_t* samplePayload(int players)
+{
+    json_t* list = json_array();
+    char name[64];
+    for (int i = 0; i < players; i++)
+    {
+        json_t* player = json_object();
+        snprintf(name, sizeof(name), "player_%d", i);
+        json_object_set_new(player, "uid", json_integer(100000 + i));
+        json_object_set_new(player, "name", json_string(name));
+        json_object_set_new(player, "x", json_real(i * 1.25));
+        json_object_set_new(player, "y", json_real(i * -0.5 + 0.1));
+        json_object_set_new(player, "online", i % 3 ? json_true() : json_false());
+        json_object_set_new(player, "motto", json_string("Veni, vidi, vici. \xe6\x88\x91\xe6\x9d\xa5\xe4\xba\x86\xef\xbc\x81 \"quoted\"\n"));
+        json_t* items = json_array();
+        for (int j = 0; j < 4; j++)
+            json_array_append_new(items, json_integer(i * 4 + j));
+        json_object_set_new(player, "items", items);
+        json_array_append_new(list, player);
+    }
+    json_t* body = json_object();
+    json_object_set_new(body, "code", json_integer(200));
+    json_object_set_new(body, "players", list);
+    return body;
+}
+
+static double seconds(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void report(const char* what, size_t bytes, int rounds, double jansson, double fast)
+{
+    double mb = bytes * (double)rounds / (1024.0 * 1024.0);
+    printf("%-6s jansson %8.1f MB/s   fast %8.1f MB/s   x%.2f\n", what, mb / jansson, mb / fast, jansson / fast);
+}
+
+int main(int argc, char** argv)
+{
+    int players = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+    json_t* body = samplePayload(players);
+    std::string text;
+    writeJson(body, text);
+    printf("%d players, %lu bytes, %d rounds\n", players, (unsigned long)text.size(), rounds);
+
+    size_t sink = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+    {
+        std::string out;
+        json_dump_callback(body, appendToString, &out, JSON_COMPACT);
+        sink += out.size();
+    }
+    double janssonWrite = seconds(start);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+    {
+        std::string out;
+        writeJson(body, out);
+        sink += out.size();
+    }
+    double fastWrite = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+    {
+        json_error_t err;
+        json_t* json = json_loadb(text.data(), text.size(), 0, &err);
+        sink += json_object_size(json);
+        json_decref(json);
+    }
+    double janssonRead = seconds(start);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++)
+    {
+        json_t* json = readJson(text.data(), text.size());
+        sink += json_object_size(json);
+        json_decref(json);
+    }
+    double fastRead = seconds(start);
+
+    report("write", text.size(), rounds, janssonWrite, fastWrite);
+    report("read", text.size(), rounds, janssonRead, fastRead);
+    json_decref(body);
+    return sink ? 0 : 1;
+}
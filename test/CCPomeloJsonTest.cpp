@@ -0,0 +1,223 @@
+//
+//  CCPomeloJsonTest.cpp
+//
+//  writeJson()/readJson() against jansson: the writer must give the same
+//  text as json_dumps(JSON_COMPACT) byte for byte, the parser must build the
+//  same tree as json_loadb() and refuse the same texts.
+//  快速JSON读写与jansson的一致性测试。
+
+#define CCPOMELO_FAST_JSON_WRITER 1
+#define CCPOMELO_FAST_JSON_PARSER 1
+#include "CCPomeloInternal.h"
+#include <stdlib.h>
+
+static int gFailures = 0;
+
+#define CHECK(_COND) \
+    do { \
+        if(!(_COND)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #_COND); \
+            gFailures++; \
+        } \
+    } while(0)
+
+//xorshift, the same documents on every run
+static uint64_t gSeed = 0x9E3779B97F4A7C15ULL;
+static uint64_t next()
+{
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 7;
+    gSeed ^= gSeed << 17;
+    return gSeed;
+}
+static size_t below(size_t n)
+{
+    return (size_t)(next() % n);
+}
+
+static std::string janssonText(json_t* json)
+{
+    std::string out;
+    char* text = json_dumps(json, JSON_COMPACT | JSON_ENCODE_ANY);
+    if(text)
+    {
+        out = text;
+        free(text);
+    }
+    return out;
+}
+
+//valid UTF-8, heavy on the characters that need care
+static std::string randomString()
+{
+    static const char* pieces[] = {
+        "a", "player", " ", "\"", "\\", "/", "\b", "\f", "\n", "\r", "\t", "\x01", "\x1f", "\x7f",
+        "\xc3\xa9", "\xe4\xb8\xad\xe6\x96\x87", "\xf0\x9f\x98\x80", "\xef\xbf\xbf", "0123456789abcdef"
+    };
+    std::string s;
+    size_t n = below(12);
+    for (size_t i = 0; i < n; i++)
+        s += pieces[below(sizeof(pieces) / sizeof(pieces[0]))];
+    return s;
+}
+static json_t* randomReal()
+{
+    static const double fixed[] = {0.0, -0.0, 1.0, -1.5, 0.1, 1e300, -1e-300, 123456789012.0, 1e17, 1e16, 5e-324, 1.7976931348623157e308};
+    if(below(3) == 0)
+        return json_real(fixed[below(sizeof(fixed) / sizeof(fixed[0]))]);
+
+    double v;
+    do
+    {
+        uint64_t bits = next();
+        memcpy(&v, &bits, sizeof(v));
+    } while (v != v || v - v != 0);    //no NaN or infinity in JSON
+    return json_real(v);
+}
+static json_t* randomValue(int depth)
+{
+    switch (below(depth > 4 ? 6 : 8))
+    {
+        case 0: return json_string(randomString().c_str());
+        case 1: return json_integer((json_int_t)next() >> below(64));
+        case 2: return randomReal();
+        case 3: return json_true();
+        case 4: return json_false();
+        case 5: return json_null();
+        case 6:
+        {
+            json_t* json = json_object();
+            size_t n = below(6);
+            for (size_t i = 0; i < n; i++)
+                json_object_set_new(json, randomString().c_str(), randomValue(depth + 1));
+            return json;
+        }
+        default:
+        {
+            json_t* json = json_array();
+            size_t n = below(6);
+            for (size_t i = 0; i < n; i++)
+                json_array_append_new(json, randomValue(depth + 1));
+            return json;
+        }
+    }
+}
+
+//both parsers agree on text: both refuse it, or both build the same tree
+static bool sameParse(const std::string& text)
+{
+    json_error_t err;
+    json_t* expected = json_loadb(text.data(), text.size(), 0, &err);
+    json_t* actual = readJson(text.data(), text.size());
+    bool same = (expected == NULL) == (actual == NULL);
+    if(same && expected)
+        same = json_equal(expected, actual) && janssonText(expected) == janssonText(actual);
+    if(!same)
+        fprintf(stderr, "parsers disagree on %s (jansson: %s)\n", text.c_str(), expected ? "ok" : err.text);
+    json_decref(actual);
+    json_decref(expected);
+    return same;
+}
+
+static void testWriter()
+{
+    for (int i = 0; i < 3000; i++)
+    {
+        json_t* json = randomValue(0);
+        std::string out;
+        writeJson(json, out);
+        CHECK(out == janssonText(json));
+        json_decref(json);
+    }
+}
+static void testParser()
+{
+    for (int i = 0; i < 3000; i++)
+    {
+        json_t* json = below(2) ? json_array() : json_object();
+        if(json_is_array(json))
+            json_array_append_new(json, randomValue(0));
+        else
+            json_object_set_new(json, "k", randomValue(0));
+        std::string text;
+        writeJson(json, text);
+        CHECK(sameParse(text));
+
+        //and mangled: bytes replaced, dropped, doubled, cut off
+        static const char noise[] = "{}[]\",:\\/ubfnrt0123456789.eE+- \t\xc3\xa9\xed\xa0\x80\xff";
+        for (int j = 0; j < 8 && !text.empty(); j++)
+        {
+            std::string bad = text;
+            size_t at = below(bad.size());
+            switch (below(4))
+            {
+                case 0: bad[at] = noise[below(sizeof(noise) - 1)]; break;
+                case 1: bad.erase(at, 1); break;
+                case 2: bad.insert(at, 1, bad[at]); break;
+                default: bad.resize(at); break;
+            }
+            CHECK(sameParse(bad));
+        }
+        json_decref(json);
+    }
+}
+static void testParserEdges()
+{
+    static const char* texts[] = {
+        "{}", "[]", " \t\r\n[ ] \n", "{} x", "\"top\"", "1", "true", "", " ",
+        "[1.]", "[.5]", "[01]", "[-]", "[-0]", "[-0.0]", "[1e]", "[1e+]", "[1E-2]", "[2e308]", "[1e-400]",
+        "[9223372036854775807]", "[9223372036854775808]", "[-9223372036854775808]", "[-9223372036854775809]",
+        "[123456789012345678]", "[1234567890123456789]", "[000]", "[+1]", "[0x10]", "[Infinity]", "[NaN]",
+        "[true,false,null]", "[tru]", "[truex]", "[nul]", "[True]",
+        "{\"a\":1,}", "[1,]", "[,1]", "{\"a\" 1}", "{\"a\":}", "{a:1}", "{\"a\":1,\"a\":2}", "{\"\":0}",
+        "[\"\\u0000\"]", "[\"\\u0041\\u00e9\\u4e2d\"]", "[\"\\uD83D\\uDE00\"]", "[\"\\uD800\"]", "[\"\\uDC00\"]",
+        "[\"\\uD800\\u0041\"]", "[\"\\uD800\\\"]", "[\"\\u12\"]", "[\"\\u12G4\"]", "[\"\\x\"]", "[\"\\'\"]",
+        "[\"\\/\\b\\f\\n\\r\\t\\\"\\\\\"]", "[\"tab\there\"]", "[\"unterminated]", "[\"\\",
+        "[\"\xc3\xa9\"]", "[\"\xc0\x80\"]", "[\"\xc1\xbf\"]", "[\"\xe0\x80\x80\"]", "[\"\xed\xa0\x80\"]",
+        "[\"\xf4\x8f\xbf\xbf\"]", "[\"\xf4\x90\x80\x80\"]", "[\"\xf5\x80\x80\x80\"]", "[\"\xe4\xb8\"]", "[\"\x80\"]",
+        "[\"0123456789abcdef0123456789abcdef\"]", "[\"0123456789abcdef\\n0123456789\xe4\xb8\xad\"]",
+    };
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+        CHECK(sameParse(texts[i]));
+
+    CHECK(sameParse(std::string("[1]\0", 4)));
+    CHECK(sameParse(std::string("[\"a\0b\"]", 7)));
+
+    //jansson's depth limit
+    for (int depth = 2040; depth < 2056; depth++)
+    {
+        std::string deep(depth, '[');
+        deep += std::string(depth, ']');
+        CHECK(sameParse(deep));
+        deep = std::string(depth, '[') + "1" + std::string(depth, ']');
+        CHECK(sameParse(deep));
+    }
+}
+static void testLoadJson()
+{
+    json_t* json = loadJson("{\"route\":\"area.playerHandler.move\",\"x\":1.5}");
+    CHECK(json_is_object(json));
+    CHECK(json_real_value(json_object_get(json, "x")) == 1.5);
+    std::string out;
+    dumpJson(json, out);
+    CHECK(out == "{\"route\":\"area.playerHandler.move\",\"x\":1.5}");
+    json_decref(json);
+    CHECK(loadJson("not json") == NULL);
+}
+
+int main()
+{
+    testWriter();
+    testParser();
+    testParserEdges();
+    testLoadJson();
+
+    if(gFailures)
+    {
+        fprintf(stderr, "%d check(s) failed\n", gFailures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
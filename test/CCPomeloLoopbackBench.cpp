@@ -0,0 +1,114 @@
+//
+//  CCPomeloLoopbackBench.cpp
+//
+//  Dispatch throughput over the loopback transport, no socket in between:
+//  requests answered on cocos thread and on the network thread, then pushes.
+//  Needs cocos2d-x 3.x and libpomelo, see CMakeLists.txt.
+//  通过进程内模拟服务器测试派发吞吐量（不经过socket）。
+//
+//  CCPomeloLoopbackBench [messages] [window]
+
+#include "CCPomeloWrapper.h"
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+
+USING_NS_CC;
+
+class EchoServer : public CCPomeloLoopbackServer
+{
+public:
+    virtual std::string onRequest(const std::string&, const std::string& msg)
+    {
+        return msg;
+    }
+};
+
+static const char* kBody = "{\"uid\":100042,\"name\":\"player_42\",\"x\":1.25,\"y\":-0.5,\"items\":[1,2,3,4]}";
+
+//one frame of the game loop, the dispatcher runs from here
+static void frame()
+{
+    Director::getInstance()->getScheduler()->update(1.0f / 60);
+}
+
+static double seconds(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+//messages requests, at most window of them in flight
+static bool requests(int messages, int window, bool onNetworkThread)
+{
+    CCPomeloWrapper* pomelo = CCPomeloWrapper::getInstance();
+    std::atomic<int> answered(0);
+    std::atomic<int> failed(0);
+    int sent = 0;
+    int frames = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (answered.load() < messages)
+    {
+        while (sent < messages && sent - answered.load() < window)
+        {
+            int ret = pomelo->request("bench.echo", kBody, [&](CCPomeloRequestResult&& result) {
+                if(result.status != 0)
+                    failed++;
+                answered++;
+            }, onNetworkThread);
+            if(ret != 0)
+                return false;
+            sent++;
+        }
+        frame();
+        frames++;
+    }
+    double elapsed = seconds(start);
+    printf("requests (%s): %.0f/s, %d frames%s\n", onNetworkThread ? "network thread" : "cocos thread",
+           messages / elapsed, frames, failed.load() ? ", some failed" : "");
+    return failed.load() == 0;
+}
+
+static bool pushes(EchoServer& server, int messages)
+{
+    CCPomeloWrapper* pomelo = CCPomeloWrapper::getInstance();
+    int received = 0;
+    pomelo->addListener("onBench", [&](CCPomeloEvent&&) { received++; });
+
+    int frames = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++)
+    {
+        if(server.push("onBench", kBody) != 0)
+            return false;
+    }
+    while (received < messages)
+    {
+        frame();
+        frames++;
+    }
+    double elapsed = seconds(start);
+    printf("pushes: %.0f/s, %d frames\n", messages / elapsed, frames);
+    pomelo->removeListener("onBench");
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int messages = argc > 1 ? atoi(argv[1]) : 100000;
+    int window = argc > 2 ? atoi(argv[2]) : 1000;
+
+    EchoServer server;
+    CCPomeloWrapper* pomelo = CCPomeloWrapper::getInstance();
+    pomelo->setLoopbackServer(&server);
+    if(pomelo->connect("loopback", 0) != 0)
+    {
+        fprintf(stderr, "loopback connect failed\n");
+        return 1;
+    }
+
+    bool ok = requests(messages, window, false) && requests(messages, window, true) && pushes(server, messages);
+
+    pomelo->stop();
+    pomelo->setLoopbackServer(NULL);
+    return ok ? 0 : 1;
+}
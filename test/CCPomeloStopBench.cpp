@@ -0,0 +1,79 @@
+//
+//  CCPomeloStopBench.cpp
+//
+//  connect()/connectAsnyc()/stop() in a tight loop against a real server,
+//  half of the attempts cancelled while still connecting. Checks that the
+//  orphaned clients are all reaped and reports the cycles per second.
+//  Needs cocos2d-x 3.x and libpomelo, see CMakeLists.txt.
+//  连接/断开的压力测试：一半的异步连接在连接过程中被stop()取消。
+//
+//  CCPomeloStopBench [host] [port] [cycles]
+
+#include "CCPomeloWrapper.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+
+USING_NS_CC;
+
+//one frame of the game loop, the dispatcher runs from here
+static void frame()
+{
+    Director::getInstance()->getScheduler()->update(1.0f / 60);
+    usleep(1000);
+}
+
+int main(int argc, char** argv)
+{
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 3010;
+    int cycles = argc > 3 ? atoi(argv[3]) : 1000;
+
+    CCPomeloWrapper* pomelo = CCPomeloWrapper::getInstance();
+    int connected = 0;
+    int answered = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < cycles; i++)
+    {
+        switch (i % 4)
+        {
+            case 0:     //blocking connect
+                if(pomelo->connect(host, port) == 0)
+                    connected++;
+                break;
+            case 1:     //cancelled while connecting, leaves an orphan
+                pomelo->connectAsnyc(host, port, [&](int) { answered++; });
+                break;
+            case 2:     //cancelled a few frames in
+                pomelo->connectAsnyc(host, port, [&](int) { answered++; });
+                for (int f = 0; f < 3; f++)
+                    frame();
+                break;
+            default:    //waited for
+            {
+                int before = answered;
+                pomelo->connectAsnyc(host, port, [&](int status) { answered++; connected += status == 0; });
+                for (int f = 0; f < 5000 && answered == before; f++)
+                    frame();
+                break;
+            }
+        }
+        pomelo->stop();
+        if(pomelo->status() != EPomeloStopped)
+        {
+            fprintf(stderr, "cycle %d: not stopped after stop()\n", i);
+            return 1;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    //orphans still connecting are reaped by the next connect() or the dispatcher
+    pomelo->connect(host, port);
+    for (int f = 0; f < 1000; f++)
+        frame();
+    pomelo->stop();
+
+    printf("%d cycles in %.2f s (%.0f/s), %d connected, %d async callbacks\n",
+           cycles, seconds, cycles / seconds, connected, answered);
+    return 0;
+}
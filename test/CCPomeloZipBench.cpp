@@ -0,0 +1,87 @@
+//
+//  CCPomeloZipBench.cpp
+//
+//  What the body envelope costs and saves: for responses of growing size,
+//  bytes on the wire raw vs as {"__zip":...,"__len":...} and the time to
+//  pack (sender) and unpack (libpomelo thread) one body.
+//  Build with optimizations (-DCMAKE_BUILD_TYPE=Release) before reading the numbers.
+//  压缩信封的开销与收益：不同大小的消息在线上的字节数，以及压缩、解压一次的耗时。
+
+#include "CCPomeloInternal.h"
+#include <stdlib.h>
+#include <chrono>
+
+//a leaderboard-like list, repetitive the way real responses are
+static std::string sampleText(int players)
+{
+    json_t* list = json_array();
+    char name[64];
+    for (int i = 0; i < players; i++)
+    {
+        json_t* player = json_object();
+        snprintf(name, sizeof(name), "player_%d", i * 7919 % 100000);
+        json_object_set_new(player, "uid", json_integer(100000 + i * 7919 % 100000));
+        json_object_set_new(player, "name", json_string(name));
+        json_object_set_new(player, "score", json_integer(1000000 - i * 37));
+        json_object_set_new(player, "level", json_integer(1 + i % 60));
+        json_object_set_new(player, "guild", json_string(i % 3 ? "Knights" : "Ravens"));
+        json_array_append_new(list, player);
+    }
+    json_t* body = json_object();
+    json_object_set_new(body, "code", json_integer(200));
+    json_object_set_new(body, "players", list);
+    std::string text;
+    dumpJson(body, text);
+    json_decref(body);
+    return text;
+}
+
+static double seconds(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+int main(int argc, char** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    static const int players[] = {2, 8, 32, 128, 512, 2048, 8192};
+
+    printf("%10s %10s %7s %12s %12s\n", "raw", "wire", "ratio", "zip us", "unzip us");
+    for (size_t i = 0; i < sizeof(players) / sizeof(players[0]); i++)
+    {
+        std::string raw = sampleText(players[i]);
+        json_t* envelope = zipBody(raw.data(), raw.size());
+        if(!envelope)
+        {
+            //not worth it, the body goes out as is
+            printf("%10lu %10lu %7.2f %12s %12s\n", (unsigned long)raw.size(), (unsigned long)raw.size(), 1.0, "-", "-");
+            continue;
+        }
+        std::string wire;
+        dumpJson(envelope, wire);
+
+        size_t sink = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            json_t* packed = zipBody(raw.data(), raw.size());
+            sink += json_object_size(packed);
+            json_decref(packed);
+        }
+        double zip = seconds(start) / rounds;
+
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++)
+        {
+            std::string out;
+            if(unzipBody(envelope, out))
+                sink += out.size();
+        }
+        double unzip = seconds(start) / rounds;
+
+        printf("%10lu %10lu %7.2f %12.1f %12.1f%s\n", (unsigned long)raw.size(), (unsigned long)wire.size(),
+               (double)wire.size() / raw.size(), zip * 1e6, unzip * 1e6, sink ? "" : " ?");
+        json_decref(envelope);
+    }
+    return 0;
+}